@@ -0,0 +1,595 @@
+#define _GNU_SOURCE // pthread_setaffinity_np()
+
+#include "Batch.h"
+#include "Block.h"
+#include "Devices.h"
+#include "Elf.h"
+#include "Jit.h"
+#include "Lockstep.h"
+#include "Parser.h"
+#include "Registers.h"
+#include "Threaded.h"
+#include "Tiered.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUMMARY_REGS 32 // x0 to x31
+
+typedef struct Batch_Engine
+{
+    const char *name;
+    bool (*tick)(Core *core);
+} Batch_Engine;
+
+static const Batch_Engine ENGINES[] = {
+    { "interp", tickFunc },
+    { "block", blockTickFunc },
+    { "threaded", runThreaded },
+    { "jit", runJit },
+    { "tiered", runTiered },
+    { "lockstep", NULL }, // No tick, runLockstep() takes up to LOCKSTEP_LANES jobs at once
+};
+#define NUM_ENGINES (sizeof(ENGINES) / sizeof(ENGINES[0]))
+
+typedef enum Batch_Status
+{
+    JOB_FINISHED, // Ran off the end of the program
+    JOB_STOPPED, // Reached its cycles= limit
+    JOB_EXITED, // Wrote the exit register
+    JOB_FAULT, // Touched flat memory out of range
+    JOB_REJECTED // Asked for a combination RVSim would refuse too
+} Batch_Status;
+
+static const char *STATUS_NAME[] = { "finished", "stopped", "exited", "fault", "rejected" };
+
+// A program loaded once and shared by every job that runs it
+typedef struct Batch_Program Batch_Program;
+typedef struct Batch_Program
+{
+    char *path;
+    Instruction_Memory i_mem;
+    Elf_Image *elf; // NULL when the program is a text trace
+    struct Batch_Group *lockstep_group; // Where its next lockstep job goes, NULL once that's full
+} Batch_Program;
+
+// Initial state on top of what the program sets up, a register or a doubleword of memory
+typedef struct Batch_Init
+{
+    bool reg;
+    Addr where;
+    uint64_t value;
+} Batch_Init;
+
+typedef struct Batch_Job Batch_Job;
+typedef struct Batch_Job
+{
+    size_t line;
+    Batch_Program *program;
+    unsigned engine;
+    unsigned hot_threshold;
+    Tick clk_limit;
+    Batch_Init *inits; // In the batch's inits, set once the whole manifest is read
+    size_t first_init;
+    size_t num_inits;
+
+    // Filled in by whichever worker ran it
+    Batch_Status status;
+    Tick clk;
+    Addr PC;
+    Addr fault_addr;
+    int64_t exit_status;
+    uint64_t regs[SUMMARY_REGS];
+    char *console; // UART output with -M, NULL otherwise
+    size_t console_len;
+    double seconds;
+} Batch_Job;
+
+// What a worker takes at once: a single job, or up to LOCKSTEP_LANES
+// lockstep jobs of one program, in manifest order
+typedef struct Batch_Group Batch_Group;
+typedef struct Batch_Group
+{
+    size_t jobs[LOCKSTEP_LANES];
+    unsigned num_jobs;
+} Batch_Group;
+
+typedef struct Batch Batch;
+typedef struct Batch
+{
+    const Batch_Config *config;
+    Batch_Job *jobs;
+    size_t num_jobs;
+    Batch_Init *inits; // Every job's, one after the other in manifest order
+    size_t num_inits;
+    size_t inits_cap;
+    Batch_Group *groups;
+    size_t num_groups;
+    atomic_size_t next; // Next group a worker takes
+    int cpus[CPU_SETSIZE]; // The CPUs we may run on, for pinning
+    unsigned num_cpus;
+} Batch;
+
+typedef struct Batch_Worker
+{
+    Batch *batch;
+    unsigned index;
+} Batch_Worker;
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static Batch_Program *findProgram(Batch_Program ***programs, size_t *num_programs, const char *path)
+{
+    // Loaded the first time a job names it, in manifest order
+    for(size_t i = 0; i < *num_programs; i++)
+    {
+        if(strcmp((*programs)[i]->path, path) == 0)
+            return (*programs)[i];
+    }
+
+    Batch_Program *program = (Batch_Program *)malloc(sizeof(Batch_Program));
+    program->path = strdup(path);
+    initInstructionMemory(&program->i_mem);
+    program->lockstep_group = NULL;
+    program->elf = openElf(path);
+    if(program->elf != NULL)
+        elfLoadText(program->elf, &program->i_mem);
+    else
+        loadInstructions(&program->i_mem, path);
+
+    *programs = (Batch_Program **)realloc(*programs, (*num_programs + 1) * sizeof(Batch_Program *));
+    (*programs)[(*num_programs)++] = program;
+    return program;
+}
+
+static void parseOption(Batch *batch, Batch_Job *job, const char *manifest, char *option)
+{
+    char *value = strchr(option, '=');
+    if(value == NULL)
+    {
+        fprintf(stderr, "%s:%zu: '%s' is not <key>=<value>\n", manifest, job->line, option);
+        exit(EXIT_FAILURE);
+    }
+    *value++ = '\0';
+
+    char *end;
+    if(strcmp(option, "engine") == 0)
+    {
+        for(job->engine = 0; job->engine < NUM_ENGINES; job->engine++)
+        {
+            if(strcmp(ENGINES[job->engine].name, value) == 0)
+                return;
+        }
+        fprintf(stderr, "%s:%zu: unknown engine '%s'\n", manifest, job->line, value);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t number = strtoull(value, &end, 0);
+    if(*value == '\0' || *end != '\0')
+    {
+        fprintf(stderr, "%s:%zu: '%s' is not a number\n", manifest, job->line, value);
+        exit(EXIT_FAILURE);
+    }
+
+    Batch_Init init;
+    int reg;
+    if(strcmp(option, "hot") == 0)
+    {
+        job->hot_threshold = number;
+        return;
+    }
+    else if(strcmp(option, "cycles") == 0)
+    {
+        job->clk_limit = number;
+        return;
+    }
+    else if(strncmp(option, "mem[", 4) == 0)
+    {
+        init.reg = false;
+        init.where = strtoull(option + 4, &end, 0);
+        if(end == option + 4 || strcmp(end, "]") != 0)
+        {
+            fprintf(stderr, "%s:%zu: '%s' is not mem[<addr>]\n", manifest, job->line, option);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if((reg = regIndex(option, strlen(option))) > 0)
+    {
+        init.reg = true;
+        init.where = reg;
+    }
+    else
+    {
+        fprintf(stderr, "%s:%zu: unknown option '%s'\n", manifest, job->line, option);
+        exit(EXIT_FAILURE);
+    }
+
+    init.value = number;
+    if(batch->num_inits == batch->inits_cap)
+    {
+        batch->inits_cap = batch->inits_cap != 0 ? batch->inits_cap * 2 : 64;
+        batch->inits = (Batch_Init *)realloc(batch->inits, batch->inits_cap * sizeof(Batch_Init));
+    }
+    batch->inits[batch->num_inits++] = init;
+    job->num_inits++;
+}
+
+static void readManifest(Batch *batch, const char *manifest, Batch_Program ***programs, size_t *num_programs)
+{
+    FILE *file = fopen(manifest, "r");
+    if(file == NULL)
+    {
+        perror(manifest);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned default_engine = 0;
+    while(default_engine < NUM_ENGINES && ENGINES[default_engine].tick != batch->config->tick)
+        default_engine++;
+
+    char *text = NULL;
+    size_t text_size = 0;
+    size_t jobs_cap = 0;
+    for(size_t line = 1; getline(&text, &text_size, file) != -1; line++)
+    {
+        // # starts a comment, a line with nothing else on it isn't a job
+        char *comment = strchr(text, '#');
+        if(comment != NULL)
+            *comment = '\0';
+        char *save;
+        char *path = strtok_r(text, " \t\r\n", &save);
+        if(path == NULL)
+            continue;
+
+        if(batch->num_jobs == jobs_cap)
+        {
+            jobs_cap = jobs_cap != 0 ? jobs_cap * 2 : 64;
+            batch->jobs = (Batch_Job *)realloc(batch->jobs, jobs_cap * sizeof(Batch_Job));
+        }
+        Batch_Job *job = &batch->jobs[batch->num_jobs++];
+        memset(job, 0, sizeof(Batch_Job));
+        job->line = line;
+        job->engine = default_engine;
+        job->hot_threshold = batch->config->hot_threshold;
+        job->clk_limit = NO_CLK_LIMIT;
+        job->first_init = batch->num_inits;
+        for(char *option = strtok_r(NULL, " \t\r\n", &save); option != NULL; option = strtok_r(NULL, " \t\r\n", &save))
+            parseOption(batch, job, manifest, option);
+
+        // Options first, a bad one fails before anything is parsed
+        job->program = findProgram(programs, num_programs, path);
+    }
+    free(text);
+    fclose(file);
+
+    // The inits have stopped moving
+    for(size_t i = 0; i < batch->num_jobs; i++)
+        batch->jobs[i].inits = batch->inits + batch->jobs[i].first_init;
+}
+
+static void groupJobs(Batch *batch)
+{
+    // Lockstep jobs share a group with the ones before them for the same
+    // program until it has a job for every lane
+    batch->groups = (Batch_Group *)malloc(batch->num_jobs * sizeof(Batch_Group));
+    for(size_t i = 0; i < batch->num_jobs; i++)
+    {
+        Batch_Job *job = &batch->jobs[i];
+        Batch_Group *group = ENGINES[job->engine].tick == NULL ? job->program->lockstep_group : NULL;
+        if(group == NULL)
+        {
+            group = &batch->groups[batch->num_groups++];
+            group->num_jobs = 0;
+        }
+        group->jobs[group->num_jobs++] = i;
+        if(ENGINES[job->engine].tick == NULL)
+            job->program->lockstep_group = group->num_jobs < LOCKSTEP_LANES ? group : NULL;
+    }
+}
+
+static Core *initWorkerCore(const Batch_Config *config, Instruction_Memory *i_mem)
+{
+    // Set up the way RVSim would for a single run, reused for every job after that
+    Core *core = initCore(i_mem);
+    if(config->huge_pages || config->flat_size != 0)
+    {
+        freeMemory(core->data_mem);
+        core->data_mem = config->flat_size != 0 ? initFlatMemory(config->flat_size) : initMemory(true);
+    }
+    core->unified = config->unified;
+    resetCore(core);
+    if(config->devices && (core->devices = initDevices(core->data_mem, &core->clk, NULL)) == NULL)
+    {
+        fprintf(stderr, "Cannot map devices at %#lx\n", UART_BASE);
+        exit(EXIT_FAILURE);
+    }
+    return core;
+}
+
+static void runJob(Core *core, Batch_Job *job)
+{
+    Batch_Program *program = job->program;
+    if(core->unified && ENGINES[job->engine].tick == runThreaded)
+    {
+        job->status = JOB_REJECTED;
+        return;
+    }
+
+    if(core->instr_mem != &program->i_mem)
+    {
+        // Everything decoded or found belongs to the last program
+        core->instr_mem = &program->i_mem;
+        flushDecoded(core);
+    }
+    resetCore(core);
+    if(program->elf != NULL)
+    {
+        elfMapSegments(program->elf, core->data_mem);
+        core->PC = program->elf->entry;
+        core->reg_file[2] = elfStackTop(core->data_mem);
+    }
+    else if(core->unified)
+        storeProgram(core);
+
+    for(size_t i = 0; i < job->num_inits; i++)
+    {
+        Batch_Init *init = &job->inits[i];
+        if(init->reg)
+            core->reg_file[init->where] = init->value;
+        else
+            memWriteBytes(core->data_mem, init->where, &init->value, sizeof(init->value));
+    }
+    core->tick = ENGINES[job->engine].tick;
+    core->hot_threshold = job->hot_threshold;
+    core->clk_limit = job->clk_limit;
+
+    FILE *console = NULL;
+    if(core->devices != NULL)
+        core->devices->console = console = open_memstream(&job->console, &job->console_len);
+
+    double start = now();
+    bool ran = runCore(core);
+    job->seconds = now() - start;
+
+    if(console != NULL)
+        fclose(console);
+    if(!ran)
+    {
+        job->status = JOB_FAULT;
+        job->fault_addr = memFaultAddr();
+    }
+    else if(core->devices != NULL && core->devices->exited)
+    {
+        job->status = JOB_EXITED;
+        job->exit_status = core->devices->exit_status;
+    }
+    else
+        job->status = core->PC > program->i_mem.last_addr || program->i_mem.num_instrs == 0 ? JOB_FINISHED : JOB_STOPPED;
+    job->clk = core->clk;
+    job->PC = core->PC;
+    memcpy(job->regs, core->reg_file, sizeof(job->regs));
+}
+
+static void runLockstepGroup(Lockstep *lockstep, Batch *batch, Batch_Group *group)
+{
+    // Each job is one lane, set up the way runJob() sets up a core
+    const Batch_Config *config = batch->config;
+    Batch_Program *program = batch->jobs[group->jobs[0]].program;
+    if(config->flat_size != 0 || config->unified || config->devices)
+    {
+        // Lanes can't fault, patch the code they all share or own a device page
+        for(unsigned lane = 0; lane < group->num_jobs; lane++)
+            batch->jobs[group->jobs[lane]].status = JOB_REJECTED;
+        return;
+    }
+
+    Core *core = lockstep->core;
+    if(core->instr_mem != &program->i_mem)
+    {
+        core->instr_mem = &program->i_mem;
+        flushDecoded(core);
+    }
+    lockstep->num_lanes = group->num_jobs;
+    resetLockstep(lockstep);
+    for(unsigned lane = 0; lane < group->num_jobs; lane++)
+    {
+        Batch_Job *job = &batch->jobs[group->jobs[lane]];
+        if(program->elf != NULL)
+        {
+            elfMapSegments(program->elf, lockstep->data_mem[lane]);
+            lockstep->PC[lane] = program->elf->entry;
+            lockstep->reg[2][lane] = elfStackTop(lockstep->data_mem[lane]);
+        }
+        for(size_t i = 0; i < job->num_inits; i++)
+        {
+            Batch_Init *init = &job->inits[i];
+            if(init->reg)
+                lockstep->reg[init->where][lane] = init->value;
+            else
+                memWriteBytes(lockstep->data_mem[lane], init->where, &init->value, sizeof(init->value));
+        }
+        lockstep->clk_limit[lane] = job->clk_limit;
+    }
+
+    double start = now();
+    runLockstep(lockstep);
+    double seconds = now() - start;
+
+    for(unsigned lane = 0; lane < group->num_jobs; lane++)
+    {
+        Batch_Job *job = &batch->jobs[group->jobs[lane]];
+        job->clk = lockstep->clk[lane];
+        job->PC = lockstep->PC[lane];
+        job->status = job->PC > program->i_mem.last_addr || program->i_mem.num_instrs == 0 ? JOB_FINISHED : JOB_STOPPED;
+        job->seconds = seconds;
+        for(unsigned r = 0; r < SUMMARY_REGS; r++)
+            job->regs[r] = lockstep->reg[r][lane];
+    }
+}
+
+static void *batchWorker(void *arg)
+{
+    Batch_Worker *worker = (Batch_Worker *)arg;
+    Batch *batch = worker->batch;
+    if(batch->config->pin && batch->num_cpus != 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(batch->cpus[worker->index % batch->num_cpus], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    // Created for the first job this worker takes, so it starts on the worker's CPU,
+    // and reused for every job after that. What's left to allocate per job is
+    // guest pages and what the engines build as the code runs; malloc gives
+    // each worker thread an arena of its own for those.
+    Core *core = NULL;
+    Lockstep *lockstep = NULL;
+    for(size_t i = atomic_fetch_add(&batch->next, 1); i < batch->num_groups; i = atomic_fetch_add(&batch->next, 1))
+    {
+        Batch_Group *group = &batch->groups[i];
+        Batch_Job *job = &batch->jobs[group->jobs[0]];
+        if(ENGINES[job->engine].tick == NULL)
+        {
+            if(lockstep == NULL)
+                lockstep = initLockstep(&job->program->i_mem, LOCKSTEP_LANES, batch->config->huge_pages);
+            runLockstepGroup(lockstep, batch, group);
+            continue;
+        }
+        if(core == NULL)
+            core = initWorkerCore(batch->config, &job->program->i_mem);
+        runJob(core, job);
+    }
+    if(core != NULL)
+        freeCore(core);
+    if(lockstep != NULL)
+        freeLockstep(lockstep);
+    return NULL;
+}
+
+static void writeString(FILE *out, const char *text, size_t len)
+{
+    fputc('"', out);
+    for(size_t i = 0; i < len; i++)
+    {
+        unsigned char c = text[i];
+        if(c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if(c == '\n')
+            fputs("\\n", out);
+        else if(c < 0x20 || c >= 0x7F)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void writeSummary(FILE *out, Batch *batch, unsigned num_workers, double seconds)
+{
+    // One JSON object, jobs in manifest order
+    Tick instrs = 0;
+    for(size_t i = 0; i < batch->num_jobs; i++)
+        instrs += batch->jobs[i].clk;
+
+    fprintf(out, "{\n  \"jobs\": %zu,\n  \"workers\": %u,\n  \"seconds\": %.6f,\n", batch->num_jobs, num_workers, seconds);
+    fprintf(out, "  \"instructions\": %lu,\n  \"mips\": %.3f,\n  \"results\": [", instrs, seconds > 0 ? instrs / seconds / 1e6 : 0.0);
+    for(size_t i = 0; i < batch->num_jobs; i++)
+    {
+        Batch_Job *job = &batch->jobs[i];
+        fprintf(out, "%s\n    {\"line\": %zu, \"program\": ", i == 0 ? "" : ",", job->line);
+        writeString(out, job->program->path, strlen(job->program->path));
+        fprintf(out, ", \"engine\": \"%s\", \"status\": \"%s\"", ENGINES[job->engine].name, STATUS_NAME[job->status]);
+        if(job->status == JOB_REJECTED)
+        {
+            fputc('}', out);
+            continue;
+        }
+
+        fprintf(out, ", \"cycles\": %lu, \"pc\": %lu, \"seconds\": %.6f", job->clk, job->PC, job->seconds);
+        if(job->status == JOB_FAULT)
+            fprintf(out, ", \"fault_addr\": %lu", job->fault_addr);
+        if(job->status == JOB_EXITED)
+            fprintf(out, ", \"exit_status\": %ld", job->exit_status);
+        if(job->console != NULL)
+        {
+            fprintf(out, ", \"console\": ");
+            writeString(out, job->console, job->console_len);
+        }
+        fprintf(out, ", \"regs\": [");
+        for(unsigned r = 0; r < SUMMARY_REGS; r++)
+            fprintf(out, "%s%ld", r == 0 ? "" : ", ", (int64_t)job->regs[r]);
+        fprintf(out, "]}");
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+size_t runBatch(const char *manifest, const Batch_Config *config, FILE *summary)
+{
+    // Returns how many jobs faulted or were rejected
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.config = config;
+    Batch_Program **programs = NULL;
+    size_t num_programs = 0;
+    readManifest(&batch, manifest, &programs, &num_programs);
+    groupJobs(&batch);
+
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if(CPU_ISSET(cpu, &allowed))
+                batch.cpus[batch.num_cpus++] = cpu;
+        }
+    }
+
+    unsigned num_workers = config->workers != 0 ? config->workers : sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_workers > batch.num_groups)
+        num_workers = batch.num_groups;
+    pthread_t *threads = (pthread_t *)malloc(num_workers * sizeof(pthread_t));
+    Batch_Worker *workers = (Batch_Worker *)malloc(num_workers * sizeof(Batch_Worker));
+
+    double start = now();
+    atomic_store(&batch.next, 0);
+    for(unsigned t = 0; t < num_workers; t++)
+    {
+        workers[t].batch = &batch;
+        workers[t].index = t;
+        pthread_create(&threads[t], NULL, batchWorker, &workers[t]);
+    }
+    for(unsigned t = 0; t < num_workers; t++)
+        pthread_join(threads[t], NULL);
+    writeSummary(summary, &batch, num_workers, now() - start);
+
+    size_t failed = 0;
+    for(size_t i = 0; i < batch.num_jobs; i++)
+    {
+        failed += batch.jobs[i].status == JOB_FAULT || batch.jobs[i].status == JOB_REJECTED;
+        free(batch.jobs[i].console);
+    }
+    free(batch.jobs);
+    free(batch.inits);
+    free(batch.groups);
+    for(size_t i = 0; i < num_programs; i++)
+    {
+        free(programs[i]->path);
+        freeInstructionMemory(&programs[i]->i_mem);
+        if(programs[i]->elf != NULL)
+            closeElf(programs[i]->elf);
+        free(programs[i]);
+    }
+    free(programs);
+    free(threads);
+    free(workers);
+    return failed;
+}
@@ -0,0 +1,35 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stdio.h>
+
+#include "Core.h"
+
+// Batch mode runs one job per manifest line on a fixed pool of worker threads:
+//
+//   <trace or ELF> [engine=interp|block|threaded|jit|tiered|lockstep] [hot=<n>] [cycles=<n>] [<reg>=<value>]... [mem[<addr>]=<value>]...
+//
+// Each distinct program is loaded once, up front, and shared read-only by the
+// workers. Each worker keeps one Core, with its decode cache, blocks and data
+// memory, and resets it between jobs instead of allocating another.
+// Everything the flags set applies to every job, engine= and hot= override
+// the engine flags for one job, and cycles= stops it between ticks.
+// engine=lockstep jobs of the same program are run together, up to
+// LOCKSTEP_LANES at a time, one lane each (see Lockstep.h); they're rejected
+// with -F, -U and -M.
+typedef struct Batch_Config Batch_Config;
+typedef struct Batch_Config
+{
+    bool (*tick)(Core *core);
+    unsigned hot_threshold;
+    bool huge_pages;
+    size_t flat_size;
+    bool unified;
+    bool devices; // A job's UART output goes into the summary
+    unsigned workers; // 0 for one per online CPU
+    bool pin; // Worker n runs only on the n-th CPU we're allowed on
+} Batch_Config;
+
+size_t runBatch(const char *manifest, const Batch_Config *config, FILE *summary);
+
+#endif
@@ -0,0 +1,202 @@
+#include "Block.h"
+
+bool endsBlock(DecodedInstruction *decoded)
+{
+    ControlSignals *ctrl = &decoded->ctrl;
+    return ctrl->beq || ctrl->bne || ctrl->blt || ctrl->bge || ctrl->jal || ctrl->jalr;
+}
+
+Block_Map *initBlocks(Core *core)
+{
+    // Only the directory, pages are filled in as they are looked up
+    Block_Map *map = (Block_Map *)calloc(1, sizeof(Block_Map));
+    map->num_pages = core->decode_cache.num_pages;
+    map->pages = (Block_Page **)calloc(map->num_pages + 1, sizeof(Block_Page *));
+    return map;
+}
+
+static Block *newBlock(Block_Map *map, Block_Page *page, Addr PC)
+{
+    Block *block = (Block *)calloc(1, sizeof(Block));
+    block->PC = PC;
+    block->next = page->blocks;
+    page->blocks = block;
+    page->leaders[(PC / 4) & ((1 << DECODE_PAGE_BITS) - 1)] = block;
+    map->num_blocks++;
+    return block;
+}
+
+static Block_Page *findPageBlocks(Core *core, Block_Map *map, Addr page_num)
+{
+    Block_Page *page = (Block_Page *)calloc(1, sizeof(Block_Page));
+    map->pages[page_num] = page;
+
+    // Leaders: the start of the page, every static target inside it and
+    // everything after a branch or jump. Blocks end at the page, the
+    // decoded instructions are only there for one page at a time.
+    size_t first = page_num << DECODE_PAGE_BITS;
+    size_t num_instrs = core->instr_mem->num_instrs - first;
+    if(num_instrs > 1 << DECODE_PAGE_BITS)
+        num_instrs = 1 << DECODE_PAGE_BITS;
+    DecodedInstruction *decoded = fetchDecoded(core, first * 4);
+    bool leader[1 << DECODE_PAGE_BITS] = { true };
+    for(size_t i = 0; i < num_instrs; i++)
+    {
+        if(!endsBlock(&decoded[i]))
+            continue;
+
+        if(i + 1 < num_instrs)
+            leader[i + 1] = true;
+
+        Addr target = (first + i) * 4 + decoded[i].imm;
+        if(!decoded[i].ctrl.jalr && target % 4 == 0 && target / 4 - first < num_instrs)
+            leader[target / 4 - first] = true;
+    }
+
+    Block *block = NULL;
+    for(size_t i = 0; i < num_instrs; i++)
+    {
+        if(leader[i])
+            block = newBlock(map, page, (first + i) * 4);
+        block->num_instrs++;
+    }
+    return page;
+}
+
+void freeBlocks(Block_Map *map)
+{
+    for(size_t i = 0; i < map->num_pages; i++)
+    {
+        if(map->pages[i] == NULL)
+            continue;
+        while(map->pages[i]->blocks != NULL)
+        {
+            Block *block = map->pages[i]->blocks;
+            map->pages[i]->blocks = block->next;
+            free(block);
+        }
+        free(map->pages[i]);
+    }
+    free(map->pages);
+    free(map);
+}
+
+void resetBlocks(Block_Map *map)
+{
+    for(size_t i = 0; i < map->num_pages; i++)
+    {
+        for(Block *block = map->pages[i] == NULL ? NULL : map->pages[i]->blocks; block != NULL; block = block->next)
+        {
+            block->count = 0;
+            block->promoted = false;
+        }
+    }
+}
+
+Block *findBlock(Core *core, Block_Map *map, Addr PC)
+{
+    // The block starting at PC, NULL past the end of the program, off an
+    // instruction boundary or on a rewritten page
+    Addr page_num = PC >> DECODE_PAGE_SHIFT;
+    if(PC % 4 != 0 || PC > core->instr_mem->last_addr || page_num >= map->num_pages)
+        return NULL;
+    Block_Page *page = map->pages[page_num];
+    if(page == NULL)
+        page = findPageBlocks(core, map, page_num);
+    if(page->stale)
+        return NULL;
+
+    size_t i = (PC / 4) & ((1 << DECODE_PAGE_BITS) - 1);
+    if(page->leaders[i] != NULL)
+        return page->leaders[i];
+
+    // A target from another page or a jalr, the block it lands in is split
+    // there and falls through into the rest. Every page starts a block.
+    size_t start = i;
+    while(page->leaders[start] == NULL)
+        start--;
+    Block *head = page->leaders[start];
+    Block *tail = newBlock(map, page, PC);
+    tail->num_instrs = head->num_instrs - (i - start);
+    tail->taken = head->taken;
+    tail->fallthrough = head->fallthrough;
+    head->num_instrs = i - start;
+    head->taken = NULL;
+    head->fallthrough = tail;
+    return tail;
+}
+
+bool blockStartsAt(Core *core, Block_Map *map, Addr PC)
+{
+    // Whether PC is already known to be a leader, without splitting anything
+    Addr page_num = PC >> DECODE_PAGE_SHIFT;
+    if(PC % 4 != 0 || PC > core->instr_mem->last_addr || page_num >= map->num_pages)
+        return false;
+    Block_Page *page = map->pages[page_num];
+    if(page == NULL)
+        page = findPageBlocks(core, map, page_num);
+    return page->leaders[(PC / 4) & ((1 << DECODE_PAGE_BITS) - 1)] != NULL;
+}
+
+void dropBlocks(Block_Map *map, Addr PC, size_t len)
+{
+    // Blocks never cross a decode page, so every block on the pages in the range
+    // goes. Their PCs get stepped through tickFunc() from now on, a page that was
+    // never looked up is marked the same way.
+    for(Addr i = PC >> DECODE_PAGE_SHIFT; i < (PC + len) >> DECODE_PAGE_SHIFT && i < map->num_pages; i++)
+    {
+        if(map->pages[i] == NULL)
+            map->pages[i] = (Block_Page *)calloc(1, sizeof(Block_Page));
+        Block_Page *page = map->pages[i];
+        page->stale = true;
+        memset(page->leaders, 0, sizeof(page->leaders));
+        for(Block *block = page->blocks; block != NULL; block = block->next)
+            block->stale = true;
+    }
+}
+
+bool blockTickFunc(Core *core)
+{
+    if(core->block_map == NULL)
+    {
+        core->block_map = initBlocks(core);
+        core->block = NULL;
+    }
+
+    if(core->data_mem->code_written)
+        memCodeWritten(core->data_mem);
+
+    Block *block = core->block;
+    if(block == NULL || block->stale)
+        block = findBlock(core, core->block_map, core->PC);
+
+    // Off an instruction boundary or on a rewritten page, step through it
+    if(block == NULL)
+        return tickFunc(core);
+
+    DecodedInstruction *decoded = fetchDecoded(core, block->PC);
+    for(unsigned i = 0; i < block->num_instrs; i++)
+        executeInstruction(core, &decoded[i]);
+    core->clk += block->num_instrs;
+
+    // Follow the chain instead of looking the next block up. Successors are
+    // chained the first time they're reached and checked against PC after that,
+    // a jalr can go somewhere else every time.
+    Block *next = block->fallthrough;
+    if(next == NULL || next->PC != core->PC)
+        next = block->taken;
+    if(next == NULL || next->PC != core->PC)
+    {
+        next = findBlock(core, core->block_map, core->PC);
+        if(core->PC == block->PC + block->num_instrs * 4)
+            block->fallthrough = next;
+        else
+            block->taken = next;
+    }
+    core->block = next;
+
+    // Are we reaching the final instruction?
+    if (core->PC > core->instr_mem->last_addr)
+        return false;
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef __BLOCK_H__
+#define __BLOCK_H__
+
+#include "Core.h"
+
+// A straight run of instructions that is only entered at the top and only
+// left at the bottom, split at branch, jal and jalr boundaries
+typedef struct Block Block;
+typedef struct Block
+{
+    Addr PC; // First instruction
+    unsigned num_instrs;
+    Block *taken; // Chained successors, the last one reached each way, NULL until then
+    Block *fallthrough;
+    Tick count; // Times entered, for tiering
+    bool promoted;
+    bool stale; // Its code was overwritten, only chains still lead here
+    Block *next; // In its page's list
+} Block;
+
+// The blocks of one decode page, found the first time anything in it is looked up
+typedef struct Block_Page Block_Page;
+typedef struct Block_Page
+{
+    Block *leaders[1 << DECODE_PAGE_BITS]; // NULL where no block starts
+    Block *blocks; // Every block found here, for resetting and freeing
+    bool stale; // Rewritten by a store, nothing is found here any more
+} Block_Page;
+
+// Pages are indexed by PC >> DECODE_PAGE_SHIFT, so finding blocks costs the
+// same as decoding: nothing until the code runs, and only the pages it runs.
+// A page's leaders are its first instruction, everything after a branch or
+// jump and the static targets inside it. Targets reached from other pages or
+// through jalr split the block they land in when they are first looked up.
+typedef struct Block_Map Block_Map;
+typedef struct Block_Map
+{
+    Block_Page **pages; // NULL until looked up
+    size_t num_pages;
+    size_t num_blocks; // Found so far, over every page
+} Block_Map;
+
+bool endsBlock(DecodedInstruction *decoded);
+Block_Map *initBlocks(Core *core);
+void freeBlocks(Block_Map *map);
+void resetBlocks(Block_Map *map);
+Block *findBlock(Core *core, Block_Map *map, Addr PC);
+bool blockStartsAt(Core *core, Block_Map *map, Addr PC);
+void dropBlocks(Block_Map *map, Addr PC, size_t len);
+bool blockTickFunc(Core *core);
+
+#endif
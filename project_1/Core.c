@@ -1,90 +1,203 @@
 #include "Core.h"
+#include "Block.h"
+#include "Devices.h"
+#include "Jit.h"
+#include "Isa.h"
+#include "Lsu.h"
 #include "Registers.h"
 
 Core *initCore(Instruction_Memory *i_mem)
 {
     Core *core = (Core *)malloc(sizeof(Core));
+    core->instr_mem = i_mem;
+    core->block_map = NULL;
+    core->unified = false;
+    core->jit = NULL;
+    core->jit_entry = NOT_IN_JIT;
+    core->devices = NULL;
+    core->hartid = 0;
+    core->data_mem = initMemory(false);
+    initDecodeCache(core, DEFAULT_DECODE_PAGES);
+    resetCore(core);
+
+    return core;
+}
+
+static void codeWritten(void *ctx, Addr addr, size_t len)
+{
+    // A store is about to change a page instructions were decoded from. What was
+    // decoded, found or translated there goes, the next fetch decodes it again.
+    Core *core = (Core *)ctx;
+    Decode_Cache *cache = &core->decode_cache;
+    Addr last = (addr + len - 1) >> DECODE_PAGE_SHIFT;
+    for(Addr page = addr >> DECODE_PAGE_SHIFT; page <= last && page < cache->num_pages; page++)
+    {
+        // The frame goes back to the pool, first in line to be decoded over
+        Decode_Page *frame = cache->pages[page];
+        if(frame != NULL)
+        {
+            cache->pages[page] = NULL;
+            frame->page = NO_PAGE;
+            frame->last_use = 0;
+        }
+        if(cache->last_page == page)
+        {
+            cache->last_page = NO_PAGE;
+            cache->last_frame = NULL;
+        }
+
+        if(core->block_map != NULL)
+            dropBlocks(core->block_map, page << DECODE_PAGE_SHIFT, 1 << DECODE_PAGE_SHIFT);
+        if(core->jit != NULL)
+            jitInvalidate(core->jit, page << DECODE_PAGE_SHIFT, 1 << DECODE_PAGE_SHIFT);
+        cache->rewrites++;
+    }
+}
+
+void resetCore(Core *core)
+{
+    // Back to the initial state without touching the decoded program,
+    // unless it was decoded from the data memory that's about to be cleared
+    if(core->unified)
+        flushDecoded(core);
+
     core->clk = 0;
     core->PC = 0;
-    core->instr_mem = i_mem;
     core->tick = tickFunc;
+    core->block = NULL;
+    core->hot_threshold = DEFAULT_HOT_THRESHOLD;
+    core->clk_limit = NO_CLK_LIMIT;
+    if(core->block_map != NULL)
+        resetBlocks(core->block_map);
+    core->interpreted_instrs = 0;
+    core->translated_instrs = 0;
+    core->fused_instrs = 0;
+    core->reservation.valid = false;
     memset(core->reg_file, 0, NUM_REGS*sizeof(core->reg_file[0]));
-    memset(core->data_mem, 0, NUM_BYTES*sizeof(core->data_mem[0]));
+    clearMemory(core->data_mem);
+    core->data_mem->code_write = codeWritten;
+    core->data_mem->code_ctx = core;
+
     /* UNCOMMENT TO SET DEFAULT VALUES FOR example_cpu_trace */ /*
     core->reg_file[25] = 4;
     core->reg_file[10] = 4;
     core->reg_file[22] = 1;
-    core->data_mem[0] = 16;
-    core->data_mem[8] = 128;
-    core->data_mem[16] = 8;
-    core->data_mem[24] = 4;
+    memWrite8(core->data_mem, 0, 16);
+    memWrite8(core->data_mem, 8, 128);
+    memWrite8(core->data_mem, 16, 8);
+    memWrite8(core->data_mem, 24, 4);
     */
 
     /* UNCOMMENT  TO SET DEFAULT VALUES FOR matrix  */ /* 
-    core->reg_file[1] = core->instr_mem->last->addr;
+    core->reg_file[1] = core->instr_mem->last_addr;
     core->reg_file[2] = NUM_BYTES - 8;
     core->reg_file[10] = 0;
     core->reg_file[11] = 128;
     */
 
     for(int i = 0; i < 16; i++)
-	core->data_mem[i*8] = i;
+	memWrite8(core->data_mem, i*8, i);
+}
 
-    return core;
+void freeCore(Core *core)
+{
+    if(core->block_map != NULL)
+        freeBlocks(core->block_map);
+    freeDecodeCache(core);
+    if(core->data_mem != NULL)
+        freeMemory(core->data_mem);
+    if(core->devices != NULL)
+        freeDevices(core->devices);
+    free(core);
+}
+
+bool runCore(Core *core)
+{
+    // Flat memory turns stray accesses into SIGSEGV, they come back here as guest
+    // faults. A device ending the run comes back here too.
+    sigjmp_buf env;
+    int jumped = sigsetjmp(env, 0);
+    if(jumped)
+    {
+        memCatchFaults(core->data_mem, NULL);
+        if(core->jit != NULL)
+        {
+            // Jumped out of its engine, nobody else is left to free it. Out of
+            // translated code clk is still short the block's instructions before PC.
+            if(core->jit_entry != NOT_IN_JIT)
+                core->clk += (core->PC - core->jit_entry) / 4;
+            core->jit_entry = NOT_IN_JIT;
+            freeJit(core->jit);
+            core->jit = NULL;
+        }
+        if(jumped == MEM_STOP)
+            return true;
+        fprintf(stderr, "Guest access fault at PC %lu: address %#lx\n", core->PC, memFaultAddr());
+        return false;
+    }
+
+    memCatchFaults(core->data_mem, &env);
+    while(core->clk < core->clk_limit && core->tick(core));
+    memCatchFaults(core->data_mem, NULL);
+    return true;
 }
 
 bool tickFunc(Core *core)
 {
-    // Steps may include
-    // (Step 1) Reading instruction from instruction memory
-    unsigned instruction = core->instr_mem->instructions[core->PC / 4].instruction;
+    // Flat memory let a store through to decoded code, drop it before the fetch
+    if(core->data_mem->code_written)
+        memCodeWritten(core->data_mem);
 
-    // (Step 2) Pass into control, register file, immediate and ALU Control
-    ControlSignals *ctrl_signals = (ControlSignals *) malloc(sizeof(ControlSignals));
-    control(ctrl_signals, (instruction & 0b1111111), ((instruction & (0b111 << 12)) >> 12));
+    // (Step 1) Reading the instruction from instruction memory, decoded on its page's first fetch
+    executeInstruction(core, fetchDecoded(core, core->PC));
 
-    uint8_t rd = (instruction & (0b11111 << 7)) >> 7;
-    uint8_t rs_1 = (instruction & (0b11111 << 15)) >> 15;
-    uint8_t rs_2 = (instruction & (0b11111 << 20)) >> 20;
+    ++core->clk;
+    // Are we reaching the final instruction?
+    if (core->PC > core->instr_mem->last_addr)
+        return false;
+    return true;
+}
+
+void executeInstruction(Core *core, DecodedInstruction *decoded)
+{
+    // Steps (2) to (5) of a cycle, everything but fetch and the clock
+    // (Step 2) Control, immediate and ALU Control were resolved by decodePage()
+    ControlSignals *ctrl_signals = &decoded->ctrl;
+
+    uint8_t rd = decoded->rd;
+    uint8_t rs_1 = decoded->rs_1;
+    uint8_t rs_2 = decoded->rs_2;
     
-    int read_data_1 = core->reg_file[rs_1]; 
-    int read_data_2 = core->reg_file[rs_2]; 
+    int64_t read_data_1 = core->reg_file[rs_1]; 
+    int64_t read_data_2 = core->reg_file[rs_2]; 
     
-    int imm = buildImm(instruction);
+    int imm = decoded->imm;
 
     // (Step 3) Pass into mux and from there into ALU
-    int result = 0;
-    int operand_2;
+    int64_t result = 0;
+    int64_t operand_2;
     uint8_t zero = 0;
-    uint8_t alu_ctrl;
 
     if(ctrl_signals->aluSrc)
         operand_2 = imm;
     else
         operand_2 = read_data_2;
 
-    uint8_t funct7 = ((instruction & (0b1111111 << 25)) >> 25);
-    if((instruction & 0b1111111) == 0b0010011)
-	funct7 = 0;
-    
-    alu_ctrl = aluControl(ctrl_signals->aluOp, ((instruction & (0b111 << 12)) >> 12), funct7);
-    alu(read_data_1, operand_2, alu_ctrl, &result, &zero);
+    alu(read_data_1, operand_2, decoded->alu_ctrl, &result, &zero);
 
     // (Step 4) Memory access and register file writeback
     int64_t ram_data = 0;
-    int w_data;
+    int64_t w_data;
 
-    if(ctrl_signals->memWrite)
+    if(ctrl_signals->atomic)
+        ram_data = lsuAtomic(core->data_mem, &core->reservation, result, read_data_2, decoded->funct3, decoded->funct5);
+    else
     {
-        core->data_mem[result] = 0;
-        for(int i = 0; i < 8; i++)
-            core->data_mem[result+i] = (read_data_2 & (0xFF << (i * 8)));
-    }
+        if(ctrl_signals->memWrite)
+            lsuStore(core->data_mem, result, read_data_2, decoded->funct3);
 
-    if(ctrl_signals->memRead)
-    {
-        for(int i = 0; i < 8; i++)
-            ram_data |= core->data_mem[result+i] << (i * 8);
+        if(ctrl_signals->memRead)
+            ram_data = lsuLoad(core->data_mem, result, decoded->funct3);
     }
 
     if(ctrl_signals->memToReg)
@@ -107,21 +220,16 @@ bool tickFunc(Core *core)
 
     
     // (Step 5) Set PC to the correct value
-    unsigned branch_PC = core->PC + imm;
-    unsigned jump_PC;
+    Addr branch_PC = core->PC + imm;
 
-    if(ctrl_signals->jal)
-        jump_PC = core->PC + imm;
-    else if(ctrl_signals->jalr)
-        jump_PC = result;
-
-    if((ctrl_signals->beq && zero) || (ctrl_signals->bne && !zero) || (ctrl_signals->blt && result) || (ctrl_signals->bge && (~result || zero)))
+    if((ctrl_signals->beq && zero) || (ctrl_signals->bne && !zero) || (ctrl_signals->blt && result) || (ctrl_signals->bge && !result))
     {
         core->PC = branch_PC;
     }
     else if(ctrl_signals->jal || ctrl_signals->jalr)
     {
-        core->PC = jump_PC;
+        // jal is PC-relative, jalr goes where the ALU added rs_1 and the offset
+        core->PC = ctrl_signals->jal ? core->PC + imm : (Addr)result;
     }
     else
     {
@@ -129,8 +237,8 @@ bool tickFunc(Core *core)
     }
 
     /* UNCOMMENT TO PRINT OUT THE INSTRUCTIONS, REGISTERS, AND DATA MEMORY
-    printf("\nInstruction: %u\n", instruction);
-    printf("rd: %u    rs1: %u    rs2: %u    imm: %d    result: %d\n", rd, rs_1, rs_2, imm, result);
+    printf("\nInstruction: %u\n", imemFetch(core->instr_mem, core->PC));
+    printf("rd: %u    rs1: %u    rs2: %u    imm: %d    result: %ld\n", rd, rs_1, rs_2, imm, result);
 
     for(int i = 0; i < NUM_REGS; i++)
         printf("%s: %lu\n", REGISTER_NAME[i], core->reg_file[i]);
@@ -140,236 +248,79 @@ bool tickFunc(Core *core)
 	int data = 0;
 	for(int j = 0; j < 7; j++)
 	{
-	    data |= (core->data_mem[i+j] << (j * 8));
+	    data |= (memRead8(core->data_mem, i+j) << (j * 8));
 	}
 	printf("Data Address %d: %u\n", i, data);
     }
     */
-
-    free(ctrl_signals);
-    ++core->clk;
-    // Are we reaching the final instruction?
-    if (core->PC > core->instr_mem->last->addr)
-        return false;
-    return true;
 }
 
-void alu(int r_data_1, int r_data_2, uint8_t ctrl_signal, int *result, uint8_t *zero)
+void alu(int64_t r_data_1, int64_t r_data_2, uint8_t ctrl_signal, int64_t *result, uint8_t *zero)
 {
     *zero = (r_data_1 == r_data_2);
     switch(ctrl_signal)
     {
-    case 0b0000:
+    case ALU_AND:
         *result = r_data_1 & r_data_2;
         break;
-    case 0b0001:
+    case ALU_OR:
         *result = r_data_1 | r_data_2;
         break;
-    case 0b0010:
+    case ALU_ADD:
         *result = r_data_1 + r_data_2;
         break;
-    case 0b0011:
-        *result = r_data_1 << r_data_2;
+    case ALU_SLL:
+        *result = r_data_1 << (r_data_2 & 0x3F);
         break;
-    case 0b0100:
-        *result = r_data_1 >> r_data_2;
+    case ALU_SRL:
+        *result = (uint64_t)r_data_1 >> (r_data_2 & 0x3F);
         break;
-    case 0b0101:
+    case ALU_XOR:
         *result = r_data_1 ^ r_data_2;
         break;
-    case 0b0110:
+    case ALU_SUB:
         *result = r_data_1 - r_data_2;
         break;
-    case 0b0111:
+    case ALU_SLT:
         *result = r_data_1 < r_data_2 ? 1 : 0;
         break;
     }
 }
 
-uint8_t aluControl(uint8_t aluOp, uint8_t funct3, uint8_t funct7)
-{
-    if(aluOp == 0)
-    {
-        return 0b0010;
-    }
-    else if(aluOp == 0b01)
-    {
-        if(funct3 == 0b000 || funct3 == 0b001)     // BEQ/BNE
-        {
-            return 0b0110;
-        }                     
-        else if(funct3 == 0b100 || funct3 == 0b101)     // BLT/BGT
-        {
-            return 0b0111;
-        }
-    }
-    else if(aluOp == 0b10)
-    {
-        switch(funct3)
-        {
-        case 0b000:         
-            if(funct7 == 0b0000000)                 // ADD
-            {
-                return 0b0010;
-            }
-            else if(funct7 == 0b0100000)            // SUB
-            {
-                return 0b0110;
-            }
-            break;
-        case 0b001:                                 // SLL
-            return 0b0011;
-        case 0b010:                                 // SLT(needed for bgt and blt)
-            return 0b0111;
-        case 0b100:                                 // XOR
-            return 0b0101;
-        case 0b101:                                 // SRL
-            return 0b0100;
-        case 0b110:                                 // OR
-            return 0b0001;
-        case 0b111:                                 // AND
-            return 0b0000;
-        }
-    }
-}
-
 void control(ControlSignals *ctrl_signals, unsigned opcode, uint8_t funct3)
 {
-    if(opcode == 0b0110011)             // R-Type
-    {
-        ctrl_signals->regWrite = 1;
-        ctrl_signals->aluSrc = 0;
-        ctrl_signals->memWrite = 0;
-        ctrl_signals->aluOp = 0b10;
-        ctrl_signals->memToReg = 0;
-        ctrl_signals->memRead = 0;
-        ctrl_signals->beq = 0;
-        ctrl_signals->jal = 0;
-        ctrl_signals->jalr = 0;
-    }   
-    else if(opcode == 0b0010011)        // I-Type
-    {
-        ctrl_signals->regWrite = 1;
-        ctrl_signals->aluSrc = 1;
-        ctrl_signals->memWrite = 0;
-        ctrl_signals->aluOp = 0b10;
-        ctrl_signals->memToReg = 0;
-        ctrl_signals->memRead = 0;
-        ctrl_signals->beq = 0;
-        ctrl_signals->jal = 0;
-        ctrl_signals->jalr = 0;
-    }   
-    else if(opcode == 0b0000011)       // LD
-    {
-        ctrl_signals->regWrite = 1;
-        ctrl_signals->aluSrc = 1;
-        ctrl_signals->memWrite = 0;
-        ctrl_signals->aluOp = 0b00;
-        ctrl_signals->memToReg = 1;
-        ctrl_signals->memRead = 1;
-        ctrl_signals->beq = 0;
-        ctrl_signals->jal = 0;
-        ctrl_signals->jalr = 0;
-    }   
-    else if(opcode == 0b1100111)      // JALR
-    {
-        ctrl_signals->regWrite = 1;
-        ctrl_signals->aluSrc = 1;
-        ctrl_signals->memWrite = 0;
-        ctrl_signals->aluOp = 0b00;
-        ctrl_signals->memToReg = 0;
-        ctrl_signals->memRead = 0;
-        ctrl_signals->beq = 0;
-        ctrl_signals->jal = 0;
-        ctrl_signals->jalr = 1;
-    }   
-    else if(opcode == 0b0100011)    // SD
-    {
-        ctrl_signals->regWrite = 0;
-        ctrl_signals->aluSrc = 1;
-        ctrl_signals->memWrite = 1;
-        ctrl_signals->aluOp = 0b00;
-        ctrl_signals->memToReg = 0;
-        ctrl_signals->memRead = 0;
-        ctrl_signals->beq = 0;
-        ctrl_signals->jal = 0;
-        ctrl_signals->jalr = 0;
-    }   
-    else if(opcode == 0b1100011)    // B-Type
-    {
-        ctrl_signals->regWrite = 0;
-        ctrl_signals->aluSrc = 0;
-        ctrl_signals->memWrite = 0;
-        ctrl_signals->aluOp = 0b01;
-        ctrl_signals->memToReg = 0;
-        ctrl_signals->memRead = 0;
-        ctrl_signals->jal = 0;
-        ctrl_signals->jalr = 0;
-        switch(funct3)
-        {
-        case 0b000:
-            ctrl_signals->beq = 1;
-            ctrl_signals->bne = 0;
-            ctrl_signals->blt = 0;
-            ctrl_signals->bge = 0;
-            break;
-        case 0b001:
-            ctrl_signals->beq = 0;
-            ctrl_signals->bne = 1;
-            ctrl_signals->blt = 0;
-            ctrl_signals->bge = 0;
-            break;
-        case 0b100:
-            ctrl_signals->beq = 0;
-            ctrl_signals->bne = 0;
-            ctrl_signals->blt = 1;
-            ctrl_signals->bge = 0;
-            break;
-        case 0b101:
-            ctrl_signals->beq = 0;
-            ctrl_signals->bne = 0;
-            ctrl_signals->blt = 0;
-            ctrl_signals->bge = 1;
-            break;
-        }
-    }   
-    else if(opcode == 0b1101111)    // JAL
-    {
-        ctrl_signals->regWrite = 1;
-        ctrl_signals->aluSrc = 0;
-        ctrl_signals->memWrite = 0;
-        ctrl_signals->aluOp = 0b00;
-        ctrl_signals->memToReg = 0;
-        ctrl_signals->memRead = 0;
-        ctrl_signals->beq = 0;
-        ctrl_signals->jal = 1;
-        ctrl_signals->jalr = 0;
-    }   
+    // Main control is a row of the ISA table, unknown opcodes leave the signals alone
+    const IsaEntry *entry = isaDecode(opcode | (funct3 << 12));
+    if(entry != NULL)
+        *ctrl_signals = entry->ctrl;
 }
 
 int buildImm(unsigned instr)
 {
     int imm = 0;
-    unsigned opcode = (instr & 0b1111111);
-    if(opcode == 0b0010011 || opcode == 0b0000011 || opcode == 0b1100111)   // I-Type
+    const IsaEntry *entry = isaDecode(instr);
+    if(entry == NULL)
+        return 0;
+
+    switch(entry->format)
     {
+    case FMT_I:
+    case FMT_I_MEM:
         imm |= ((instr & (0b111111111111 << 20)) >> 20);
         if(imm & 0x800)
         {
             imm |= 0xFFFFF000;
         }
-    }
-    else if(opcode == 0b0100011)        //S-Type
-    {
+        break;
+    case FMT_S:
         imm |= ((instr & (0b11111 << 7)) >> 7);
         imm |= ((instr & (0b1111111 << 25)) >> 20);
         if(imm & 0x800)
         {
             imm |= 0xFFFFF000;
         }
-    }
-    else if(opcode == 0b1100011)        // B-Type
-    {
+        break;
+    case FMT_B:
         imm |= ((instr & (0b1 << 7)) << 4);
         imm |= ((instr & (0b1111 << 8)) >> 7); 
         imm |= ((instr & (0b111111 << 25)) >> 20);
@@ -378,9 +329,8 @@ int buildImm(unsigned instr)
         {
             imm |= 0xFFFFF000;
         }
-    }
-    else if(opcode == 0b1101111)        // J-Type
-    {
+        break;
+    case FMT_J:
         imm |= (instr & 0b11111111000000000000); 
         imm |= ((instr & (0b100000000000 << 9)) >> 9); 
         imm |= ((instr & (0b11111111110 << 20)) >> 20); 
@@ -389,7 +339,136 @@ int buildImm(unsigned instr)
         {
             imm |= 0xFFF00000;
         }
+        break;
+    case FMT_R:
+    case FMT_AMO: // aq and rl aren't an immediate, atomics address rs1 + 0
+    case FMT_LR:
+        break;
     }
 
     return imm;
 }
+
+void decodeInstruction(unsigned instr, DecodedInstruction *decoded)
+{
+    // Anything the ISA table doesn't know decodes to all-zero control, a NOP
+    memset(decoded, 0, sizeof(DecodedInstruction));
+    decoded->alu_ctrl = ALU_ADD;
+
+    decoded->rd = (instr & (0b11111 << 7)) >> 7;
+    decoded->rs_1 = (instr & (0b11111 << 15)) >> 15;
+    decoded->rs_2 = (instr & (0b11111 << 20)) >> 20;
+    decoded->funct3 = (instr & (0b111 << 12)) >> 12;
+    decoded->funct5 = (instr & (0b11111 << 27)) >> 27;
+    decoded->imm = buildImm(instr);
+
+    const IsaEntry *entry = isaDecode(instr);
+    if(entry != NULL)
+    {
+        decoded->ctrl = entry->ctrl;
+        decoded->alu_ctrl = entry->alu_ctrl;
+    }
+}
+
+void storeProgram(Core *core)
+{
+    // Unified memory: the trace goes into data memory at its own PCs, over whatever is there
+    Instruction_Memory *i_mem = core->instr_mem;
+    if(i_mem->num_instrs != 0)
+        memWriteBytes(core->data_mem, 0, i_mem->words, i_mem->num_instrs * sizeof(uint32_t));
+}
+
+void initDecodeCache(Core *core, size_t max_pages)
+{
+    // Nothing is decoded until it's fetched, so this costs the same for any size of program
+    Decode_Cache *cache = &core->decode_cache;
+    size_t page_instrs = 1 << DECODE_PAGE_BITS;
+    cache->num_pages = (core->instr_mem->num_instrs + page_instrs - 1) / page_instrs;
+    cache->pages = (Decode_Page **)calloc(cache->num_pages + 1, sizeof(Decode_Page *));
+    cache->max_frames = max_pages != 0 ? max_pages : 1;
+    cache->frames = (Decode_Page **)calloc(cache->max_frames, sizeof(Decode_Page *));
+    cache->num_frames = 0;
+    cache->clock = 0;
+    cache->last_page = NO_PAGE;
+    cache->last_frame = NULL;
+    cache->decodes = 0;
+    cache->rewrites = 0;
+    decodeInstruction(0, &cache->nop);
+}
+
+void freeDecodeCache(Core *core)
+{
+    Decode_Cache *cache = &core->decode_cache;
+    for(size_t i = 0; i < cache->num_frames; i++)
+        free(cache->frames[i]);
+    free(cache->frames);
+    free(cache->pages);
+}
+
+void flushDecoded(Core *core)
+{
+    // Forget everything decoded or found in the program, for a new one or new memory
+    freeDecodeCache(core);
+    initDecodeCache(core, core->decode_cache.max_frames);
+    if(core->block_map != NULL)
+    {
+        freeBlocks(core->block_map);
+        core->block_map = NULL;
+    }
+    core->block = NULL;
+}
+
+DecodedInstruction *decodePage(Core *core, Addr PC)
+{
+    Decode_Cache *cache = &core->decode_cache;
+    Addr page = PC >> DECODE_PAGE_SHIFT;
+    if(page >= cache->num_pages)
+        return &cache->nop;
+
+    Decode_Page *frame = cache->pages[page];
+    if(frame == NULL)
+    {
+        if(cache->num_frames < cache->max_frames)
+        {
+            frame = (Decode_Page *)malloc(sizeof(Decode_Page));
+            cache->frames[cache->num_frames++] = frame;
+        }
+        else
+        {
+            // Full, decode over the page that has gone longest without being entered
+            frame = cache->frames[0];
+            for(size_t i = 1; i < cache->num_frames; i++)
+            {
+                if(cache->frames[i]->last_use < frame->last_use)
+                    frame = cache->frames[i];
+            }
+            if(frame->page != NO_PAGE)
+                cache->pages[frame->page] = NULL;
+        }
+
+        frame->page = page;
+        Addr first = page << DECODE_PAGE_BITS;
+        uint32_t words[1 << DECODE_PAGE_BITS];
+        if(core->unified)
+        {
+            // Marked, so a store to the page calls codeWritten() before it lands
+            memReadBytes(core->data_mem, first * 4, words, sizeof(words));
+            memMarkCode(core->data_mem, first * 4);
+        }
+        else
+        {
+            for(size_t i = 0; i < (1 << DECODE_PAGE_BITS); i++)
+                words[i] = imemFetch(core->instr_mem, (first + i) * 4);
+        }
+        for(size_t i = 0; i < (1 << DECODE_PAGE_BITS); i++)
+            decodeInstruction(words[i], &frame->instrs[i]);
+        cache->pages[page] = frame;
+        cache->decodes++;
+    }
+
+    // Only page switches count as uses, the fast path in fetchDecoded() stays a compare
+    frame->last_use = ++cache->clock;
+    cache->last_page = page;
+    cache->last_frame = frame;
+    return &frame->instrs[(PC / 4) & ((1 << DECODE_PAGE_BITS) - 1)];
+}
@@ -2,6 +2,8 @@
 #define __CORE_H__
 
 #include "Instruction_Memory.h"
+#include "Lsu.h"
+#include "Memory.h"
 
 #include <stdbool.h>
 #include <stdlib.h>
@@ -9,22 +11,13 @@
 #include <string.h>
 
 #define NUM_REGS 64
-#define NUM_BYTES 1024
+#define NUM_BYTES 1024 // The stack starts at the top of this, data_mem itself is sparse
 #define BOOL bool
-
-struct Core;
-typedef struct Core Core;
-typedef struct Core
-{
-    Tick clk; // Keep track of core clock
-    Addr PC; // Keep track of program counter
-    Instruction_Memory *instr_mem;
-    uint64_t reg_file[NUM_REGS];
-    uint8_t data_mem[NUM_BYTES];
-
-    // Simulation function
-    bool (*tick)(Core *core);
-} Core;
+#define DEFAULT_HOT_THRESHOLD 50
+#define NO_CLK_LIMIT (~(Tick)0)
+#define DECODE_PAGE_BITS 10 // Instructions decoded together, as a power of two
+#define DECODE_PAGE_SHIFT (DECODE_PAGE_BITS + 2) // PC >> DECODE_PAGE_SHIFT is the decode page
+#define DEFAULT_DECODE_PAGES 64 // Decoded pages kept at once, 1.75MB worth
 
 typedef struct ControlSignals ControlSignals;
 typedef struct ControlSignals
@@ -41,14 +34,126 @@ typedef struct ControlSignals
     uint8_t bge;
     uint8_t jal;
     uint8_t jalr;
+    uint8_t atomic; // Goes to lsuAtomic() instead of a plain load or store
 } ControlSignals;
 
+// Everything ID would derive from an instruction word, worked out once per decode of its page
+typedef struct DecodedInstruction DecodedInstruction;
+typedef struct DecodedInstruction
+{
+    ControlSignals ctrl;
+    int imm; // Sign-extended immediate
+    uint8_t alu_ctrl;
+    uint8_t rd;
+    uint8_t rs_1;
+    uint8_t rs_2;
+    uint8_t funct3; // Width of a load or store, see Lsu.h
+    uint8_t funct5; // Which atomic, AMO_* in Lsu.h
+} DecodedInstruction;
+
+// One page of instruction memory, decoded the first time anything in it is fetched
+typedef struct Decode_Page Decode_Page;
+typedef struct Decode_Page
+{
+    Addr page; // PC >> DECODE_PAGE_SHIFT
+    Tick last_use;
+    DecodedInstruction instrs[1 << DECODE_PAGE_BITS];
+} Decode_Page;
+
+// Decoded pages are found through a directory with one slot per page of the
+// program. Only max_frames of them are kept, past that the page that was least
+// recently switched to is decoded over. Like Memory, the page the last fetch
+// came from is cached in front of the directory.
+typedef struct Decode_Cache Decode_Cache;
+typedef struct Decode_Cache
+{
+    Decode_Page **pages; // NULL where the page isn't decoded
+    size_t num_pages;
+    Decode_Page **frames;
+    size_t num_frames;
+    size_t max_frames;
+    Tick clock; // Advances on every page switch, for the LRU
+
+    Addr last_page;
+    Decode_Page *last_frame;
+    DecodedInstruction nop; // Fetched from anywhere past the end of the program
+
+    Tick decodes; // Pages decoded, including ones decoded again after eviction
+    Tick rewrites; // Pages dropped because a store was about to change them
+} Decode_Cache;
+
+struct Block;
+struct Block_Map;
+struct Jit;
+struct Devices;
+
+struct Core;
+typedef struct Core Core;
+typedef struct Core
+{
+    Tick clk; // Keep track of core clock
+    Addr PC; // Keep track of program counter
+    Instruction_Memory *instr_mem;
+    Decode_Cache decode_cache;
+
+    // Unified memory: instructions are fetched from data_mem, which storeProgram()
+    // copies a trace into. A store to a page with decoded code on it drops that
+    // page's decode, blocks and translations before it lands.
+    bool unified;
+    uint64_t reg_file[NUM_REGS];
+    Memory *data_mem; // Freed with the core unless NULL, harts share the first hart's
+    unsigned hartid; // 0 unless initHarts() made it
+    Lsu_Reservation reservation; // Left by lr for sc
+    struct Devices *devices; // Mapped into data_mem with -M, freed along with the core
+
+    // Basic blocks, found a decode page at a time as they're looked up
+    struct Block_Map *block_map;
+    struct Block *block; // Next block to run, NULL if it has to be looked up
+
+    // Tiered execution: blocks entered hot_threshold times get translated
+    unsigned hot_threshold;
+    Tick interpreted_instrs;
+    Tick translated_instrs;
+
+    // Instructions the threaded engine ran as part of a fused macro-op
+    Tick fused_instrs;
+
+    struct Jit *jit; // The translator runJit() or runTiered() is running, if any
+    Addr jit_entry; // PC translated code last entered a block at, NOT_IN_JIT once it returns
+
+    // runCore() stops between ticks once clk reaches this. Engines that run the
+    // whole program in one tick (-f, -j, -t) can go past it.
+    Tick clk_limit;
+
+    // Simulation function
+    bool (*tick)(Core *core);
+} Core;
+
 Core *initCore(Instruction_Memory *i_mem);
+void resetCore(Core *core);
+void freeCore(Core *core);
+bool runCore(Core *core);
 bool tickFunc(Core *core);
-void alu(int r_data_1, int r_data_2, uint8_t ctrl_signal, int *result, uint8_t *zero);
-uint8_t aluControl(uint8_t aluOp, uint8_t funct3, uint8_t funct7);
+void executeInstruction(Core *core, DecodedInstruction *decoded);
+void alu(int64_t r_data_1, int64_t r_data_2, uint8_t ctrl_signal, int64_t *result, uint8_t *zero);
 void control(ControlSignals *ctrl_signals, unsigned opcode, uint8_t funct3);
 int buildImm(unsigned instr);
+void decodeInstruction(unsigned instr, DecodedInstruction *decoded);
+void storeProgram(Core *core);
+void initDecodeCache(Core *core, size_t max_pages);
+void freeDecodeCache(Core *core);
+void flushDecoded(Core *core);
+DecodedInstruction *decodePage(Core *core, Addr PC);
+
+// The decoded instruction at PC. The pointer, and the rest of its page after
+// it, stay good until the next fetch from a different page.
+static inline DecodedInstruction *fetchDecoded(Core *core, Addr PC)
+{
+    Decode_Cache *cache = &core->decode_cache;
+    if((PC >> DECODE_PAGE_SHIFT) != cache->last_page)
+        return decodePage(core, PC);
+    return &cache->last_frame->instrs[(PC / 4) & ((1 << DECODE_PAGE_BITS) - 1)];
+}
 
 #endif
 
@@ -0,0 +1,130 @@
+#include "Coroutine.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void runCoroutine(Coroutine *co) __attribute__((used, noinline, noreturn));
+
+#if defined(__x86_64__)
+// coroutineSwap(&from->sp, to->sp): push what the ABI says a call keeps, swap
+// stacks, pop the other side's. It goes back with a jump rather than a ret,
+// the return stack predicts the caller on the old stack and would miss every
+// time. A new stack is laid out as if it had switched away at the start of
+// coroutineBoot, with the coroutine in r12.
+__asm__(
+    ".text\n"
+    ".globl coroutineSwap\n"
+    ".hidden coroutineSwap\n"
+    ".type coroutineSwap, @function\n"
+    "coroutineSwap:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    popq %rcx\n"
+    "    jmpq *%rcx\n"
+    ".size coroutineSwap, .-coroutineSwap\n"
+    ".globl coroutineBoot\n"
+    ".hidden coroutineBoot\n"
+    ".type coroutineBoot, @function\n"
+    "coroutineBoot:\n"
+    "    movq %r12, %rdi\n"
+    "    call runCoroutine\n"
+    "    ud2\n"
+    ".size coroutineBoot, .-coroutineBoot\n");
+
+void coroutineSwap(void **save_sp, void *sp) __attribute__((visibility("hidden")));
+void coroutineBoot(void) __attribute__((visibility("hidden")));
+
+enum { SAVED_R15, SAVED_R14, SAVED_R13, SAVED_R12, SAVED_RBX, SAVED_RBP, SAVED_RIP, SAVED_SLOTS };
+#else
+static void bootCoroutine(unsigned hi, unsigned lo)
+{
+    // makecontext() only passes ints
+    runCoroutine((Coroutine *)(((uintptr_t)hi << 32) | lo));
+}
+#endif
+
+static void runCoroutine(Coroutine *co)
+{
+    co->fn(co->arg);
+    co->finished = true;
+    for(;;)
+        coroutineSwitch(co, co->exit_to);
+}
+
+void initThreadCoroutine(Coroutine *co)
+{
+    co->sp = NULL;
+    co->stack = NULL;
+    co->stack_size = 0;
+    co->fn = NULL;
+    co->arg = NULL;
+    co->exit_to = NULL;
+    co->finished = false;
+}
+
+void initCoroutine(Coroutine *co, void (*fn)(void *arg), void *arg, size_t stack_size, Coroutine *exit_to)
+{
+    // The stack is only backed as deep as it gets, with a guard page under it
+    long page = sysconf(_SC_PAGESIZE);
+    initThreadCoroutine(co);
+    co->stack_size = (stack_size + page - 1) / page * page + page;
+    co->stack = mmap(NULL, co->stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(co->stack == MAP_FAILED)
+    {
+        perror("Cannot map coroutine stack");
+        exit(EXIT_FAILURE);
+    }
+    mprotect(co->stack, page, PROT_NONE);
+    co->fn = fn;
+    co->arg = arg;
+    co->exit_to = exit_to;
+
+#if defined(__x86_64__)
+    // coroutineBoot's call has to find the stack 16-byte aligned
+    uintptr_t top = ((uintptr_t)co->stack + co->stack_size) & ~(uintptr_t)15;
+    void **frame = (void **)(top - 16) - SAVED_SLOTS;
+    for(int i = 0; i < SAVED_SLOTS; i++)
+        frame[i] = NULL;
+    frame[SAVED_R12] = co;
+    frame[SAVED_RIP] = (void *)coroutineBoot;
+    co->sp = frame;
+#else
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp = (char *)co->stack + page;
+    co->context.uc_stack.ss_size = co->stack_size - page;
+    co->context.uc_link = NULL;
+    makecontext(&co->context, (void (*)(void))bootCoroutine, 2, (unsigned)((uintptr_t)co >> 32), (unsigned)(uintptr_t)co);
+#endif
+}
+
+void freeCoroutine(Coroutine *co)
+{
+    // Never the one running
+    if(co->stack != NULL)
+        munmap(co->stack, co->stack_size);
+    co->stack = NULL;
+}
+
+void coroutineSwitch(Coroutine *from, Coroutine *to)
+{
+#if defined(__x86_64__)
+    coroutineSwap(&from->sp, to->sp);
+#else
+    swapcontext(&from->context, &to->context);
+#endif
+}
@@ -0,0 +1,36 @@
+#ifndef __COROUTINE_H__
+#define __COROUTINE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+// Loops that take turns on one thread, each on a stack of its own, switching
+// only where coroutineSwitch() is called. On x86-64 a switch saves the
+// callee-saved registers and the stack pointer and nothing else, elsewhere it
+// falls back to swapcontext(), which also saves the signal mask.
+typedef struct Coroutine Coroutine;
+typedef struct Coroutine
+{
+    void *sp; // Where the registers were pushed the last time it switched away
+    void *stack; // NULL for the thread's own stack
+    size_t stack_size;
+    void (*fn)(void *arg);
+    void *arg;
+    Coroutine *exit_to; // Switched to once fn returns
+    bool finished;
+#if !defined(__x86_64__)
+    ucontext_t context;
+#endif
+} Coroutine;
+
+// The thread's own stack, what the first coroutineSwitch() is made from
+void initThreadCoroutine(Coroutine *co);
+void initCoroutine(Coroutine *co, void (*fn)(void *arg), void *arg, size_t stack_size, Coroutine *exit_to);
+void freeCoroutine(Coroutine *co);
+void coroutineSwitch(Coroutine *from, Coroutine *to);
+
+#endif
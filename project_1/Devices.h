@@ -0,0 +1,41 @@
+#ifndef __DEVICES_H__
+#define __DEVICES_H__
+
+#include <stdio.h>
+
+#include "Memory.h"
+
+// Each device takes one page, spaced so they stay apart with huge pages too
+#define UART_BASE 0x10000000UL
+#define TIMER_BASE 0x10200000UL
+#define EXIT_BASE 0x10400000UL
+
+// UART registers, a 16550 as far as a program printing through it can tell
+#define UART_THR 0 // Write a byte to transmit it, reads are RBR and nothing ever arrives
+#define UART_LSR 5 // Line status
+#define UART_LSR_IDLE 0x60 // THRE | TEMT, the transmitter is always empty
+
+#define TIMER_COUNT 0 // Cycles so far, writes are ignored
+#define EXIT_STATUS 0 // A write ends the run with that status
+
+// The guest-visible devices, each backed by a local stand-in: the UART
+// transmits to console, the timer reads clk and the exit register stops the
+// run through memStopRun(). Their pages live in paged memory only.
+typedef struct Devices Devices;
+typedef struct Devices
+{
+    Mem_Device uart;
+    Mem_Device timer;
+    Mem_Device exit;
+
+    FILE *console;
+    const Tick *clk;
+    bool exited;
+    int64_t exit_status;
+} Devices;
+
+Devices *initDevices(Memory *mem, const Tick *clk, FILE *console);
+void freeDevices(Devices *devices);
+void printDeviceStats(Devices *devices);
+
+#endif
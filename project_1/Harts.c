@@ -0,0 +1,194 @@
+#include "Harts.h"
+
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+Harts *initHarts(Instruction_Memory *i_mem, unsigned num_harts, size_t flat_size)
+{
+    Harts *harts = (Harts *)malloc(sizeof(Harts));
+    harts->harts = (Hart *)calloc(num_harts, sizeof(Hart));
+    harts->num_harts = num_harts;
+    harts->data_mem = flat_size != 0 ? initFlatMemory(flat_size) : initMemory(false);
+    harts->quantum = DEFAULT_QUANTUM;
+    harts->rounds = 0;
+    harts->seconds = 0;
+
+    for(unsigned h = 0; h < num_harts; h++)
+    {
+        Core *core = initCore(i_mem);
+        freeMemory(core->data_mem);
+        core->data_mem = harts->data_mem;
+        // Only the first reset goes to the shared memory, the others would clear it again
+        if(h == 0)
+            resetCore(core);
+        core->hartid = h;
+        core->reg_file[10] = h;
+
+        harts->harts[h].core = core;
+        harts->harts[h].harts = harts;
+    }
+    return harts;
+}
+
+void freeHarts(Harts *harts)
+{
+    for(unsigned h = 0; h < harts->num_harts; h++)
+    {
+        if(h != 0)
+            harts->harts[h].core->data_mem = NULL;
+        freeCore(harts->harts[h].core);
+    }
+    free(harts->harts);
+    free(harts);
+}
+
+static void *hartThread(void *arg)
+{
+    Hart *hart = (Hart *)arg;
+    Harts *harts = hart->harts;
+    Core *core = hart->core;
+    for(Tick round = 1;; round++)
+    {
+        if(!hart->done)
+        {
+            double start = now();
+            core->clk_limit = round * harts->quantum;
+            hart->faulted = !runCore(core);
+            hart->done = hart->faulted || core->PC > core->instr_mem->last_addr;
+            hart->seconds += now() - start;
+        }
+
+        // One thread looks at every hart while the rest wait for it at the second
+        // barrier, nobody can have started the next round and changed their done
+        if(pthread_barrier_wait(&harts->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+        {
+            harts->finished = true;
+            for(unsigned h = 0; h < harts->num_harts; h++)
+                harts->finished &= harts->harts[h].done;
+            harts->rounds = round;
+        }
+        pthread_barrier_wait(&harts->barrier);
+        if(harts->finished)
+            return NULL;
+    }
+}
+
+bool runHarts(Harts *harts, Tick quantum)
+{
+    // False if any hart faulted, the others still run to the end
+    harts->quantum = quantum;
+    harts->finished = false;
+    pthread_barrier_init(&harts->barrier, NULL, harts->num_harts);
+
+    double start = now();
+    for(unsigned h = 0; h < harts->num_harts; h++)
+    {
+        if(pthread_create(&harts->harts[h].thread, NULL, hartThread, &harts->harts[h]) != 0)
+        {
+            perror("Cannot start hart thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bool ran = true;
+    for(unsigned h = 0; h < harts->num_harts; h++)
+    {
+        pthread_join(harts->harts[h].thread, NULL);
+        ran &= !harts->harts[h].faulted;
+    }
+    harts->seconds = now() - start;
+
+    pthread_barrier_destroy(&harts->barrier);
+    return ran;
+}
+
+static void interleavedHart(void *arg)
+{
+    // The hart's whole run as one loop, switching back to the scheduler at the
+    // end of every turn. Faults come back here the way they do to runCore().
+    Hart *hart = (Hart *)arg;
+    Harts *harts = hart->harts;
+    Core *core = hart->core;
+    sigjmp_buf env;
+    if(sigsetjmp(env, 0))
+    {
+        fprintf(stderr, "Guest access fault at PC %lu: address %#lx\n", core->PC, memFaultAddr());
+        hart->faulted = true;
+        hart->done = true;
+        return;
+    }
+    hart->env = &env;
+    memCatchFaults(core->data_mem, &env);
+
+    // Counted in clk, -b ticks a whole block at a time
+    Tick turn_end = core->clk + harts->quantum;
+    while(core->tick(core))
+    {
+        if(core->clk >= turn_end)
+        {
+            coroutineSwitch(&hart->co, &harts->scheduler);
+            turn_end = core->clk + harts->quantum;
+        }
+    }
+    hart->done = true;
+}
+
+bool interleaveHarts(Harts *harts, Tick quantum)
+{
+    // False if any hart faulted, the others still run to the end
+    harts->quantum = quantum;
+    initThreadCoroutine(&harts->scheduler);
+    for(unsigned h = 0; h < harts->num_harts; h++)
+    {
+        harts->harts[h].env = NULL;
+        initCoroutine(&harts->harts[h].co, interleavedHart, &harts->harts[h], HART_COROUTINE_STACK, &harts->scheduler);
+    }
+
+    double start = now();
+    for(bool running = true; running; harts->rounds++)
+    {
+        running = false;
+        for(unsigned h = 0; h < harts->num_harts; h++)
+        {
+            // The fault handler's jump buffer is per thread, it goes with the turn
+            Hart *hart = &harts->harts[h];
+            if(hart->done)
+                continue;
+            memCatchFaults(harts->data_mem, hart->env);
+            coroutineSwitch(&harts->scheduler, &hart->co);
+            running |= !hart->done;
+        }
+    }
+    memCatchFaults(harts->data_mem, NULL);
+    harts->seconds = now() - start;
+
+    bool ran = true;
+    for(unsigned h = 0; h < harts->num_harts; h++)
+    {
+        harts->harts[h].seconds = harts->seconds;
+        ran &= !harts->harts[h].faulted;
+        freeCoroutine(&harts->harts[h].co);
+    }
+    return ran;
+}
+
+void printHartStats(Harts *harts)
+{
+    // A hart's rate is over the time it spent running, or the whole run if the
+    // harts took turns on one thread, the total is over the whole run
+    Tick instrs = 0;
+    for(unsigned h = 0; h < harts->num_harts; h++)
+    {
+        Hart *hart = &harts->harts[h];
+        instrs += hart->core->clk;
+        printf("Hart %u: %lu instructions, PC %lu%s, %.3f MIPS\n", h, hart->core->clk, hart->core->PC,
+               hart->faulted ? " (faulted)" : "", hart->seconds > 0 ? hart->core->clk / hart->seconds / 1e6 : 0.0);
+    }
+    printf("%u harts, %lu rounds of %lu: %lu instructions in %.6f s, %.3f MIPS\n", harts->num_harts, harts->rounds,
+           harts->quantum, instrs, harts->seconds, harts->seconds > 0 ? instrs / harts->seconds / 1e6 : 0.0);
+}
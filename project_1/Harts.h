@@ -0,0 +1,70 @@
+#ifndef __HARTS_H__
+#define __HARTS_H__
+
+#include "Core.h"
+#include "Coroutine.h"
+
+#include <pthread.h>
+#include <setjmp.h>
+
+#define DEFAULT_QUANTUM 1000 // Instructions each hart runs between barriers
+#define DEFAULT_HARTS_MB 64 // Flat memory the harts share when -F doesn't size it
+#define HART_STACK_SIZE (64UL << 10) // Apart from each other below elfStackTop()
+#define HART_COROUTINE_STACK (256UL << 10) // Host stack of an interleaved hart
+
+// Several harts running one program out of one shared data memory, each a Core
+// with its own registers, hartid, decode cache and blocks, on its own host
+// thread. a0 starts out as the hartid, the way a boot loader hands it over.
+//
+// Each round every hart runs until its clk reaches the next multiple of the
+// quantum, then waits at a barrier for the others, so how far the harts are
+// apart at any round never depends on how the host schedules the threads.
+// Stores reach the other harts the way the host makes them visible, a guest
+// that races inside a quantum gets whatever the race gives it.
+//
+// Paged memory keeps its caches and page table in the Memory itself, so
+// harts on threads always share flat memory, which is nothing but a host mapping.
+//
+// interleaveHarts() runs them all on the calling thread instead, each hart's
+// loop a coroutine that switches back to the scheduler after its turn of
+// quantum instructions, and the scheduler goes round them in hartid order. No
+// barriers or atomics, the same interleaving every run down to a quantum of 1,
+// and any memory can be shared.
+struct Harts;
+
+typedef struct Hart Hart;
+typedef struct Hart
+{
+    Core *core;
+    struct Harts *harts;
+    pthread_t thread;
+    Coroutine co; // Interleaved, the loop tickFunc() runs in
+    sigjmp_buf *env; // Where a fault takes an interleaved hart, NULL until it starts
+    bool done; // Ran off the end of the program or faulted
+    bool faulted;
+    double seconds; // Spent running, not waiting at the barrier
+} Hart;
+
+typedef struct Harts Harts;
+typedef struct Harts
+{
+    Hart *harts;
+    unsigned num_harts;
+    Memory *data_mem; // The first hart's, the others point at it
+    Tick quantum;
+    Tick rounds; // Including the one the last hart finished in
+    double seconds; // The whole run, start to last hart done
+
+    pthread_barrier_t barrier;
+    bool finished; // Every hart is done, decided at the end of each round
+    Coroutine scheduler; // What interleaved harts switch back to
+} Harts;
+
+// flat_size 0 shares paged memory, only interleaveHarts() can run on that
+Harts *initHarts(Instruction_Memory *i_mem, unsigned num_harts, size_t flat_size);
+void freeHarts(Harts *harts);
+bool runHarts(Harts *harts, Tick quantum);
+bool interleaveHarts(Harts *harts, Tick quantum);
+void printHartStats(Harts *harts);
+
+#endif
@@ -6,14 +6,4 @@
 typedef uint64_t Addr;
 typedef uint64_t Tick;
 
-typedef struct
-{
-    // Byte-addressable address
-    Addr addr;
-
-    // This is the translated binary format of assembly input
-    unsigned int instruction;
-
-}Instruction;
-
 #endif
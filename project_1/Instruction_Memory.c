@@ -0,0 +1,52 @@
+#include "Instruction_Memory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+void initInstructionMemory(Instruction_Memory *i_mem)
+{
+    i_mem->words = NULL;
+    i_mem->num_instrs = 0;
+    i_mem->last_addr = 0;
+    i_mem->mapping = NULL;
+    i_mem->mapping_size = 0;
+}
+
+uint32_t *imemAlloc(Instruction_Memory *i_mem, size_t num_instrs)
+{
+    // Replaces the old program. The words start out as zero and only the pages
+    // the loader writes to are backed.
+    freeInstructionMemory(i_mem);
+    if(num_instrs == 0)
+        return NULL;
+
+    size_t size = num_instrs * sizeof(uint32_t);
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mapping == MAP_FAILED)
+    {
+        perror("Cannot map instruction memory");
+        exit(EXIT_FAILURE);
+    }
+
+    imemMap(i_mem, mapping, size, (uint32_t *)mapping, num_instrs);
+    return i_mem->words;
+}
+
+void imemMap(Instruction_Memory *i_mem, void *mapping, size_t mapping_size, uint32_t *words, size_t num_instrs)
+{
+    // Takes ownership of the mapping, words has to lie inside it
+    freeInstructionMemory(i_mem);
+    i_mem->words = words;
+    i_mem->num_instrs = num_instrs;
+    i_mem->last_addr = num_instrs != 0 ? (num_instrs - 1) * 4 : 0;
+    i_mem->mapping = mapping;
+    i_mem->mapping_size = mapping_size;
+}
+
+void freeInstructionMemory(Instruction_Memory *i_mem)
+{
+    if(i_mem->mapping != NULL)
+        munmap(i_mem->mapping, i_mem->mapping_size);
+    initInstructionMemory(i_mem);
+}
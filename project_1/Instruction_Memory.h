@@ -3,12 +3,34 @@
 
 #include "Instruction.h"
 
-#define IMEM_SIZE 256
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMEM_MAX_BYTES (1UL << 32) // Code has to sit below this
+
+// The program as raw encodings, one word per PC / 4 from 0 to last_addr.
+// words is either an anonymous mapping, so pages nobody writes or fetches
+// never get host memory, or points straight into a mapped .rvbin image.
+// Decoding is left to whoever fetches from it.
 typedef struct
 {
-    Instruction instructions[IMEM_SIZE];
+    uint32_t *words;
+    size_t num_instrs; // 0 for an empty program
+    Addr last_addr; // PC of the last instruction
 
-    Instruction *last; // Points to the last instruction
+    void *mapping; // What words lives in, NULL if nothing is mapped
+    size_t mapping_size;
 }Instruction_Memory;
 
+void initInstructionMemory(Instruction_Memory *i_mem);
+uint32_t *imemAlloc(Instruction_Memory *i_mem, size_t num_instrs);
+void imemMap(Instruction_Memory *i_mem, void *mapping, size_t mapping_size, uint32_t *words, size_t num_instrs);
+void freeInstructionMemory(Instruction_Memory *i_mem);
+
+// Past the end of the program reads as 0, which doesn't decode to anything
+static inline uint32_t imemFetch(const Instruction_Memory *i_mem, Addr PC)
+{
+    return PC / 4 < i_mem->num_instrs ? i_mem->words[PC / 4] : 0;
+}
+
 #endif
@@ -0,0 +1,226 @@
+#include "Isa.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ISA_ENTRY(name, format, opcode, funct3, funct7, alu_ctrl, ctrl) \
+    { #name, format, opcode, funct3, funct7, alu_ctrl, ctrl },
+
+const IsaEntry ISA[] = { ISA_TABLE(ISA_ENTRY) };
+const size_t NUM_ISA_ENTRIES = sizeof(ISA) / sizeof(ISA[0]);
+
+// Decode table indexed by opcode, funct3 and funct7's only meaningful bit (0x20)
+#define DECODE_KEY(opcode, funct3, funct7) (((opcode) << 4) | ((funct3) << 1) | (((funct7) >> 5) & 1))
+#define DECODE_TABLE_SIZE (1 << 11)
+#define NOT_AN_INSTRUCTION 0xFF
+
+// Atomics all share one opcode and funct3 pair, funct5 tells them apart
+#define ATOMIC_KEY(funct3, funct7) ((((funct3) & 1) << 5) | ((funct7) >> 2))
+#define ATOMIC_TABLE_SIZE (1 << 6)
+
+static uint8_t decode_table[DECODE_TABLE_SIZE];
+static uint8_t atomic_table[ATOMIC_TABLE_SIZE];
+static pthread_once_t decode_table_once = PTHREAD_ONCE_INIT; // Batch workers decode on their own threads
+
+// Perfect hash of the mnemonics, packed little-endian into two words. The
+// multiplier is searched for once, so new rows in ISA_TABLE never need the
+// table touched.
+#define MNEMONIC_SLOT_BITS 8
+#define MNEMONIC_SLOTS (1 << MNEMONIC_SLOT_BITS)
+
+typedef struct Mnemonic_Key Mnemonic_Key;
+typedef struct Mnemonic_Key
+{
+    uint64_t lo;
+    uint64_t hi;
+} Mnemonic_Key;
+
+static Mnemonic_Key mnemonic_keys[MNEMONIC_SLOTS]; // 0 where empty
+static uint8_t mnemonic_entries[MNEMONIC_SLOTS];
+static uint64_t mnemonic_mult;
+static pthread_once_t mnemonic_table_once = PTHREAD_ONCE_INIT; // The parser looks mnemonics up from several threads
+
+static Mnemonic_Key packMnemonic(const char *mnemonic, size_t len)
+{
+    // Nothing in the ISA is longer than two words, so longer names just don't match
+    Mnemonic_Key key = { 0, 0 };
+    if(len == 0 || len > sizeof(key))
+        return key;
+    memcpy(&key, mnemonic, len);
+    return key;
+}
+
+static size_t mnemonicSlot(Mnemonic_Key key)
+{
+    return ((key.lo ^ (key.hi * 0x9E3779B97F4A7C15UL)) * mnemonic_mult) >> (64 - MNEMONIC_SLOT_BITS);
+}
+
+static void buildMnemonicTable()
+{
+    uint64_t seed = 0x9E3779B97F4A7C15UL;
+    for(unsigned attempt = 0; attempt < (1 << 20); attempt++)
+    {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        mnemonic_mult = seed | 1;
+        memset(mnemonic_keys, 0, sizeof(mnemonic_keys));
+
+        size_t i;
+        for(i = 0; i < NUM_ISA_ENTRIES; i++)
+        {
+            Mnemonic_Key key = packMnemonic(ISA[i].mnemonic, strlen(ISA[i].mnemonic));
+            size_t slot = mnemonicSlot(key);
+            if(mnemonic_keys[slot].lo != 0)
+                break;
+            mnemonic_keys[slot] = key;
+            mnemonic_entries[slot] = i;
+        }
+        if(i == NUM_ISA_ENTRIES)
+            return;
+    }
+
+    fprintf(stderr, "No perfect hash for the %zu mnemonics in %d slots\n", NUM_ISA_ENTRIES, MNEMONIC_SLOTS);
+    exit(EXIT_FAILURE);
+}
+
+static void buildDecodeTable(void)
+{
+    memset(decode_table, NOT_AN_INSTRUCTION, sizeof(decode_table));
+    memset(atomic_table, NOT_AN_INSTRUCTION, sizeof(atomic_table));
+    for(size_t i = 0; i < NUM_ISA_ENTRIES; i++)
+    {
+        const IsaEntry *entry = &ISA[i];
+
+        // Formats without funct3/funct7 carry immediate bits there, so they match any value
+        for(unsigned funct3 = 0; funct3 < 8; funct3++)
+        {
+            if(entry->format != FMT_J && funct3 != entry->funct3)
+                continue;
+            for(unsigned funct7 = 0; funct7 <= 0b0100000; funct7 += 0b0100000)
+            {
+                if(entry->format == FMT_R && funct7 != (entry->funct7 & 0b0100000))
+                    continue;
+                decode_table[DECODE_KEY(entry->opcode, funct3, funct7)] = i;
+            }
+        }
+        if(entry->format == FMT_AMO || entry->format == FMT_LR)
+            atomic_table[ATOMIC_KEY(entry->funct3, entry->funct7)] = i;
+    }
+}
+
+const IsaEntry *isaFind(const char *mnemonic)
+{
+    return isaLookup(mnemonic, strlen(mnemonic));
+}
+
+const IsaEntry *isaLookup(const char *mnemonic, size_t len)
+{
+    // One multiply and one compare, the name doesn't have to be NUL terminated
+    pthread_once(&mnemonic_table_once, buildMnemonicTable);
+
+    Mnemonic_Key key = packMnemonic(mnemonic, len);
+    size_t slot = mnemonicSlot(key);
+    if(key.lo == 0 || mnemonic_keys[slot].lo != key.lo || mnemonic_keys[slot].hi != key.hi)
+        return NULL;
+    return &ISA[mnemonic_entries[slot]];
+}
+
+const IsaEntry *isaDecode(unsigned instr)
+{
+    pthread_once(&decode_table_once, buildDecodeTable);
+
+    unsigned opcode = instr & 0b1111111;
+    unsigned funct3 = (instr & (0b111 << 12)) >> 12;
+    unsigned funct7 = (instr & (0b1111111 << 25)) >> 25;
+    uint8_t index = decode_table[DECODE_KEY(opcode, funct3, funct7)];
+    if(index == NOT_AN_INSTRUCTION)
+        return NULL;
+
+    // The key only has one bit of funct7, R-Type needs all of it to match
+    const IsaEntry *entry = &ISA[index];
+    if(entry->format == FMT_R && funct7 != entry->funct7)
+        return NULL;
+
+    // Any atomic's row got the key, funct5 picks the one it is. aq and rl can be anything.
+    if(entry->format == FMT_AMO || entry->format == FMT_LR)
+    {
+        index = atomic_table[ATOMIC_KEY(funct3, funct7)];
+        return index == NOT_AN_INSTRUCTION ? NULL : &ISA[index];
+    }
+    return entry;
+}
+
+unsigned isaEncode(const IsaEntry *entry, unsigned rd, unsigned rs_1, unsigned rs_2, int imm)
+{
+    unsigned instr = entry->opcode;
+    switch(entry->format)
+    {
+    case FMT_R:
+        instr |= (rd << 7);
+        instr |= (entry->funct3 << (7 + 5));
+        instr |= (rs_1 << (7 + 5 + 3));
+        instr |= (rs_2 << (7 + 5 + 3 + 5));
+        instr |= (entry->funct7 << (7 + 5 + 3 + 5 + 5));
+        break;
+    case FMT_AMO:
+    case FMT_LR:
+        // The immediate is the aq and rl bits, funct7's low two
+        instr |= (rd << 7);
+        instr |= (entry->funct3 << (7 + 5));
+        instr |= (rs_1 << (7 + 5 + 3));
+        instr |= (rs_2 << (7 + 5 + 3 + 5));
+        instr |= ((entry->funct7 | (imm & 0b11)) << (7 + 5 + 3 + 5 + 5));
+        break;
+    case FMT_I:
+    case FMT_I_MEM:
+        instr |= (rd << 7);
+        instr |= (entry->funct3 << (7 + 5));
+        instr |= (rs_1 << (7 + 5 + 3));
+        instr |= (imm << (7 + 5 + 3 + 5));
+        break;
+    case FMT_S:
+        instr |= ((imm & 0b11111) << 7);
+        instr |= (entry->funct3 << (7 + 5));
+        instr |= (rs_1 << (7 + 5 + 3));
+        instr |= (rs_2 << (7 + 5 + 3 + 5));
+        instr |= ((imm & 0b111111100000) << 20); // >> 5 << 7 + 5 + 3 + 5 + 5
+        break;
+    case FMT_B:
+        instr |= ((imm & 0b100000000000) >> 4); // >> 11 << 7
+        instr |= ((imm & 0b11110) << 7); // >> 1 << 7 + 1
+        instr |= (entry->funct3 << (7 + 1 + 4));
+        instr |= (rs_1 << (7 + 1 + 4 + 3));
+        instr |= (rs_2 << (7 + 1 + 4 + 3 + 5));
+        instr |= ((imm & 0b11111100000) << 20); // >> 5 << 7 + 1 + 4 + 3 + 5 + 5
+        instr |= ((imm & 0b1000000000000) << 19); // >> 12 << 7 + 1 + 4 + 3 + 5 + 5 + 6
+        break;
+    case FMT_J:
+        instr |= (rd << 7);
+        instr |= (imm & 0b11111111000000000000); // >> 12 << 7 + 5
+        instr |= ((imm & 0b100000000000) << 9); // >> 11 << 7 + 5 + 8
+        instr |= ((imm & 0b11111111110) << 20); // >> 1 << 7 + 5 + 8 + 1
+        instr |= ((imm & 0b100000000000000000000) << 11); // >> 20 << 7 + 5 + 8 + 1 + 10;
+        break;
+    }
+    return instr;
+}
+
+bool isaImmFits(const IsaEntry *entry, int64_t imm)
+{
+    // Whether isaEncode() can fit imm in the format's field: 12 bits for I and S,
+    // 13 and 21 for B and J, whose offsets are even. R has none, and the
+    // atomics' is only the aq and rl bits the parser picked.
+    switch(entry->format)
+    {
+    case FMT_I:
+    case FMT_I_MEM:
+    case FMT_S:
+        return imm >= -(1 << 11) && imm < (1 << 11);
+    case FMT_B:
+        return imm >= -(1 << 12) && imm < (1 << 12) && imm % 2 == 0;
+    case FMT_J:
+        return imm >= -(1 << 20) && imm < (1 << 20) && imm % 2 == 0;
+    default:
+        return true;
+    }
+}
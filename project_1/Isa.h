@@ -0,0 +1,126 @@
+#ifndef __ISA_H__
+#define __ISA_H__
+
+#include "Core.h"
+#include "Lsu.h"
+
+// ALU Control lines, see alu()
+#define ALU_AND 0b0000
+#define ALU_OR  0b0001
+#define ALU_ADD 0b0010
+#define ALU_SLL 0b0011
+#define ALU_SRL 0b0100
+#define ALU_XOR 0b0101
+#define ALU_SUB 0b0110
+#define ALU_SLT 0b0111
+
+// Main control output for each kind of instruction
+//                  regWrite aluSrc memWrite aluOp memToReg memRead beq bne blt bge jal jalr atomic
+#define CTRL_OP     { 1,     0,     0,       0b10, 0,       0,      0,  0,  0,  0,  0,  0,  0 }
+#define CTRL_OP_IMM { 1,     1,     0,       0b10, 0,       0,      0,  0,  0,  0,  0,  0,  0 }
+#define CTRL_LOAD   { 1,     1,     0,       0b00, 1,       1,      0,  0,  0,  0,  0,  0,  0 }
+#define CTRL_STORE  { 0,     1,     1,       0b00, 0,       0,      0,  0,  0,  0,  0,  0,  0 }
+#define CTRL_BEQ    { 0,     0,     0,       0b01, 0,       0,      1,  0,  0,  0,  0,  0,  0 }
+#define CTRL_BNE    { 0,     0,     0,       0b01, 0,       0,      0,  1,  0,  0,  0,  0,  0 }
+#define CTRL_BLT    { 0,     0,     0,       0b01, 0,       0,      0,  0,  1,  0,  0,  0,  0 }
+#define CTRL_BGE    { 0,     0,     0,       0b01, 0,       0,      0,  0,  0,  1,  0,  0,  0 }
+#define CTRL_JAL    { 1,     0,     0,       0b00, 0,       0,      0,  0,  0,  0,  1,  0,  0 }
+#define CTRL_JALR   { 1,     1,     0,       0b00, 0,       0,      0,  0,  0,  0,  0,  1,  0 }
+#define CTRL_LR     { 1,     1,     0,       0b00, 1,       1,      0,  0,  0,  0,  0,  0,  1 }
+#define CTRL_AMO    { 1,     1,     1,       0b00, 1,       1,      0,  0,  0,  0,  0,  0,  1 }
+
+typedef enum IsaFormat
+{
+    FMT_R,
+    FMT_I,
+    FMT_I_MEM, // I-Type written as rd, offset(rs1)
+    FMT_S,
+    FMT_B,
+    FMT_J,
+    FMT_AMO, // R-Type written as rd, rs2, (rs1), funct7 is funct5 and the aq/rl bits
+    FMT_LR // FMT_AMO without rs2
+} IsaFormat;
+
+// The whole ISA, one instruction per row. The assembler, control(), buildImm()
+// and the decoders are all driven by this, so adding an instruction is one line.
+// Atomics compute their address with the ALU (rs1 + 0) like a load does, and
+// their funct7 is funct5 with aq and rl clear.
+//  X(mnemonic, format, opcode, funct3, funct7, ALU Control, control)
+#define ISA_TABLE(X) \
+    X(add,  FMT_R,     0b0110011, 0b000, 0b0000000, ALU_ADD, CTRL_OP)     \
+    X(sub,  FMT_R,     0b0110011, 0b000, 0b0100000, ALU_SUB, CTRL_OP)     \
+    X(sll,  FMT_R,     0b0110011, 0b001, 0b0000000, ALU_SLL, CTRL_OP)     \
+    X(slt,  FMT_R,     0b0110011, 0b010, 0b0000000, ALU_SLT, CTRL_OP)     \
+    X(xor,  FMT_R,     0b0110011, 0b100, 0b0000000, ALU_XOR, CTRL_OP)     \
+    X(srl,  FMT_R,     0b0110011, 0b101, 0b0000000, ALU_SRL, CTRL_OP)     \
+    X(or,   FMT_R,     0b0110011, 0b110, 0b0000000, ALU_OR,  CTRL_OP)     \
+    X(and,  FMT_R,     0b0110011, 0b111, 0b0000000, ALU_AND, CTRL_OP)     \
+    X(addi, FMT_I,     0b0010011, 0b000, 0b0000000, ALU_ADD, CTRL_OP_IMM) \
+    X(slli, FMT_I,     0b0010011, 0b001, 0b0000000, ALU_SLL, CTRL_OP_IMM) \
+    X(slti, FMT_I,     0b0010011, 0b010, 0b0000000, ALU_SLT, CTRL_OP_IMM) \
+    X(xori, FMT_I,     0b0010011, 0b100, 0b0000000, ALU_XOR, CTRL_OP_IMM) \
+    X(srli, FMT_I,     0b0010011, 0b101, 0b0000000, ALU_SRL, CTRL_OP_IMM) \
+    X(ori,  FMT_I,     0b0010011, 0b110, 0b0000000, ALU_OR,  CTRL_OP_IMM) \
+    X(andi, FMT_I,     0b0010011, 0b111, 0b0000000, ALU_AND, CTRL_OP_IMM) \
+    X(lb,   FMT_I_MEM, 0b0000011, 0b000, 0b0000000, ALU_ADD, CTRL_LOAD)   \
+    X(lh,   FMT_I_MEM, 0b0000011, 0b001, 0b0000000, ALU_ADD, CTRL_LOAD)   \
+    X(lw,   FMT_I_MEM, 0b0000011, 0b010, 0b0000000, ALU_ADD, CTRL_LOAD)   \
+    X(ld,   FMT_I_MEM, 0b0000011, 0b011, 0b0000000, ALU_ADD, CTRL_LOAD)   \
+    X(lbu,  FMT_I_MEM, 0b0000011, 0b100, 0b0000000, ALU_ADD, CTRL_LOAD)   \
+    X(lhu,  FMT_I_MEM, 0b0000011, 0b101, 0b0000000, ALU_ADD, CTRL_LOAD)   \
+    X(lwu,  FMT_I_MEM, 0b0000011, 0b110, 0b0000000, ALU_ADD, CTRL_LOAD)   \
+    X(jalr, FMT_I_MEM, 0b1100111, 0b000, 0b0000000, ALU_ADD, CTRL_JALR)   \
+    X(sb,   FMT_S,     0b0100011, 0b000, 0b0000000, ALU_ADD, CTRL_STORE)  \
+    X(sh,   FMT_S,     0b0100011, 0b001, 0b0000000, ALU_ADD, CTRL_STORE)  \
+    X(sw,   FMT_S,     0b0100011, 0b010, 0b0000000, ALU_ADD, CTRL_STORE)  \
+    X(sd,   FMT_S,     0b0100011, 0b011, 0b0000000, ALU_ADD, CTRL_STORE)  \
+    X(beq,  FMT_B,     0b1100011, 0b000, 0b0000000, ALU_SUB, CTRL_BEQ)    \
+    X(bne,  FMT_B,     0b1100011, 0b001, 0b0000000, ALU_SUB, CTRL_BNE)    \
+    X(blt,  FMT_B,     0b1100011, 0b100, 0b0000000, ALU_SLT, CTRL_BLT)    \
+    X(bge,  FMT_B,     0b1100011, 0b101, 0b0000000, ALU_SLT, CTRL_BGE)    \
+    X(jal,  FMT_J,     0b1101111, 0b000, 0b0000000, ALU_ADD, CTRL_JAL)    \
+    X(lr.w,      FMT_LR,    0b0101111, 0b010, 0b0001000, ALU_ADD, CTRL_LR)     \
+    X(sc.w,      FMT_AMO,   0b0101111, 0b010, 0b0001100, ALU_ADD, CTRL_AMO)    \
+    X(amoswap.w, FMT_AMO,   0b0101111, 0b010, 0b0000100, ALU_ADD, CTRL_AMO)    \
+    X(amoadd.w,  FMT_AMO,   0b0101111, 0b010, 0b0000000, ALU_ADD, CTRL_AMO)    \
+    X(amoxor.w,  FMT_AMO,   0b0101111, 0b010, 0b0010000, ALU_ADD, CTRL_AMO)    \
+    X(amoand.w,  FMT_AMO,   0b0101111, 0b010, 0b0110000, ALU_ADD, CTRL_AMO)    \
+    X(amoor.w,   FMT_AMO,   0b0101111, 0b010, 0b0100000, ALU_ADD, CTRL_AMO)    \
+    X(amomin.w,  FMT_AMO,   0b0101111, 0b010, 0b1000000, ALU_ADD, CTRL_AMO)    \
+    X(amomax.w,  FMT_AMO,   0b0101111, 0b010, 0b1010000, ALU_ADD, CTRL_AMO)    \
+    X(amominu.w, FMT_AMO,   0b0101111, 0b010, 0b1100000, ALU_ADD, CTRL_AMO)    \
+    X(amomaxu.w, FMT_AMO,   0b0101111, 0b010, 0b1110000, ALU_ADD, CTRL_AMO)    \
+    X(lr.d,      FMT_LR,    0b0101111, 0b011, 0b0001000, ALU_ADD, CTRL_LR)     \
+    X(sc.d,      FMT_AMO,   0b0101111, 0b011, 0b0001100, ALU_ADD, CTRL_AMO)    \
+    X(amoswap.d, FMT_AMO,   0b0101111, 0b011, 0b0000100, ALU_ADD, CTRL_AMO)    \
+    X(amoadd.d,  FMT_AMO,   0b0101111, 0b011, 0b0000000, ALU_ADD, CTRL_AMO)    \
+    X(amoxor.d,  FMT_AMO,   0b0101111, 0b011, 0b0010000, ALU_ADD, CTRL_AMO)    \
+    X(amoand.d,  FMT_AMO,   0b0101111, 0b011, 0b0110000, ALU_ADD, CTRL_AMO)    \
+    X(amoor.d,   FMT_AMO,   0b0101111, 0b011, 0b0100000, ALU_ADD, CTRL_AMO)    \
+    X(amomin.d,  FMT_AMO,   0b0101111, 0b011, 0b1000000, ALU_ADD, CTRL_AMO)    \
+    X(amomax.d,  FMT_AMO,   0b0101111, 0b011, 0b1010000, ALU_ADD, CTRL_AMO)    \
+    X(amominu.d, FMT_AMO,   0b0101111, 0b011, 0b1100000, ALU_ADD, CTRL_AMO)    \
+    X(amomaxu.d, FMT_AMO,   0b0101111, 0b011, 0b1110000, ALU_ADD, CTRL_AMO)
+
+typedef struct IsaEntry IsaEntry;
+typedef struct IsaEntry
+{
+    const char *mnemonic;
+    IsaFormat format;
+    uint8_t opcode;
+    uint8_t funct3;
+    uint8_t funct7;
+    uint8_t alu_ctrl;
+    ControlSignals ctrl;
+} IsaEntry;
+
+extern const IsaEntry ISA[];
+extern const size_t NUM_ISA_ENTRIES;
+
+const IsaEntry *isaFind(const char *mnemonic);
+const IsaEntry *isaLookup(const char *mnemonic, size_t len);
+const IsaEntry *isaDecode(unsigned instr);
+unsigned isaEncode(const IsaEntry *entry, unsigned rd, unsigned rs_1, unsigned rs_2, int imm);
+bool isaImmFits(const IsaEntry *entry, int64_t imm);
+
+#endif
@@ -0,0 +1,733 @@
+#include "Jit.h"
+#include "Block.h"
+#include "Threaded.h"
+#include "Lsu.h"
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define JIT_MAX_INSTR_BYTES 160 // Worst case x86-64 for one guest instruction, a flat load with its slow path
+#define JIT_MAX_BLOCK_INSTRS 256
+#define JIT_EXIT_BYTES 11 // mov rax, imm64; ret -- or a patched jmp rel32 and padding
+
+// Host registers used by the generated code
+#define RAX 0
+#define RCX 1
+#define RDX 2 // &core->clk
+#define RSI 6 // data_mem
+#define RDI 7 // reg_file base
+
+typedef struct Emitter Emitter;
+typedef struct Emitter
+{
+    uint8_t *p;
+    uint8_t *start; // Of the block being emitted, and its PC
+    Addr PC;
+} Emitter;
+
+static void emit8(Emitter *e, uint8_t byte)
+{
+    *e->p++ = byte;
+}
+
+static void emit32(Emitter *e, uint32_t word)
+{
+    memcpy(e->p, &word, sizeof(word));
+    e->p += sizeof(word);
+}
+
+static void emit64(Emitter *e, uint64_t dword)
+{
+    memcpy(e->p, &dword, sizeof(dword));
+    e->p += sizeof(dword);
+}
+
+// mov host, [rdi + guest * 8]
+static void emitLoadReg(Emitter *e, uint8_t host, uint8_t guest)
+{
+    emit8(e, 0x48);
+    emit8(e, 0x8B);
+    emit8(e, 0x80 | (host << 3) | RDI);
+    emit32(e, guest * 8);
+}
+
+// mov [rdi + guest * 8], host
+static void emitStoreReg(Emitter *e, uint8_t guest, uint8_t host)
+{
+    emit8(e, 0x48);
+    emit8(e, 0x89);
+    emit8(e, 0x80 | (host << 3) | RDI);
+    emit32(e, guest * 8);
+}
+
+// mov host, imm64
+static void emitMovImm(Emitter *e, uint8_t host, uint64_t imm)
+{
+    emit8(e, 0x48);
+    emit8(e, 0xB8 | host);
+    emit64(e, imm);
+}
+
+// <op> rax, rcx
+static void emitAluReg(Emitter *e, uint8_t opcode)
+{
+    emit8(e, 0x48);
+    emit8(e, opcode);
+    emit8(e, 0xC8);
+}
+
+// <op> rax, imm32 (sign-extended)
+static void emitAluImm(Emitter *e, uint8_t opcode, int32_t imm)
+{
+    emit8(e, 0x48);
+    emit8(e, opcode);
+    emit32(e, imm);
+}
+
+// setl al; movzx eax, al
+static void emitSetLess(Emitter *e)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0x9C);
+    emit8(e, 0xC0);
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emit8(e, 0xC0);
+}
+
+// mov dst, src
+static void emitMovReg(Emitter *e, uint8_t dst, uint8_t src)
+{
+    emit8(e, 0x48);
+    emit8(e, 0x89);
+    emit8(e, 0xC0 | (src << 3) | dst);
+}
+
+// jcc/jmp rel32 with the offset left for patchRel32(), returns where it goes
+static uint8_t *emitJump(Emitter *e, uint8_t opcode)
+{
+    if(opcode != 0xE9)
+        emit8(e, 0x0F);
+    emit8(e, opcode);
+    uint8_t *rel = e->p;
+    emit32(e, 0);
+    return rel;
+}
+
+static void patchRel32(uint8_t *rel, uint8_t *target)
+{
+    int32_t offset = target - (rel + 4);
+    memcpy(rel, &offset, sizeof(offset));
+}
+
+// test al, size - 1; jnz -- NULL for bytes, which are always aligned
+static uint8_t *emitAlignCheck(Emitter *e, unsigned size)
+{
+    if(size == 1)
+        return NULL;
+    emit8(e, 0xA8);
+    emit8(e, size - 1);
+    return emitJump(e, 0x85);
+}
+
+// rax = rs_1 + imm, and rcx = its host address when the access is aligned to
+// its size and inside data_mem's cached page for loads or for stores. Being
+// aligned, it can't run off the end of the page. Anything else takes one of
+// the jumps in slow[], which are NULL where there's nothing to check.
+static void emitAddress(Jit *jit, Emitter *e, DecodedInstruction *decoded, unsigned size, bool store, uint8_t *slow[2])
+{
+    emitLoadReg(e, RAX, decoded->rs_1);
+    emitAluImm(e, 0x05, decoded->imm);
+
+    // shr rcx, page_bits; cmp rcx, [rsi + last_page or write_page]; jne slow
+    emitMovReg(e, RCX, RAX);
+    emit8(e, 0x48);
+    emit8(e, 0xC1);
+    emit8(e, 0xE9);
+    emit8(e, jit->page_bits);
+    emit8(e, 0x48);
+    emit8(e, 0x3B);
+    emit8(e, 0x80 | (RCX << 3) | RSI);
+    emit32(e, store ? offsetof(Memory, write_page) : offsetof(Memory, last_page));
+    slow[0] = emitJump(e, 0x85);
+    slow[1] = emitAlignCheck(e, size);
+
+    // and rcx, page_mask
+    emitMovReg(e, RCX, RAX);
+    emit8(e, 0x48);
+    emit8(e, 0x81);
+    emit8(e, 0xE1);
+    emit32(e, (1U << jit->page_bits) - 1);
+
+    // add rcx, [rsi + last_data or write_data]
+    emit8(e, 0x48);
+    emit8(e, 0x03);
+    emit8(e, 0x80 | (RCX << 3) | RSI);
+    emit32(e, store ? offsetof(Memory, write_data) : offsetof(Memory, last_data));
+}
+
+// mov ecx, imm32; mov [rdx + field - clk], rcx -- a Core field next to clk.
+// Through ecx, which zero-extends, so a PC from 2GB up isn't sign-extended.
+static void emitCoreStore(Emitter *e, size_t field, uint32_t imm)
+{
+    emit8(e, 0xB8 | RCX);
+    emit32(e, imm);
+    emit8(e, 0x48);
+    emit8(e, 0x89);
+    emit8(e, 0x80 | (RCX << 3) | RDX);
+    emit32(e, field - offsetof(Core, clk));
+}
+
+// rcx = base + rs_1 + imm in flat memory. One test covers the alignment and the
+// upper 32 bits, past the end below FLAT_SPAN is a guard page. PC goes to
+// core->PC first for the fault report, the handler works out the address.
+static void emitFlatAddress(Jit *jit, Emitter *e, DecodedInstruction *decoded, unsigned size, Addr PC, uint8_t *slow[2])
+{
+    emitLoadReg(e, RAX, decoded->rs_1);
+    emitAluImm(e, 0x05, decoded->imm);
+    emitCoreStore(e, offsetof(Core, PC), PC);
+
+    // test rax, ~(FLAT_SPAN - 1) | (size - 1); jnz slow
+    emitMovImm(e, RCX, ~(FLAT_SPAN - 1) | (size - 1));
+    emit8(e, 0x48);
+    emit8(e, 0x85);
+    emit8(e, 0xC0 | (RCX << 3) | RAX);
+    slow[0] = NULL;
+    slow[1] = emitJump(e, 0x85);
+
+    emitMovImm(e, RCX, (uint64_t)jit->flat_base);
+    emit8(e, 0x48); // add rcx, rax
+    emit8(e, 0x01);
+    emit8(e, 0xC1);
+}
+
+// rax = the size bytes at [rcx], zero-extended
+static void emitHostLoad(Emitter *e, unsigned size)
+{
+    if(size == 8)
+        emit8(e, 0x48); // mov rax, [rcx]
+    if(size == 1 || size == 2)
+    {
+        emit8(e, 0x0F); // movzx eax, byte or word [rcx]
+        emit8(e, size == 1 ? 0xB6 : 0xB7);
+    }
+    else
+        emit8(e, 0x8B); // mov eax, [rcx]
+    emit8(e, 0x01);
+}
+
+// The low size bytes of rax to [rcx]
+static void emitHostStore(Emitter *e, unsigned size)
+{
+    if(size == 2)
+        emit8(e, 0x66);
+    else if(size == 8)
+        emit8(e, 0x48);
+    emit8(e, size == 1 ? 0x88 : 0x89); // mov [rcx], al, ax, eax or rax
+    emit8(e, 0x01);
+}
+
+// Sign-extend the low size bytes of rax
+static void emitSignExtend(Emitter *e, unsigned size)
+{
+    emit8(e, 0x48);
+    if(size == 4)
+        emit8(e, 0x63); // movsxd rax, eax
+    else
+    {
+        emit8(e, 0x0F); // movsx rax, al or ax
+        emit8(e, size == 1 ? 0xBE : 0xBF);
+    }
+    emit8(e, 0xC0);
+}
+
+// Call fn(data_mem, rax, ...) with the live rdi, rsi and rdx saved around it:
+// fn(data_mem, addr, size) for loads, fn(data_mem, addr, rs_2, size) for stores.
+// Blocks are entered with rsp 8 off 16-byte alignment, the pushes realign it.
+static void emitMemCall(Emitter *e, void *fn, DecodedInstruction *store, unsigned size)
+{
+    emit8(e, 0x57); // push rdi
+    emit8(e, 0x56); // push rsi
+    emit8(e, 0x52); // push rdx
+    if(store != NULL)
+    {
+        emitLoadReg(e, RDX, store->rs_2);
+        emit8(e, 0xB8 | RCX); // mov ecx, size
+    }
+    else
+        emit8(e, 0xB8 | RDX); // mov edx, size
+    emit32(e, size);
+    emitMovReg(e, RDI, RSI);
+    emitMovReg(e, RSI, RAX);
+    emitMovImm(e, RAX, (uint64_t)fn);
+    emit8(e, 0xFF); // call rax
+    emit8(e, 0xD0);
+    emit8(e, 0x5A); // pop rdx
+    emit8(e, 0x5E); // pop rsi
+    emit8(e, 0x5F); // pop rdi
+}
+
+// The fast path just emitted jumps over a call to fn, which the checks in slow[] lead to.
+// A device there can end the run, so PC goes to core->PC first as it does for flat memory.
+static void emitSlowPath(Emitter *e, uint8_t *slow[2], void *fn, DecodedInstruction *store, unsigned size, Addr PC)
+{
+    if(slow[0] == NULL && slow[1] == NULL)
+        return;
+
+    uint8_t *done = emitJump(e, 0xE9);
+    for(int i = 0; i < 2; i++)
+    {
+        if(slow[i] != NULL)
+            patchRel32(slow[i], e->p);
+    }
+    emitCoreStore(e, offsetof(Core, PC), PC);
+    emitMemCall(e, fn, store, size);
+    patchRel32(done, e->p);
+}
+
+// Leave for runJit() before anything runs if a store reached decoded code and
+// memCodeWritten() hasn't dropped it yet, chained jumps would go on into old code.
+// cmp dword [rsi + code_written], 0; je over mov rax, PC; ret
+static void emitCodeCheck(Emitter *e, Addr PC)
+{
+    emit8(e, 0x83);
+    emit8(e, 0x80 | (7 << 3) | RSI);
+    emit32(e, offsetof(Memory, code_written));
+    emit8(e, 0x00);
+    uint8_t *skip = emitJump(e, 0x84);
+    emitMovImm(e, RAX, PC);
+    emit8(e, 0xC3);
+    patchRel32(skip, e->p);
+}
+
+// add qword [rdx], n -- clk counts a block's instructions at its exits, once they have all run
+static void emitCount(Emitter *e, uint32_t n)
+{
+    emit8(e, 0x48);
+    emit8(e, 0x81);
+    emit8(e, 0x02);
+    emit32(e, n);
+}
+
+// The page PC's block is in, allocated the first time it's needed
+static JitPage *jitPage(Jit *jit, Addr PC)
+{
+    size_t index = PC >> DECODE_PAGE_SHIFT;
+    if(jit->pages[index] == NULL)
+    {
+        jit->pages[index] = (JitPage *)calloc(1, sizeof(JitPage));
+        if(jit->pages[index] == NULL)
+        {
+            perror("Cannot allocate JIT page");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return jit->pages[index];
+}
+
+JitBlock *jitBlock(Jit *jit, Addr PC)
+{
+    return &jitPage(jit, PC)->blocks[(PC / 4) & ((1 << DECODE_PAGE_BITS) - 1)];
+}
+
+// Exits waiting for the block at PC
+static JitPatch **jitPatches(Jit *jit, Addr PC)
+{
+    return &jitPage(jit, PC)->patches[(PC / 4) & ((1 << DECODE_PAGE_BITS) - 1)];
+}
+
+// jmp rel32 from site to target
+static void patchJump(uint8_t *site, uint8_t *target)
+{
+    int32_t rel = target - (site + 5);
+    site[0] = 0xE9;
+    memcpy(&site[1], &rel, sizeof(rel));
+}
+
+// Leave the block for next_PC. Jumps straight into the successor if it has
+// been translated, otherwise returns to runJit() and asks to be patched
+// once the successor exists.
+static void emitExit(Jit *jit, Emitter *e, Addr next_PC)
+{
+    uint8_t *site = e->p;
+    emitMovImm(e, RAX, next_PC);
+    emit8(e, 0xC3);
+
+    if(next_PC % 4 != 0 || next_PC / 4 >= jit->num_instrs)
+        return;
+
+    JitBlock *successor = jitBlock(jit, next_PC);
+    if(successor->code != NULL)
+    {
+        patchJump(site, (uint8_t *)successor->code);
+        return;
+    }
+
+    JitPatch *patch = (JitPatch *)malloc(sizeof(JitPatch));
+    patch->site = site;
+    patch->owner = e->PC;
+    patch->owner_code = e->start;
+    JitPatch **waiting = jitPatches(jit, next_PC);
+    patch->next = *waiting;
+    *waiting = patch;
+}
+
+// Returns false if the instruction has to be left to the interpreter
+static bool emitInstruction(Jit *jit, Emitter *e, ThreadedOpcode opcode, DecodedInstruction *decoded, Addr PC)
+{
+    int32_t imm = decoded->imm;
+    unsigned size = LSU_SIZE(decoded->funct3);
+    uint8_t *slow[2];
+
+    switch(opcode)
+    {
+    case T_NOP:
+        return true;
+    case T_ADD:
+    case T_SUB:
+    case T_SLL:
+    case T_SRL:
+    case T_XOR:
+    case T_OR:
+    case T_AND:
+    case T_SLT:
+        emitLoadReg(e, RAX, decoded->rs_1);
+        emitLoadReg(e, RCX, decoded->rs_2);
+        if(opcode == T_ADD)
+            emitAluReg(e, 0x01);
+        else if(opcode == T_SUB)
+            emitAluReg(e, 0x29);
+        else if(opcode == T_XOR)
+            emitAluReg(e, 0x31);
+        else if(opcode == T_OR)
+            emitAluReg(e, 0x09);
+        else if(opcode == T_AND)
+            emitAluReg(e, 0x21);
+        else if(opcode == T_SLT)
+        {
+            emitAluReg(e, 0x39); // cmp rax, rcx
+            emitSetLess(e);
+        }
+        else
+        {
+            // shl/shr rax, cl; the hardware masks the count to six bits
+            emit8(e, 0x48);
+            emit8(e, 0xD3);
+            emit8(e, opcode == T_SLL ? 0xE0 : 0xE8);
+        }
+        emitStoreReg(e, decoded->rd, RAX);
+        return true;
+    case T_ADDI:
+    case T_XORI:
+    case T_ORI:
+    case T_ANDI:
+    case T_SLTI:
+        emitLoadReg(e, RAX, decoded->rs_1);
+        if(opcode == T_ADDI)
+            emitAluImm(e, 0x05, imm);
+        else if(opcode == T_XORI)
+            emitAluImm(e, 0x35, imm);
+        else if(opcode == T_ORI)
+            emitAluImm(e, 0x0D, imm);
+        else if(opcode == T_ANDI)
+            emitAluImm(e, 0x25, imm);
+        else
+        {
+            emitAluImm(e, 0x3D, imm); // cmp rax, imm32
+            emitSetLess(e);
+        }
+        emitStoreReg(e, decoded->rd, RAX);
+        return true;
+    case T_SLLI:
+    case T_SRLI:
+        // shl/shr rax, imm8
+        emitLoadReg(e, RAX, decoded->rs_1);
+        emit8(e, 0x48);
+        emit8(e, 0xC1);
+        emit8(e, opcode == T_SLLI ? 0xE0 : 0xE8);
+        emit8(e, imm & 0x3F);
+        emitStoreReg(e, decoded->rd, RAX);
+        return true;
+    case T_LB:
+    case T_LH:
+    case T_LW:
+    case T_LD:
+    case T_LBU:
+    case T_LHU:
+    case T_LWU:
+        // Load from [rcx] on the fast path, through memReadSlow() otherwise
+        if(jit->flat_base != NULL)
+            emitFlatAddress(jit, e, decoded, size, PC, slow);
+        else
+            emitAddress(jit, e, decoded, size, false, slow);
+        emitHostLoad(e, size);
+        emitSlowPath(e, slow, memReadSlow, NULL, size, PC);
+        if(decoded->rd == 0)
+            return true;
+        if(size < 8 && !LSU_UNSIGNED(decoded->funct3))
+            emitSignExtend(e, size);
+        emitStoreReg(e, decoded->rd, RAX);
+        return true;
+    case T_SB:
+    case T_SH:
+    case T_SW:
+    case T_SD:
+        // Store to [rcx] on the fast path, through memWriteSlow() otherwise
+        if(jit->flat_base != NULL)
+            emitFlatAddress(jit, e, decoded, size, PC, slow);
+        else
+            emitAddress(jit, e, decoded, size, true, slow);
+        emitLoadReg(e, RAX, decoded->rs_2);
+        emitHostStore(e, size);
+        emitSlowPath(e, slow, memWriteSlow, decoded, size, PC);
+        return true;
+    case T_BEQ:
+    case T_BNE:
+    case T_BLT:
+    case T_BGE:
+        emitLoadReg(e, RAX, decoded->rs_1);
+        emitLoadReg(e, RCX, decoded->rs_2);
+        emitAluReg(e, 0x39); // cmp rax, rcx
+        // jcc over the fall-through exit to the taken one
+        emit8(e, 0x0F);
+        if(opcode == T_BEQ)
+            emit8(e, 0x84);
+        else if(opcode == T_BNE)
+            emit8(e, 0x85);
+        else if(opcode == T_BLT)
+            emit8(e, 0x8C);
+        else
+            emit8(e, 0x8D);
+        emit32(e, JIT_EXIT_BYTES);
+        emitExit(jit, e, PC + 4);
+        emitExit(jit, e, PC + imm);
+        return true;
+    case T_JAL:
+        if(decoded->rd != 0)
+        {
+            emitMovImm(e, RAX, PC + 4);
+            emitStoreReg(e, decoded->rd, RAX);
+        }
+        emitExit(jit, e, PC + imm);
+        return true;
+    case T_JALR:
+        // Target first, rd may be rs_1
+        emitLoadReg(e, RAX, decoded->rs_1);
+        emitAluImm(e, 0x05, imm);
+        if(decoded->rd != 0)
+        {
+            emitMovImm(e, RCX, PC + 4);
+            emitStoreReg(e, decoded->rd, RCX);
+        }
+        emit8(e, 0xC3);
+        return true;
+    default:
+        return false;
+    }
+}
+
+Jit *initJit(Core *core)
+{
+    Jit *jit = (Jit *)calloc(1, sizeof(Jit));
+    jit->num_instrs = core->instr_mem->num_instrs;
+    jit->num_pages = core->decode_cache.num_pages;
+    jit->pages = (JitPage **)calloc(jit->num_pages + 1, sizeof(JitPage *));
+    jit->page_bits = core->data_mem->page_bits;
+    jit->flat_base = core->data_mem->base;
+    if(core->block_map == NULL)
+        core->block_map = initBlocks(core);
+
+#if defined(__x86_64__)
+    // Room for every block to be translated a few times over (entries into the
+    // middle of a block). num_instrs goes up to the highest PC, not just what
+    // was loaded, so this is only reserved and capped at what rel32 reaches.
+    long page = sysconf(_SC_PAGESIZE);
+    jit->size = jit->num_instrs * 4 * JIT_MAX_INSTR_BYTES;
+    if(jit->num_instrs > JIT_MAX_BUFFER_BYTES / 4 / JIT_MAX_INSTR_BYTES)
+        jit->size = JIT_MAX_BUFFER_BYTES;
+    jit->size = (jit->size / page + 1) * page;
+    jit->buffer = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(jit->buffer == MAP_FAILED)
+    {
+        perror("Cannot map JIT code buffer, interpreting instead");
+        jit->buffer = NULL;
+        jit->size = 0;
+    }
+#endif
+
+    return jit;
+}
+
+void freeJit(Jit *jit)
+{
+    if(jit->buffer != NULL)
+        munmap(jit->buffer, jit->size);
+    for(size_t i = 0; i <= jit->num_pages; i++)
+    {
+        JitPage *jit_page = jit->pages[i];
+        if(jit_page == NULL)
+            continue;
+        for(size_t j = 0; j < (1 << DECODE_PAGE_BITS); j++)
+        {
+            while(jit_page->patches[j] != NULL)
+            {
+                JitPatch *patch = jit_page->patches[j];
+                jit_page->patches[j] = patch->next;
+                free(patch);
+            }
+        }
+        free(jit_page);
+    }
+    free(jit->pages);
+    free(jit);
+}
+
+JitBlock *jitTranslate(Jit *jit, Core *core, Addr PC)
+{
+    JitBlock *block = jitBlock(jit, PC);
+    block->translated = true;
+    block->code = NULL;
+    block->num_instrs = 0;
+
+    if(jit->buffer == NULL)
+        return block;
+
+    // Reserve the worst case for the longest block we'd emit here
+    size_t max_instrs = jit->num_instrs - PC / 4;
+    if(max_instrs > JIT_MAX_BLOCK_INSTRS)
+        max_instrs = JIT_MAX_BLOCK_INSTRS;
+    if(jit->used + (max_instrs + 1) * JIT_MAX_INSTR_BYTES > jit->size)
+        return block;
+
+    mprotect(jit->buffer, jit->size, PROT_READ | PROT_WRITE);
+
+    Emitter e = { jit->buffer + jit->used, jit->buffer + jit->used, PC };
+    uint8_t *start = e.p;
+
+    // Where the block was entered, so a fault or device stop partway through
+    // can tell runCore() how many of its instructions had run. It's as long as
+    // the exit jitInvalidate() writes over the block, so no exit is overwritten.
+    emitCoreStore(&e, offsetof(Core, jit_entry), PC);
+    emitCodeCheck(&e, PC);
+
+    Addr block_PC = PC;
+    bool ends_in_jump = false;
+    while(block->num_instrs < max_instrs)
+    {
+        // Stop at the next leader so blocks aren't translated twice over, and
+        // at the next decode page even if its leader was dropped by a store
+        if(block->num_instrs > 0 && (block_PC % (4 << DECODE_PAGE_BITS) == 0 || blockStartsAt(core, core->block_map, block_PC)))
+            break;
+
+        DecodedInstruction *decoded = fetchDecoded(core, block_PC);
+        ThreadedOpcode opcode = threadedOpcode(decoded);
+        bool jump = opcode == T_BEQ || opcode == T_BNE || opcode == T_BLT || opcode == T_BGE || opcode == T_JAL || opcode == T_JALR;
+        if(jump)
+            emitCount(&e, block->num_instrs + 1); // Ahead of the compare, add sets the flags
+        if(!emitInstruction(jit, &e, opcode, decoded, block_PC))
+            break;
+
+        block->num_instrs++;
+        block_PC += 4;
+        if(jump)
+        {
+            ends_in_jump = true;
+            break;
+        }
+    }
+
+    if(block->num_instrs > 0)
+    {
+        block->code = (JitCode)start;
+        if(!ends_in_jump)
+        {
+            emitCount(&e, block->num_instrs);
+            emitExit(jit, &e, block_PC);
+        }
+        jit->used += e.p - start;
+
+        // Chain every exit that was waiting for this block, unless the block it's
+        // in was invalidated since and the site is dead code
+        JitPatch **waiting = jitPatches(jit, PC);
+        while(*waiting != NULL)
+        {
+            JitPatch *patch = *waiting;
+            if(jitBlock(jit, patch->owner)->code == (JitCode)patch->owner_code)
+                patchJump(patch->site, start);
+            *waiting = patch->next;
+            free(patch);
+        }
+    }
+
+    mprotect(jit->buffer, jit->size, PROT_READ | PROT_EXEC);
+    return block;
+}
+
+void jitInvalidate(Jit *jit, Addr PC, size_t len)
+{
+    // Blocks translated from [PC, PC + len) start over with an exit back to
+    // runJit(), so chained jumps into them leave instead of running old code.
+    // They are translated again the next time they are reached. Exits still
+    // waiting in them are left unpatched, see jitTranslate().
+    if(jit->buffer == NULL)
+        return;
+
+    mprotect(jit->buffer, jit->size, PROT_READ | PROT_WRITE);
+    for(Addr i = PC / 4; i < (PC + len) / 4 && i < jit->num_instrs; i++)
+    {
+        // Nothing was translated in a page that was never allocated
+        if(jit->pages[(i * 4) >> DECODE_PAGE_SHIFT] == NULL)
+            continue;
+        JitBlock *block = jitBlock(jit, i * 4);
+        if(block->code != NULL)
+        {
+            Emitter e = { .p = (uint8_t *)block->code, .start = (uint8_t *)block->code, .PC = i * 4 };
+            emitMovImm(&e, RAX, i * 4);
+            emit8(&e, 0xC3);
+        }
+        block->code = NULL;
+        block->num_instrs = 0;
+        block->translated = false;
+    }
+    mprotect(jit->buffer, jit->size, PROT_READ | PROT_EXEC);
+}
+
+bool runJit(Core *core)
+{
+    if(core->instr_mem->num_instrs == 0)
+        return false;
+
+    Jit *jit = initJit(core);
+    core->jit = jit;
+    Addr last_addr = core->instr_mem->last_addr;
+    while(core->PC <= last_addr)
+    {
+        if(core->data_mem->code_written)
+            memCodeWritten(core->data_mem);
+
+        // Misaligned PCs run in the interpreter, PC / 4 would hide the offset
+        if(core->PC % 4 == 0)
+        {
+            JitBlock *block = jitBlock(jit, core->PC);
+            if(!block->translated)
+                block = jitTranslate(jit, core, core->PC);
+
+            if(block->code != NULL)
+            {
+                // Chained blocks count their own instructions into clk
+                core->PC = block->code(core->reg_file, core->data_mem, &core->clk);
+                core->jit_entry = NOT_IN_JIT;
+                continue;
+            }
+        }
+
+        tickFunc(core);
+    }
+
+    core->jit = NULL;
+    freeJit(jit);
+
+    // Runs to completion in one call, so there's never another tick
+    return false;
+}
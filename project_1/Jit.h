@@ -0,0 +1,67 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include "Core.h"
+
+// Dynamic binary translator: guest basic blocks become x86-64 functions
+// that take the reg_file base and data_mem and return the next PC.
+// Blocks jump directly into their successors when those are known statically.
+// Anything that can't be translated is run through tickFunc instead.
+// A block adds its instructions to clk as it leaves, so a fault or device stop
+// partway through hasn't counted any of them; core->jit_entry says where it
+// was entered, and core->PC is the access that didn't come back.
+#define NOT_IN_JIT (~(Addr)0) // core->jit_entry outside translated code
+typedef Addr (*JitCode)(uint64_t *reg_file, Memory *data_mem, Tick *clk);
+
+typedef struct JitBlock JitBlock;
+typedef struct JitBlock
+{
+    JitCode code; // NULL if the block has to be interpreted
+    unsigned num_instrs;
+    bool translated;
+} JitBlock;
+
+// An exit stub waiting for its target block to be translated
+typedef struct JitPatch JitPatch;
+typedef struct JitPatch
+{
+    uint8_t *site;
+    Addr owner; // PC of the block the site is in
+    uint8_t *owner_code; // Its code then, the site is dead once that changes
+    JitPatch *next;
+} JitPatch;
+
+// The blocks of one decode page, allocated the first time one of them is
+// translated or jumped to
+typedef struct JitPage JitPage;
+typedef struct JitPage
+{
+    JitBlock blocks[1 << DECODE_PAGE_BITS]; // Indexed by PC / 4 within the page
+    JitPatch *patches[1 << DECODE_PAGE_BITS]; // Indexed by target PC / 4 within the page
+} JitPage;
+
+// The code buffer is only reserved up front, pages are committed as they are
+// written. It never grows past what rel32 jumps between blocks can reach.
+#define JIT_MAX_BUFFER_BYTES ((size_t)1 << 30)
+
+typedef struct Jit Jit;
+typedef struct Jit
+{
+    uint8_t *buffer; // mmap'd code buffer, only writable while translating
+    size_t size;
+    size_t used;
+    JitPage **pages; // Indexed by PC >> DECODE_PAGE_SHIFT, NULL until used
+    size_t num_pages;
+    size_t num_instrs;
+    unsigned page_bits; // Of the data_mem the code runs on, loads and stores inline its last-page check
+    uint8_t *flat_base; // Or its base, when it is flat
+} Jit;
+
+Jit *initJit(Core *core);
+void freeJit(Jit *jit);
+JitBlock *jitBlock(Jit *jit, Addr PC);
+JitBlock *jitTranslate(Jit *jit, Core *core, Addr PC);
+void jitInvalidate(Jit *jit, Addr PC, size_t len);
+bool runJit(Core *core);
+
+#endif
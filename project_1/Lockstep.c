@@ -0,0 +1,240 @@
+#include "Lockstep.h"
+#include "Isa.h"
+#include "Lsu.h"
+
+// runLockstep() is built once per vector width and the best one the host has
+// is picked when the program loads, RVSim itself stays buildable for any x86-64.
+// ThreadSanitizer isn't up yet when that pick runs, so its builds get one.
+#if defined(__x86_64__) && !defined(__SANITIZE_THREAD__)
+#define LOCKSTEP_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define LOCKSTEP_CLONES
+#endif
+
+// The lane helpers are always inlined, so how a non-AVX caller would pass
+// their vectors never matters (the Makefile's -Wno-psabi)
+#define LANE_INLINE static inline __attribute__((always_inline))
+#define NO_LANE_PC (~(Addr)0) // Above any PC a running lane can be at
+
+Lockstep *initLockstep(Instruction_Memory *i_mem, unsigned num_lanes, bool huge_pages)
+{
+    // malloc() only lines up to 16 bytes, the lane vectors want all of theirs
+    Lockstep *lockstep = (Lockstep *)aligned_alloc(sizeof(Lane_Vec), sizeof(Lockstep));
+    lockstep->core = initCore(i_mem);
+    lockstep->num_lanes = num_lanes < LOCKSTEP_LANES ? num_lanes : LOCKSTEP_LANES;
+    if(huge_pages)
+    {
+        freeMemory(lockstep->core->data_mem);
+        lockstep->core->data_mem = initMemory(true);
+    }
+    lockstep->data_mem[0] = lockstep->core->data_mem;
+    for(unsigned lane = 1; lane < LOCKSTEP_LANES; lane++)
+        lockstep->data_mem[lane] = lane < lockstep->num_lanes ? initMemory(huge_pages) : NULL;
+    resetLockstep(lockstep);
+
+    return lockstep;
+}
+
+void resetLockstep(Lockstep *lockstep)
+{
+    // Every lane back to the start, the decoded program stays. Each lane starts
+    // out the way resetCore() leaves a core, lane 0's memory goes last so the
+    // core ends up with it again.
+    Core *core = lockstep->core;
+    for(unsigned lane = lockstep->num_lanes; lane-- > 0;)
+    {
+        core->data_mem = lockstep->data_mem[lane];
+        resetCore(core);
+        for(unsigned r = 0; r < NUM_REGS; r++)
+            lockstep->reg[r][lane] = core->reg_file[r];
+        lockstep->reservation[lane] = core->reservation;
+    }
+    for(unsigned lane = lockstep->num_lanes; lane < LOCKSTEP_LANES; lane++)
+    {
+        for(unsigned r = 0; r < NUM_REGS; r++)
+            lockstep->reg[r][lane] = 0;
+    }
+    memset(&lockstep->PC, 0, sizeof(lockstep->PC));
+    memset(&lockstep->clk, 0, sizeof(lockstep->clk));
+    lockstep->clk_limit = (Lane_UVec){} + NO_CLK_LIMIT;
+    lockstep->steps = 0;
+    lockstep->diverged_steps = 0;
+}
+
+void freeLockstep(Lockstep *lockstep)
+{
+    for(unsigned lane = 1; lane < LOCKSTEP_LANES; lane++)
+    {
+        if(lockstep->data_mem[lane] != NULL)
+            freeMemory(lockstep->data_mem[lane]);
+    }
+    freeCore(lockstep->core);
+    free(lockstep);
+}
+
+LANE_INLINE Lane_Vec laneSelect(Lane_Vec mask, Lane_Vec a, Lane_Vec b)
+{
+    // a where mask is set, b elsewhere
+    return (a & mask) | (b & ~mask);
+}
+
+LANE_INLINE Lane_Vec laneAlu(Lane_Vec a, Lane_Vec b, uint8_t alu_ctrl)
+{
+    // alu() on every lane at once
+    switch(alu_ctrl)
+    {
+    case ALU_AND:
+        return a & b;
+    case ALU_OR:
+        return a | b;
+    case ALU_ADD:
+        return a + b;
+    case ALU_SLL:
+        return a << (b & 0x3F);
+    case ALU_SRL:
+        return (Lane_Vec)((Lane_UVec)a >> (Lane_UVec)(b & 0x3F));
+    case ALU_XOR:
+        return a ^ b;
+    case ALU_SUB:
+        return a - b;
+    case ALU_SLT:
+        return (a < b) & 1;
+    }
+    return (Lane_Vec){};
+}
+
+LANE_INLINE void laneStep(Lockstep *lockstep, DecodedInstruction *decoded, Addr PC, Lane_Vec active)
+{
+    // executeInstruction() for the lanes in active, which are all at PC
+    ControlSignals *ctrl = &decoded->ctrl;
+    Lane_Vec read_data_1 = lockstep->reg[decoded->rs_1];
+    Lane_Vec read_data_2 = lockstep->reg[decoded->rs_2];
+    Lane_Vec operand_2 = ctrl->aluSrc ? (Lane_Vec){} + decoded->imm : read_data_2;
+    Lane_Vec result = laneAlu(read_data_1, operand_2, decoded->alu_ctrl);
+
+    // Memory is per lane, one scalar access for each lane that's active
+    Lane_Vec w_data = result;
+    if(ctrl->memWrite || ctrl->memRead)
+    {
+        for(unsigned lane = 0; lane < lockstep->num_lanes; lane++)
+        {
+            if(!active[lane])
+                continue;
+            if(ctrl->atomic)
+            {
+                w_data[lane] = lsuAtomic(lockstep->data_mem[lane], &lockstep->reservation[lane], result[lane], read_data_2[lane],
+                                         decoded->funct3, decoded->funct5);
+                continue;
+            }
+            if(ctrl->memWrite)
+                lsuStore(lockstep->data_mem[lane], result[lane], read_data_2[lane], decoded->funct3);
+            if(ctrl->memRead)
+                w_data[lane] = lsuLoad(lockstep->data_mem[lane], result[lane], decoded->funct3);
+        }
+    }
+    else if(ctrl->jal || ctrl->jalr)
+        w_data = (Lane_Vec){} + (int64_t)(PC + 4);
+
+    if(decoded->rd != 0 && ctrl->regWrite)
+        lockstep->reg[decoded->rd] = laneSelect(active, w_data, lockstep->reg[decoded->rd]);
+
+    // Lanes that branch and lanes that don't go their own ways from here
+    Lane_Vec next;
+    Lane_Vec zero = read_data_1 == operand_2;
+    if(ctrl->beq || ctrl->bne || ctrl->blt || ctrl->bge)
+    {
+        Lane_Vec taken = ctrl->beq ? zero : ctrl->bne ? ~zero : ctrl->blt ? result != 0 : result == 0;
+        next = laneSelect(taken, (Lane_Vec){} + (int64_t)(PC + decoded->imm), (Lane_Vec){} + (int64_t)(PC + 4));
+    }
+    else if(ctrl->jal)
+        next = (Lane_Vec){} + (int64_t)(PC + decoded->imm);
+    else if(ctrl->jalr)
+        next = result;
+    else
+        next = (Lane_Vec){} + (int64_t)(PC + 4);
+
+    lockstep->PC = laneSelect(active, next, lockstep->PC);
+    lockstep->clk -= (Lane_UVec)active;
+}
+
+LANE_INLINE unsigned laneBits(Lane_Vec mask)
+{
+    // Bit n set for lane n in mask
+    unsigned bits = 0;
+    for(unsigned lane = 0; lane < LOCKSTEP_LANES; lane++)
+        bits |= (mask[lane] != 0) << lane;
+    return bits;
+}
+
+LANE_INLINE Tick runConverged(Lockstep *lockstep, Addr PC, Lane_Vec active, Tick budget)
+{
+    // Every running lane is at PC: they go as one without looking for the
+    // lowest PC again until a branch splits them or budget runs out
+    Core *core = lockstep->core;
+    Addr last_addr = core->instr_mem->last_addr;
+    unsigned lead = __builtin_ctz(laneBits(active));
+    Tick n = 0;
+    while(n < budget && PC <= last_addr)
+    {
+        DecodedInstruction *decoded = fetchDecoded(core, PC);
+        laneStep(lockstep, decoded, PC, active);
+        n++;
+
+        ControlSignals *ctrl = &decoded->ctrl;
+        if(!(ctrl->beq || ctrl->bne || ctrl->blt || ctrl->bge || ctrl->jal || ctrl->jalr))
+        {
+            PC += 4;
+            continue;
+        }
+        PC = lockstep->PC[lead];
+        if(laneBits(active & (lockstep->PC != (Lane_Vec){} + (int64_t)PC)) != 0)
+            break;
+    }
+    return n;
+}
+
+LOCKSTEP_CLONES void runLockstep(Lockstep *lockstep)
+{
+    // Until every lane has run off the end of the program or hit its limit
+    Core *core = lockstep->core;
+    if(core->instr_mem->num_instrs == 0)
+        return;
+
+    Lane_Vec lanes;
+    for(unsigned lane = 0; lane < LOCKSTEP_LANES; lane++)
+        lanes[lane] = lane < lockstep->num_lanes ? -1 : 0;
+    Lane_UVec last_addr = (Lane_UVec){} + core->instr_mem->last_addr;
+
+    for(;;)
+    {
+        Lane_Vec running = lanes & ((Lane_UVec)lockstep->PC <= last_addr) & (lockstep->clk < lockstep->clk_limit);
+
+        // Lowest PC first: lanes that fell behind catch up before the rest go on
+        Addr PC = NO_LANE_PC;
+        for(unsigned lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            if(running[lane] && (Addr)lockstep->PC[lane] < PC)
+                PC = lockstep->PC[lane];
+        }
+        if(PC == NO_LANE_PC)
+            break;
+
+        Lane_Vec active = running & (lockstep->PC == (Lane_Vec){} + (int64_t)PC);
+        if(laneBits(running & ~active) == 0)
+        {
+            // No lane left behind, run up to where the first lane stops
+            Tick budget = NO_CLK_LIMIT;
+            for(unsigned lane = 0; lane < LOCKSTEP_LANES; lane++)
+            {
+                if(active[lane] && lockstep->clk_limit[lane] - lockstep->clk[lane] < budget)
+                    budget = lockstep->clk_limit[lane] - lockstep->clk[lane];
+            }
+            lockstep->steps += runConverged(lockstep, PC, active, budget);
+            continue;
+        }
+
+        lockstep->steps++;
+        lockstep->diverged_steps++;
+        laneStep(lockstep, fetchDecoded(core, PC), PC, active);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef __LOCKSTEP_H__
+#define __LOCKSTEP_H__
+
+#include "Core.h"
+
+#define LOCKSTEP_LANES 8 // 64-bit lanes, one AVX-512 vector or two AVX2 ones
+
+// One 64-bit value per lane. GCC vector extensions, the compiler lowers them
+// to whatever vector unit the host has.
+typedef int64_t Lane_Vec __attribute__((vector_size(LOCKSTEP_LANES * sizeof(int64_t))));
+typedef uint64_t Lane_UVec __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint64_t))));
+
+// Up to LOCKSTEP_LANES instances of one program with their own registers and
+// data memory, run in lockstep. Registers are stored reg[r][lane], so one
+// instruction is one vector operation across every lane at its PC. Each step
+// issues the instruction at the lowest PC a running lane is at and masks off
+// the lanes elsewhere, which wait there until the others catch up; lanes that
+// split at a branch meet again at the first PC both paths reach.
+// Loads, stores and atomics go to each active lane's memory in turn.
+typedef struct Lockstep Lockstep;
+typedef struct Lockstep
+{
+    Core *core; // Decodes for every lane, its data_mem is lane 0's
+    unsigned num_lanes; // Can be lowered before a reset, never above what it was created with
+    Lane_Vec reg[NUM_REGS];
+    Lane_Vec PC;
+    Lane_UVec clk; // Instructions each lane has retired
+    Lane_UVec clk_limit; // A lane stops once its clk reaches this
+    Memory *data_mem[LOCKSTEP_LANES];
+    Lsu_Reservation reservation[LOCKSTEP_LANES];
+
+    Tick steps; // Instructions issued, each for however many lanes were active
+    Tick diverged_steps; // Issued while some running lanes were masked off
+} Lockstep;
+
+Lockstep *initLockstep(Instruction_Memory *i_mem, unsigned num_lanes, bool huge_pages);
+void resetLockstep(Lockstep *lockstep);
+void freeLockstep(Lockstep *lockstep);
+void runLockstep(Lockstep *lockstep);
+
+#endif
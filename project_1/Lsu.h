@@ -0,0 +1,175 @@
+#ifndef __LSU_H__
+#define __LSU_H__
+
+#include "Memory.h"
+
+// Load/store unit. Loads and stores carry their width in funct3: the low two
+// bits are log2 of the size in bytes, and the top bit makes a load zero-extend
+// (lbu, lhu, lwu) instead of sign-extending.
+#define LSU_SIZE(funct3) (1U << ((funct3) & 0b11))
+#define LSU_UNSIGNED(funct3) (((funct3) & 0b100) != 0)
+
+// Atomics (RV64A) carry their width in funct3 the same way, 0b010 for .w and
+// 0b011 for .d, and their operation in funct5, the top five bits of funct7.
+// The two bits below funct5 are aq and rl, every atomic here is sequentially
+// consistent so they change nothing.
+#define AMO_ADD  0b00000
+#define AMO_SWAP 0b00001
+#define AMO_LR   0b00010
+#define AMO_SC   0b00011
+#define AMO_XOR  0b00100
+#define AMO_OR   0b01000
+#define AMO_AND  0b01100
+#define AMO_MIN  0b10000
+#define AMO_MAX  0b10100
+#define AMO_MINU 0b11000
+#define AMO_MAXU 0b11100
+
+// What lr.w/lr.d left for the next sc to check, one per hart. sc stores only
+// if memory still holds the value lr read, so a store of the same value in
+// between goes unnoticed, the way it does with any compare-and-swap.
+typedef struct Lsu_Reservation Lsu_Reservation;
+typedef struct Lsu_Reservation
+{
+    Addr addr;
+    uint64_t value;
+    bool valid;
+} Lsu_Reservation;
+
+static inline int64_t lsuLoad(Memory *mem, Addr addr, uint8_t funct3)
+{
+    switch(funct3)
+    {
+    case 0b000: // lb
+        return (int8_t)memRead(mem, addr, 1);
+    case 0b001: // lh
+        return (int16_t)memRead(mem, addr, 2);
+    case 0b010: // lw
+        return (int32_t)memRead(mem, addr, 4);
+    case 0b100: // lbu
+        return memRead(mem, addr, 1);
+    case 0b101: // lhu
+        return memRead(mem, addr, 2);
+    case 0b110: // lwu
+        return memRead(mem, addr, 4);
+    default: // ld
+        return memRead(mem, addr, 8);
+    }
+}
+
+static inline void lsuStore(Memory *mem, Addr addr, int64_t data, uint8_t funct3)
+{
+    switch(funct3 & 0b11)
+    {
+    case 0b00: // sb
+        memWrite(mem, addr, data, 1);
+        break;
+    case 0b01: // sh
+        memWrite(mem, addr, data, 2);
+        break;
+    case 0b10: // sw
+        memWrite(mem, addr, data, 4);
+        break;
+    default: // sd
+        memWrite(mem, addr, data, 8);
+        break;
+    }
+}
+
+static inline int64_t lsuAmoApply(int64_t old, int64_t src, uint8_t funct5, unsigned size)
+{
+    // What an AMO stores, on an old value already sign-extended to 64 bits
+    if(size == 4)
+        src = (int32_t)src;
+    switch(funct5)
+    {
+    case AMO_SWAP:
+        return src;
+    case AMO_ADD:
+        return old + src;
+    case AMO_XOR:
+        return old ^ src;
+    case AMO_AND:
+        return old & src;
+    case AMO_OR:
+        return old | src;
+    case AMO_MIN:
+        return old < src ? old : src;
+    case AMO_MAX:
+        return old > src ? old : src;
+    case AMO_MINU:
+        return (uint64_t)old < (uint64_t)src ? old : src;
+    default: // AMO_MAXU
+        return (uint64_t)old > (uint64_t)src ? old : src;
+    }
+}
+
+// One read-modify-write with host atomics on a host word of the given type,
+// returning the old value, or for sc 0 if it stored and 1 if it didn't.
+// min and max have no host instruction and retry a compare-and-swap.
+#define LSU_ATOMIC(name, type, stype) \
+    static inline type name(type *host, Lsu_Reservation *reservation, Addr addr, type src, uint8_t funct5) \
+    { \
+        type old; \
+        switch(funct5) \
+        { \
+        case AMO_LR: \
+            old = __atomic_load_n(host, __ATOMIC_SEQ_CST); \
+            *reservation = (Lsu_Reservation){ addr, old, true }; \
+            return old; \
+        case AMO_SC: \
+            old = (type)reservation->value; \
+            if(!reservation->valid || reservation->addr != addr) \
+                return 1; \
+            reservation->valid = false; \
+            return !__atomic_compare_exchange_n(host, &old, src, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+        case AMO_SWAP: \
+            return __atomic_exchange_n(host, src, __ATOMIC_SEQ_CST); \
+        case AMO_ADD: \
+            return __atomic_fetch_add(host, src, __ATOMIC_SEQ_CST); \
+        case AMO_XOR: \
+            return __atomic_fetch_xor(host, src, __ATOMIC_SEQ_CST); \
+        case AMO_AND: \
+            return __atomic_fetch_and(host, src, __ATOMIC_SEQ_CST); \
+        case AMO_OR: \
+            return __atomic_fetch_or(host, src, __ATOMIC_SEQ_CST); \
+        } \
+        old = __atomic_load_n(host, __ATOMIC_RELAXED); \
+        while(!__atomic_compare_exchange_n(host, &old, (type)lsuAmoApply((stype)old, (stype)src, funct5, sizeof(type)), \
+                                           true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)); \
+        return old; \
+    }
+
+LSU_ATOMIC(lsuAtomic32, uint32_t, int32_t)
+LSU_ATOMIC(lsuAtomic64, uint64_t, int64_t)
+#undef LSU_ATOMIC
+
+static inline int64_t lsuAtomic(Memory *mem, Lsu_Reservation *reservation, Addr addr, int64_t src, uint8_t funct3, uint8_t funct5)
+{
+    // What the atomic writes back to rd, .w results sign-extended
+    unsigned size = LSU_SIZE(funct3);
+    uint8_t *host = memAtomicHost(mem, addr, size);
+    if(host != NULL && size == 4)
+        return (int32_t)lsuAtomic32((uint32_t *)host, reservation, addr, src, funct5);
+    if(host != NULL)
+        return lsuAtomic64((uint64_t *)host, reservation, addr, src, funct5);
+
+    // Misaligned or a device's, a plain read and write are all there is
+    int64_t old = lsuLoad(mem, addr, funct3);
+    switch(funct5)
+    {
+    case AMO_LR:
+        *reservation = (Lsu_Reservation){ addr, (uint64_t)old, true };
+        return old;
+    case AMO_SC:
+        if(!reservation->valid || reservation->addr != addr || old != (size == 4 ? (int32_t)reservation->value : (int64_t)reservation->value))
+            return 1;
+        reservation->valid = false;
+        lsuStore(mem, addr, src, funct3);
+        return 0;
+    }
+    lsuStore(mem, addr, lsuAmoApply(old, src, funct5, size), funct3);
+    return old;
+}
+
+#endif
@@ -1,29 +1,230 @@
 #include <stdio.h>
+#include <unistd.h>
 
 #include "Core.h"
 #include "Parser.h"
+#include "Elf.h"
+#include "Devices.h"
+#include "Block.h"
+#include "Jit.h"
+#include "Threaded.h"
+#include "Tiered.h"
+#include "Batch.h"
+#include "Harts.h"
 
-int main(int argc, const char *argv[])
+int main(int argc, char *argv[])
 {	
-    if (argc != 2)
+    // The engine defaults to tickFunc, a flag picks one of the faster ones:
+    // -b runs a basic block per tick, -f the functional threaded code, -j the JIT,
+    // -t <n> interprets blocks until they have run n times and then JITs them.
+    // -H backs data memory with transparent huge pages, -F <MB> makes it flat,
+    // guard-paged RAM of that size with out-of-range accesses reported as faults.
+    // -U fetches instructions from data memory, so the program can rewrite itself.
+    // -M maps the devices in: a UART on stdout, a cycle timer and an exit register.
+    // -B <manifest> runs a batch of jobs instead of one trace, see Batch.h, on
+    // -w <n> worker threads (-P pins them to CPUs) and writes a JSON summary to
+    // stdout or to -o <file>.
+    // -N <n> runs n harts of the program on threads of their own, sharing flat
+    // memory, in rounds of -q <n> instructions each, see Harts.h. -I takes them
+    // in turns of -q <n> instructions on this thread instead.
+    bool (*tick)(Core *core) = tickFunc;
+    unsigned hot_threshold = DEFAULT_HOT_THRESHOLD;
+    bool huge_pages = false;
+    size_t flat_size = 0;
+    bool unified = false;
+    bool devices = false;
+    const char *manifest = NULL;
+    unsigned workers = 0;
+    bool pin = false;
+    const char *summary_path = NULL;
+    unsigned num_harts = 0;
+    Tick quantum = DEFAULT_QUANTUM;
+    bool interleave = false;
+    bool usage = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "bfjt:HF:UMB:w:Po:N:q:I")) != -1)
     {
-        printf("Usage: %s %s\n", argv[0], "<trace-file>");
+        if (opt == 'b')
+            tick = blockTickFunc;
+        else if (opt == 'f')
+            tick = runThreaded;
+        else if (opt == 'j')
+            tick = runJit;
+        else if (opt == 't')
+        {
+            tick = runTiered;
+            hot_threshold = strtoul(optarg, NULL, 10);
+        }
+        else if (opt == 'H')
+            huge_pages = true;
+        else if (opt == 'F')
+            flat_size = strtoul(optarg, NULL, 10) << 20;
+        else if (opt == 'U')
+            unified = true;
+        else if (opt == 'M')
+            devices = true;
+        else if (opt == 'B')
+            manifest = optarg;
+        else if (opt == 'w')
+            workers = strtoul(optarg, NULL, 10);
+        else if (opt == 'P')
+            pin = true;
+        else if (opt == 'o')
+            summary_path = optarg;
+        else if (opt == 'N')
+            num_harts = strtoul(optarg, NULL, 10);
+        else if (opt == 'q')
+            quantum = strtoull(optarg, NULL, 10);
+        else if (opt == 'I')
+            interleave = true;
+        else
+            usage = true;
+    }
+
+    // The threaded engine compiles the whole program up front and can't be told it changed
+    if (unified && tick == runThreaded)
+        usage = true;
+    // Devices hang off page flags, flat memory has none
+    if (devices && flat_size != 0)
+        usage = true;
+    // Harts have to stop at the end of every quantum, and share nothing but flat memory
+    if (num_harts != 0 && (quantum == 0 || (tick != tickFunc && tick != blockTickFunc) || huge_pages || unified || devices || manifest != NULL))
+        usage = true;
+    if (interleave && num_harts == 0)
+        usage = true;
+    // A batch names its programs in the manifest
+    if (optind != argc - (manifest == NULL))
+        usage = true;
+
+    if (usage)
+    {
+        printf("Usage: %s %s\n", argv[0], "[-b | -f | -j | -t <hot-threshold>] [-H | -F <MB>] [-U] [-M] <trace-file>");
+        printf("       %s %s\n", argv[0], "[-b | -f | -j | -t <hot-threshold>] [-H | -F <MB>] [-U] [-M] -B <manifest> [-w <workers>] [-P] [-o <summary>]");
+        printf("       %s %s\n", argv[0], "[-b] [-F <MB>] -N <harts> [-q <quantum>] [-I] <trace-file>");
 
         return 0;
     }
 
+    if (manifest != NULL)
+    {
+        Batch_Config config = { tick, hot_threshold, huge_pages, flat_size, unified, devices, workers, pin };
+        FILE *summary = summary_path != NULL ? fopen(summary_path, "w") : stdout;
+        if (summary == NULL)
+        {
+            perror(summary_path);
+            return EXIT_FAILURE;
+        }
+
+        size_t failed = runBatch(manifest, &config, summary);
+        if (summary != stdout)
+            fclose(summary);
+        return failed != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     /* Task One */
+    // RV64 ELF executables are loaded as they are, anything else is a text trace
     Instruction_Memory instr_mem;
-    instr_mem.last = NULL;
-    loadInstructions(&instr_mem, argv[1]);
+    initInstructionMemory(&instr_mem);
+    Elf_Image *elf = openElf(argv[optind]);
+    if (elf != NULL)
+        elfLoadText(elf, &instr_mem);
+    else
+        loadInstructions(&instr_mem, argv[optind]);
+
+    if (num_harts != 0)
+    {
+        // Every hart starts at the entry point, each with a stack of its own.
+        // Threads share flat memory, harts taking turns can share paged memory.
+        Harts *harts = initHarts(&instr_mem, num_harts, flat_size == 0 && !interleave ? DEFAULT_HARTS_MB << 20 : flat_size);
+        if (elf != NULL)
+            elfMapSegments(elf, harts->data_mem);
+        for (unsigned h = 0; h < num_harts; h++)
+        {
+            Core *core = harts->harts[h].core;
+            if (elf != NULL)
+            {
+                core->PC = elf->entry;
+                core->reg_file[2] = elfStackTop(harts->data_mem) - h * HART_STACK_SIZE;
+            }
+            core->tick = tick;
+        }
+
+        bool ran = interleave ? interleaveHarts(harts, quantum) : runHarts(harts, quantum);
+        if (ran)
+            printf("Simulation is finished.\n");
+        printHartStats(harts);
+
+        freeHarts(harts);
+        freeInstructionMemory(&instr_mem);
+        if (elf != NULL)
+            closeElf(elf);
+        return ran ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     /* Task Two */
     Core *core = initCore(&instr_mem);
+    if (huge_pages || flat_size != 0)
+    {
+        // Swap the memory before anything runs, resetCore() puts the initial values back
+        freeMemory(core->data_mem);
+        core->data_mem = flat_size != 0 ? initFlatMemory(flat_size) : initMemory(true);
+        resetCore(core);
+    }
+    if (elf != NULL)
+    {
+        elfMapSegments(elf, core->data_mem);
+        core->PC = elf->entry;
+        core->reg_file[2] = elfStackTop(core->data_mem);
+    }
+    if (unified)
+    {
+        // An ELF's text is already in data memory, a trace is copied in at its PCs
+        core->unified = true;
+        if (elf == NULL)
+            storeProgram(core);
+    }
+    if (devices && (core->devices = initDevices(core->data_mem, &core->clk, stdout)) == NULL)
+    {
+        // Something was loaded over the device pages
+        fprintf(stderr, "Cannot map devices at %#lx\n", UART_BASE);
+        freeCore(core);
+        return EXIT_FAILURE;
+    }
+    core->tick = tick;
+    core->hot_threshold = hot_threshold;
 
     /* Task Three - Simulation */
-    while(core->tick(core));
+    if (!runCore(core))
+    {
+        freeCore(core);
+        return EXIT_FAILURE;
+    }
 
     printf("Simulation is finished.\n");
+    if (core->data_mem->unaligned != 0)
+        printf("Unaligned accesses: %lu\n", core->data_mem->unaligned);
+    if (tick == runTiered)
+        printTierStats(core);
+    else if (tick == runThreaded)
+        printf("Fused instructions: %lu of %lu\n", core->fused_instrs, core->clk);
+    if (unified)
+        printf("Code pages rewritten: %lu\n", core->decode_cache.rewrites);
+
+    // The guest's exit status becomes ours
+    int status = EXIT_SUCCESS;
+    if (core->devices != NULL)
+    {
+        printDeviceStats(core->devices);
+        if (core->devices->exited)
+        {
+            printf("Guest exited with status %ld\n", core->devices->exit_status);
+            status = (int)core->devices->exit_status;
+        }
+    }
 
-    free(core);    
+    freeCore(core);    
+    freeInstructionMemory(&instr_mem);
+    if (elf != NULL)
+        closeElf(elf);
+    return status;
 }
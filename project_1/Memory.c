@@ -0,0 +1,640 @@
+#include "Memory.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define INITIAL_SLOTS 64
+
+// The memory and jump buffer memCatchFaults() armed on this thread
+static __thread Memory *fault_mem;
+static __thread sigjmp_buf *fault_env;
+static __thread Addr fault_addr; // Guest address of the access that jumped to it with MEM_FAULT
+
+// What an MMIO page's data points at, it only keeps the slot taken
+static uint8_t mmio_data;
+
+static void insertDevice(Memory *mem, Mem_Device *device);
+
+static size_t slotIndex(Memory *mem, Addr page)
+{
+    // Fibonacci hashing, num_slots is a power of two
+    return (page * 0x9E3779B97F4A7C15UL) >> (64 - __builtin_ctzl(mem->num_slots));
+}
+
+static uint8_t *allocPage(Memory *mem)
+{
+    size_t size = 1UL << mem->page_bits;
+    if(!mem->huge_pages)
+    {
+        uint8_t *data = (uint8_t *)calloc(1, size);
+        if(data == NULL)
+        {
+            perror("Cannot allocate guest memory page");
+            exit(EXIT_FAILURE);
+        }
+        return data;
+    }
+
+    // Over-map so the page can be aligned for THP, then give the slack back
+    uint8_t *map = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED)
+    {
+        perror("Cannot map guest memory page");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *data = (uint8_t *)(((uintptr_t)map + size - 1) & ~(size - 1));
+    if(data > map)
+        munmap(map, data - map);
+    munmap(data + size, map + size - data);
+#ifdef MADV_HUGEPAGE
+    madvise(data, size, MADV_HUGEPAGE);
+#endif
+    return data;
+}
+
+static void freePage(Memory *mem, uint8_t *data)
+{
+    if(mem->huge_pages)
+        munmap(data, 1UL << mem->page_bits);
+    else
+        free(data);
+}
+
+static void growPages(Memory *mem)
+{
+    Memory_Page *old = mem->pages;
+    size_t old_slots = mem->num_slots;
+
+    mem->num_slots *= 2;
+    mem->pages = (Memory_Page *)calloc(mem->num_slots, sizeof(Memory_Page));
+    for(size_t i = 0; i < old_slots; i++)
+    {
+        if(old[i].data == NULL)
+            continue;
+        size_t slot = slotIndex(mem, old[i].page);
+        while(mem->pages[slot].data != NULL)
+            slot = (slot + 1) & (mem->num_slots - 1);
+        mem->pages[slot] = old[i];
+    }
+    free(old);
+}
+
+Memory *initMemory(bool huge_pages)
+{
+    Memory *mem = (Memory *)malloc(sizeof(Memory));
+    mem->last_page = NO_PAGE;
+    mem->last_data = NULL;
+    mem->write_page = NO_PAGE;
+    mem->write_data = NULL;
+    mem->huge_pages = huge_pages;
+    mem->page_bits = huge_pages ? HUGE_PAGE_BITS : PAGE_BITS;
+    mem->num_slots = INITIAL_SLOTS;
+    mem->num_pages = 0;
+    mem->pages = (Memory_Page *)calloc(mem->num_slots, sizeof(Memory_Page));
+    mem->base = NULL;
+    mem->size = 0;
+    mem->reserve = NULL;
+    mem->reserve_size = 0;
+    mem->unaligned = 0;
+    mem->mappings = NULL;
+    mem->devices = NULL;
+    mem->code_write = NULL;
+    mem->code_ctx = NULL;
+    mem->code = NULL;
+    mem->code_written = 0;
+    return mem;
+}
+
+Memory *initFlatMemory(size_t size)
+{
+    Memory *mem = initMemory(false);
+    long page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+    if(size > FLAT_SPAN)
+        size = FLAT_SPAN;
+
+    // Reserve all 4 GB of offsets plus the guards, only the first size bytes become RAM
+    mem->reserve_size = FLAT_SPAN + 2 * page;
+    mem->reserve = mmap(NULL, mem->reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mem->reserve == MAP_FAILED)
+    {
+        perror("Cannot reserve flat guest memory");
+        exit(EXIT_FAILURE);
+    }
+    mem->base = mem->reserve + page;
+    mem->size = size;
+    mem->page_bits = __builtin_ctzl(page); // Code is marked per host page, the unit mprotect() works in
+    if(mprotect(mem->base, mem->size, PROT_READ | PROT_WRITE) != 0)
+    {
+        perror("Cannot map flat guest memory");
+        exit(EXIT_FAILURE);
+    }
+    return mem;
+}
+
+void clearMemory(Memory *mem)
+{
+    // Private anonymous pages read back as zero once they're dropped, file
+    // mappings would read back the file so they're replaced outright
+    if(mem->base != NULL && mem->mappings != NULL)
+    {
+        if(mmap(mem->base, mem->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+        {
+            perror("Cannot map flat guest memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if(mem->base != NULL)
+        madvise(mem->base, mem->size, MADV_DONTNEED);
+    if(mem->code != NULL)
+    {
+        mprotect(mem->base, mem->size, PROT_READ | PROT_WRITE);
+        memset(mem->code, 0, mem->size >> mem->page_bits);
+        mem->code_written = 0;
+    }
+
+    while(mem->mappings != NULL)
+    {
+        Memory_Mapping *mapping = mem->mappings;
+        if(mem->base == NULL)
+            munmap(mapping->host, mapping->len);
+        mem->mappings = mapping->next;
+        free(mapping);
+    }
+
+    // Dropping the pages is cheaper than zeroing them, they come back zeroed
+    for(size_t i = 0; i < mem->num_slots; i++)
+    {
+        if(mem->pages[i].data != NULL && !(mem->pages[i].attrs & (PAGE_MAPPED | PAGE_MMIO)))
+            freePage(mem, mem->pages[i].data);
+    }
+    memset(mem->pages, 0, mem->num_slots * sizeof(Memory_Page));
+    mem->num_pages = 0;
+
+    // Devices stay where they are, in their power-on state
+    for(Mem_Device *device = mem->devices; device != NULL; device = device->next)
+    {
+        insertDevice(mem, device);
+        device->reads = 0;
+        device->writes = 0;
+        if(device->reset != NULL)
+            device->reset(device);
+    }
+    mem->last_page = NO_PAGE;
+    mem->last_data = NULL;
+    mem->write_page = NO_PAGE;
+    mem->write_data = NULL;
+    mem->unaligned = 0;
+}
+
+void freeMemory(Memory *mem)
+{
+    mem->devices = NULL;
+    clearMemory(mem);
+    if(mem->reserve != NULL)
+        munmap(mem->reserve, mem->reserve_size);
+    free(mem->code);
+    free(mem->pages);
+    free(mem);
+}
+
+static Memory_Page *findPage(Memory *mem, Addr page)
+{
+    // The page's slot, or the empty one it would go in
+    size_t slot = slotIndex(mem, page);
+    while(mem->pages[slot].data != NULL && mem->pages[slot].page != page)
+        slot = (slot + 1) & (mem->num_slots - 1);
+    return &mem->pages[slot];
+}
+
+static Memory_Page *insertPage(Memory *mem, Addr page, uint8_t *data, uint8_t attrs)
+{
+    // Keep the table at most half full so probe runs stay short
+    if(2 * (mem->num_pages + 1) > mem->num_slots)
+        growPages(mem);
+
+    Memory_Page *slot = findPage(mem, page);
+    slot->page = page;
+    slot->data = data;
+    slot->device = NULL;
+    slot->attrs = attrs;
+    mem->num_pages++;
+    return slot;
+}
+
+static void insertDevice(Memory *mem, Mem_Device *device)
+{
+    for(Addr addr = device->base; addr < device->base + device->size; addr += 1UL << mem->page_bits)
+        insertPage(mem, addr >> mem->page_bits, &mmio_data, PAGE_MMIO)->device = device;
+}
+
+bool memAddDevice(Memory *mem, Mem_Device *device)
+{
+    // Flat memory has no page table for the flag to live in. The device's
+    // pages must not be in use yet, clearMemory() first if they might be.
+    if(mem->base != NULL || (device->base & ((1UL << mem->page_bits) - 1)) != 0)
+        return false;
+    for(Addr addr = device->base; addr < device->base + device->size; addr += 1UL << mem->page_bits)
+    {
+        if(findPage(mem, addr >> mem->page_bits)->data != NULL)
+            return false;
+    }
+
+    insertDevice(mem, device);
+    device->reads = 0;
+    device->writes = 0;
+    device->next = mem->devices;
+    mem->devices = device;
+    return true;
+}
+
+static Mem_Device *pageDevice(Memory *mem, Addr addr)
+{
+    // Only asked once memPage() has come back empty, so RAM never pays for it
+    if(mem->devices == NULL)
+        return NULL;
+    Memory_Page *slot = findPage(mem, addr >> mem->page_bits);
+    return (slot->attrs & PAGE_MMIO) ? slot->device : NULL;
+}
+
+static uint64_t deviceRead(Mem_Device *device, Addr addr, unsigned size)
+{
+    // Devices see only the bytes the access asked for
+    device->reads++;
+    uint64_t data = device->read(device, addr - device->base, size);
+    return size == 8 ? data : data & ((1UL << (size * 8)) - 1);
+}
+
+static void deviceWrite(Mem_Device *device, Addr addr, uint64_t data, unsigned size)
+{
+    device->writes++;
+    device->write(device, addr - device->base, data, size);
+}
+
+static void unmarkCode(Memory *mem, Addr page)
+{
+    // The page is about to change, whoever decoded it drops what they have first
+    if(mem->base != NULL)
+    {
+        mem->code[page] = 0;
+        mprotect(mem->base + (page << mem->page_bits), 1UL << mem->page_bits, PROT_READ | PROT_WRITE);
+    }
+    if(mem->code_write != NULL)
+        mem->code_write(mem->code_ctx, page << mem->page_bits, 1UL << mem->page_bits);
+}
+
+uint8_t *memPage(Memory *mem, Addr addr, bool allocate)
+{
+    // allocate is set for stores, which go through their own cache
+    Addr page = addr >> mem->page_bits;
+    if(page == (allocate ? mem->write_page : mem->last_page))
+        return allocate ? mem->write_data : mem->last_data;
+
+    // MMIO pages have no data, NULL sends the caller to pageDevice()
+    Memory_Page *slot = findPage(mem, page);
+    if(slot->attrs & PAGE_MMIO)
+        return NULL;
+    if(slot->data == NULL)
+    {
+        if(!allocate)
+            return NULL;
+        slot = insertPage(mem, page, allocPage(mem), 0);
+    }
+
+    if(allocate)
+    {
+        if(slot->attrs & PAGE_CODE)
+        {
+            slot->attrs &= ~PAGE_CODE;
+            unmarkCode(mem, page);
+        }
+        mem->write_page = page;
+        mem->write_data = slot->data;
+    }
+    mem->last_page = page;
+    mem->last_data = slot->data;
+    return mem->last_data;
+}
+
+void memMarkCode(Memory *mem, Addr addr)
+{
+    if(mem->base != NULL)
+    {
+        // Past the end of flat memory nothing can be stored anyway
+        if(addr >= mem->size)
+            return;
+        Addr page = addr >> mem->page_bits;
+        if(mem->code == NULL)
+            mem->code = (uint8_t *)calloc(mem->size >> mem->page_bits, 1);
+        // A store it hasn't been told about would be lost once marked again
+        if(mem->code[page] == CODE_WRITTEN)
+            memCodeWritten(mem);
+        if(!mem->code[page])
+        {
+            mem->code[page] = CODE_MARKED;
+            mprotect(mem->base + (page << mem->page_bits), 1UL << mem->page_bits, PROT_READ);
+        }
+        return;
+    }
+
+    // A page that was never stored to gets allocated, so the mark has somewhere to live
+    Addr page = addr >> mem->page_bits;
+    Memory_Page *slot = findPage(mem, page);
+    if(slot->data == NULL)
+        slot = insertPage(mem, page, allocPage(mem), 0);
+    slot->attrs |= PAGE_CODE;
+    if(mem->write_page == page)
+    {
+        mem->write_page = NO_PAGE;
+        mem->write_data = NULL;
+    }
+}
+
+void memCodeWritten(Memory *mem)
+{
+    // Catch code_write up with the pages the fault handler let stores through to
+    mem->code_written = 0;
+    for(Addr page = 0; page < (mem->size >> mem->page_bits); page++)
+    {
+        if(mem->code[page] != CODE_WRITTEN)
+            continue;
+        mem->code[page] = 0;
+        if(mem->code_write != NULL)
+            mem->code_write(mem->code_ctx, page << mem->page_bits, 1UL << mem->page_bits);
+    }
+}
+
+static bool pageMapped(Memory *mem, Addr page_addr)
+{
+    for(Memory_Mapping *mapping = mem->mappings; mapping != NULL; mapping = mapping->next)
+    {
+        if(page_addr >= mapping->addr && page_addr < mapping->addr + mapping->len)
+            return true;
+    }
+    return false;
+}
+
+void memMapFile(Memory *mem, Addr addr, int fd, off_t offset, size_t len, size_t zero_len)
+{
+    // Makes [addr, addr + len) read as the file from offset on, and zeros up to
+    // zero_len after that as far as the last page the file shows up in
+    size_t page = sysconf(_SC_PAGESIZE);
+    Addr start = addr & ~(Addr)(page - 1);
+    size_t map_len = (addr - start + len + page - 1) & ~(page - 1);
+    if(mem->base != NULL && (start >= mem->size || map_len > mem->size - start))
+    {
+        fprintf(stderr, "[%#lx, %#lx) does not fit in flat memory\n", addr, addr + len);
+        exit(EXIT_FAILURE);
+    }
+
+    // Zero-copy needs guest pages the size of host ones, lined up with the file's,
+    // and none of them already in use
+    bool share = (offset & (page - 1)) == (addr & (page - 1)) && len != 0 &&
+                 (mem->base != NULL || mem->page_bits == (unsigned)__builtin_ctzl(page));
+    for(Addr p = start; share && p < start + map_len; p += page)
+        share = !pageMapped(mem, p) && (mem->base != NULL || findPage(mem, p >> mem->page_bits)->data == NULL);
+
+    if(share)
+    {
+        uint8_t *host = mem->base != NULL ? mem->base + start : NULL;
+        int flags = MAP_PRIVATE | (host != NULL ? MAP_FIXED : 0);
+        host = mmap(host, map_len, PROT_READ | PROT_WRITE, flags, fd, offset - (addr - start));
+        if(host == MAP_FAILED)
+        {
+            perror("Cannot map file into guest memory");
+            exit(EXIT_FAILURE);
+        }
+
+        Memory_Mapping *mapping = (Memory_Mapping *)malloc(sizeof(Memory_Mapping));
+        mapping->addr = start;
+        mapping->host = host;
+        mapping->len = map_len;
+        mapping->next = mem->mappings;
+        mem->mappings = mapping;
+        if(mem->base == NULL)
+        {
+            for(size_t i = 0; i < map_len; i += page)
+                insertPage(mem, (start + i) >> mem->page_bits, host + i, PAGE_MAPPED);
+        }
+    }
+    else
+    {
+        uint8_t *buf = (uint8_t *)malloc(len);
+        if(pread(fd, buf, len, offset) != (ssize_t)len)
+        {
+            perror("Cannot read file into guest memory");
+            exit(EXIT_FAILURE);
+        }
+        memWriteBytes(mem, addr, buf, len);
+        free(buf);
+    }
+
+    // The rest of the last page holds whatever followed in the file, the
+    // pages after it have never been stored to and read as zero already
+    Addr zero_end = (addr + len + page - 1) & ~(Addr)(page - 1);
+    if(zero_end > addr + len + zero_len)
+        zero_end = addr + len + zero_len;
+    for(Addr a = addr + len; a < zero_end; a++)
+        memWrite8(mem, a, 0);
+}
+
+bool memInRange(Memory *mem, Addr addr, size_t len)
+{
+    // Paged memory backs the whole 64-bit space
+    return mem->base == NULL || (addr <= mem->size && len <= mem->size - addr);
+}
+
+uint8_t memRead8(Memory *mem, Addr addr)
+{
+    // The byte accessors are for setup and debugging, they check instead of faulting
+    if(mem->base != NULL)
+        return addr < mem->size ? mem->base[addr] : 0;
+
+    uint8_t *data = memPage(mem, addr, false);
+    if(data == NULL)
+    {
+        Mem_Device *device = pageDevice(mem, addr);
+        return device == NULL ? 0 : deviceRead(device, addr, 1);
+    }
+    return data[addr & ((1UL << mem->page_bits) - 1)];
+}
+
+void memWrite8(Memory *mem, Addr addr, uint8_t data)
+{
+    if(mem->base != NULL)
+    {
+        if(addr >= mem->size)
+            return;
+        Addr page = addr >> mem->page_bits;
+        if(mem->code != NULL && mem->code[page])
+            unmarkCode(mem, page);
+        mem->base[addr] = data;
+        return;
+    }
+
+    uint8_t *page = memPage(mem, addr, true);
+    if(page == NULL)
+        deviceWrite(pageDevice(mem, addr), addr, data, 1);
+    else
+        page[addr & ((1UL << mem->page_bits) - 1)] = data;
+}
+
+void memReadBytes(Memory *mem, Addr addr, void *buf, size_t len)
+{
+    for(size_t i = 0; i < len; i++)
+        ((uint8_t *)buf)[i] = memRead8(mem, addr + i);
+}
+
+void memWriteBytes(Memory *mem, Addr addr, const void *buf, size_t len)
+{
+    for(size_t i = 0; i < len; i++)
+        memWrite8(mem, addr + i, ((const uint8_t *)buf)[i]);
+}
+
+// Where a flat access of size bytes at addr goes on the host. Anything reaching
+// past FLAT_SPAN faults here, the reservation would only catch it if it wrapped around.
+static uint8_t *flatHost(Memory *mem, Addr addr, unsigned size)
+{
+    if(addr > FLAT_SPAN - size)
+    {
+        if(fault_env != NULL && fault_mem == mem)
+        {
+            fault_addr = addr;
+            siglongjmp(*fault_env, MEM_FAULT);
+        }
+        fprintf(stderr, "Guest access fault: address %#lx\n", addr);
+        exit(EXIT_FAILURE);
+    }
+    return mem->base + addr;
+}
+
+uint64_t memReadSlow(Memory *mem, Addr addr, unsigned size)
+{
+    bool aligned = (addr & (size - 1)) == 0;
+    if(!aligned)
+        __atomic_fetch_add(&mem->unaligned, 1, __ATOMIC_RELAXED); // Harts on threads share mem
+
+    // Flat memory still faults past the end, the host doesn't mind the misalignment
+    if(mem->base != NULL)
+        return hostLoad(flatHost(mem, addr, size), size);
+
+    // Aligned, just not in the cached page, or a device's
+    if(aligned)
+    {
+        uint8_t *data = memPage(mem, addr, false);
+        if(data == NULL)
+        {
+            Mem_Device *device = pageDevice(mem, addr);
+            return device == NULL ? 0 : deviceRead(device, addr, size);
+        }
+        return hostLoad(data + (addr & ((1UL << mem->page_bits) - 1)), size);
+    }
+
+    // Little-endian, and it may straddle two pages. Devices only see it a byte at a time.
+    uint64_t data = 0;
+    for(unsigned i = 0; i < size; i++)
+        data |= (uint64_t)memRead8(mem, addr + i) << (i * 8);
+    return data;
+}
+
+void memWriteSlow(Memory *mem, Addr addr, uint64_t data, unsigned size)
+{
+    bool aligned = (addr & (size - 1)) == 0;
+    if(!aligned)
+        __atomic_fetch_add(&mem->unaligned, 1, __ATOMIC_RELAXED);
+
+    uint8_t *page;
+    if(mem->base != NULL)
+        hostStore(flatHost(mem, addr, size), data, size);
+    else if(aligned && (page = memPage(mem, addr, true)) != NULL)
+        hostStore(page + (addr & ((1UL << mem->page_bits) - 1)), data, size);
+    else if(aligned)
+        deviceWrite(pageDevice(mem, addr), addr, data, size);
+    else
+    {
+        for(unsigned i = 0; i < size; i++)
+            memWrite8(mem, addr + i, (uint8_t)(data >> (i * 8)));
+    }
+}
+
+uint8_t *memAtomicHost(Memory *mem, Addr addr, unsigned size)
+{
+    // Where a read-modify-write can go straight to RAM with one host atomic.
+    // NULL for misaligned addresses and devices, those go through memRead() and
+    // memWrite() instead. Paged memory gets the page as a store would, so
+    // decoded code on it is dropped first.
+    if((addr & (size - 1)) != 0)
+        return NULL;
+    if(mem->base != NULL)
+        return flatHost(mem, addr, size);
+
+    uint8_t *page = memPage(mem, addr, true);
+    return page == NULL ? NULL : page + (addr & ((1UL << mem->page_bits) - 1));
+}
+
+static void faultHandler(int sig, siginfo_t *info, void *context)
+{
+    uint8_t *host = (uint8_t *)info->si_addr;
+    Memory *mem = fault_mem;
+
+    // A store to a page with decoded code on it, let the store go again. Dropping
+    // the code allocates and the engine may be partway through it, so that waits
+    // for memCodeWritten() from the engine.
+    if(mem != NULL && mem->code != NULL && host >= mem->base && host < mem->base + mem->size &&
+       mem->code[(host - mem->base) >> mem->page_bits] == CODE_MARKED)
+    {
+        Addr page = (host - mem->base) >> mem->page_bits;
+        mem->code[page] = CODE_WRITTEN;
+        mem->code_written = 1;
+        mprotect(mem->base + (page << mem->page_bits), 1UL << mem->page_bits, PROT_READ | PROT_WRITE);
+        return;
+    }
+
+    // Flat accesses are base + addr, so the host address gives the guest one back.
+    // An unaligned access straddling the end reports its first byte out of range.
+    if(mem != NULL && fault_env != NULL && host >= mem->reserve && host < mem->reserve + mem->reserve_size)
+    {
+        fault_addr = (Addr)(host - mem->base);
+        siglongjmp(*fault_env, MEM_FAULT);
+    }
+
+    // Not a guest access, crash the way we would have without the handler
+    signal(sig, SIG_DFL);
+}
+
+static void installFaultHandler(void)
+{
+    // Process-wide, each thread arms its own jump buffer
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = faultHandler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER; // Jumped out of, never returns to unblock
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+void memCatchFaults(Memory *mem, sigjmp_buf *env)
+{
+    // Until env is disarmed with NULL, a fault inside mem's reservation jumps to it
+    static pthread_once_t installed = PTHREAD_ONCE_INIT;
+    pthread_once(&installed, installFaultHandler);
+    fault_mem = mem;
+    fault_env = env;
+}
+
+Addr memFaultAddr(void)
+{
+    // After MEM_FAULT, on the thread that took it
+    return fault_addr;
+}
+
+void memStopRun(void)
+{
+    // Leaves the run the way a fault does, nothing to do outside one
+    if(fault_env != NULL)
+        siglongjmp(*fault_env, MEM_STOP);
+}
@@ -1,8 +1,13 @@
 #ifndef __REGISTERS_H__
 #define __REGISTERS_H__
 
+#include <stddef.h>
+
 #define NUM_OF_REGS 64
+#define FP_REG_BASE 32 // f0 is register 32
 
 extern const char* REGISTER_NAME[NUM_OF_REGS];
 
+int regIndex(const char *reg, size_t len);
+
 #endif
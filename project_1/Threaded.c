@@ -0,0 +1,419 @@
+#include "Threaded.h"
+#include "Isa.h"
+#include "Lsu.h"
+
+// Indexed by funct3, which sets the width
+static const ThreadedOpcode load_opcodes[8] = { T_LB, T_LH, T_LW, T_LD, T_LBU, T_LHU, T_LWU, T_NOP };
+static const ThreadedOpcode store_opcodes[4] = { T_SB, T_SH, T_SW, T_SD };
+
+ThreadedOpcode threadedOpcode(DecodedInstruction *decoded)
+{
+    ControlSignals *ctrl = &decoded->ctrl;
+
+    // Ahead of the rd == 0 check below, loads and atomics into x0 still access
+    // memory, which can fault or reach a device
+    if(ctrl->atomic)
+        return T_AMO;
+    if(ctrl->jal)
+        return T_JAL;
+    if(ctrl->jalr)
+        return T_JALR;
+    if(ctrl->memWrite)
+        return store_opcodes[decoded->funct3 & 0b11];
+    if(ctrl->beq)
+        return T_BEQ;
+    if(ctrl->bne)
+        return T_BNE;
+    if(ctrl->blt)
+        return T_BLT;
+    if(ctrl->bge)
+        return T_BGE;
+
+    if(ctrl->memRead)
+        return load_opcodes[decoded->funct3];
+
+    // Everything left only writes rd, so writing x0 does nothing at all
+    if(!ctrl->regWrite || decoded->rd == 0)
+        return T_NOP;
+
+    switch(decoded->alu_ctrl)
+    {
+    case ALU_AND:
+        return ctrl->aluSrc ? T_ANDI : T_AND;
+    case ALU_OR:
+        return ctrl->aluSrc ? T_ORI : T_OR;
+    case ALU_ADD:
+        return ctrl->aluSrc ? T_ADDI : T_ADD;
+    case ALU_SLL:
+        return ctrl->aluSrc ? T_SLLI : T_SLL;
+    case ALU_SRL:
+        return ctrl->aluSrc ? T_SRLI : T_SRL;
+    case ALU_XOR:
+        return ctrl->aluSrc ? T_XORI : T_XOR;
+    case ALU_SUB:
+        return ctrl->aluSrc ? T_NOP : T_SUB;
+    case ALU_SLT:
+        return ctrl->aluSrc ? T_SLTI : T_SLT;
+    }
+
+    return T_NOP;
+}
+
+static bool readsReg(ThreadedOpcode opcode, DecodedInstruction *decoded, uint8_t reg)
+{
+    // Branches and R-type read both sources, everything else only rs_1
+    bool reads_rs_2 = opcode <= T_SLT || (opcode >= T_SB && opcode <= T_BGE) || opcode == T_AMO;
+    return decoded->rs_1 == reg || (reads_rs_2 && decoded->rs_2 == reg);
+}
+
+ThreadedOpcode fusedOpcode(ThreadedOpcode *opcodes, DecodedInstruction *decoded, size_t num_instrs)
+{
+    // Each pattern needs the later ops to consume what the head produced
+    if(num_instrs < 2 || !readsReg(opcodes[1], &decoded[1], decoded[0].rd))
+        return opcodes[0];
+
+    // Address generation: slli; add; and maybe a load through the result
+    if(opcodes[0] == T_SLLI && opcodes[1] == T_ADD)
+    {
+        if(num_instrs >= 3 && opcodes[2] == T_LD && decoded[2].rs_1 == decoded[1].rd)
+            return T_SLLI_ADD_LD;
+        return T_SLLI_ADD;
+    }
+
+    // Loop counters: addi; branch on the new value
+    if(opcodes[0] == T_ADDI)
+    {
+        if(opcodes[1] == T_BEQ)
+            return T_ADDI_BEQ;
+        if(opcodes[1] == T_BNE)
+            return T_ADDI_BNE;
+        if(opcodes[1] == T_BLT)
+            return T_ADDI_BLT;
+        if(opcodes[1] == T_BGE)
+            return T_ADDI_BGE;
+    }
+
+    // Compare and branch: slt/slti; beq/bne on the flag
+    if(opcodes[0] == T_SLT || opcodes[0] == T_SLTI)
+    {
+        if(opcodes[1] == T_BEQ)
+            return opcodes[0] == T_SLT ? T_SLT_BEQ : T_SLTI_BEQ;
+        if(opcodes[1] == T_BNE)
+            return opcodes[0] == T_SLT ? T_SLT_BNE : T_SLTI_BNE;
+    }
+
+    return opcodes[0];
+}
+
+// Threaded code for one decode page: an op per instruction, then one that
+// carries on into the next page, then one per branch or jal that leaves the
+// page. Those are T_ENTER ops, or T_EXIT past the end of the program.
+static ThreadedOp *translatePage(Core *core, const void *const *handlers, Addr page_num)
+{
+    Addr last_addr = core->instr_mem->last_addr;
+    size_t first = page_num << DECODE_PAGE_BITS;
+    size_t num_instrs = core->instr_mem->num_instrs - first;
+    if(num_instrs > 1 << DECODE_PAGE_BITS)
+        num_instrs = 1 << DECODE_PAGE_BITS;
+    ThreadedOp *code = calloc(2 * num_instrs + 1, sizeof(ThreadedOp));
+    ThreadedOpcode opcodes[1 << DECODE_PAGE_BITS];
+    ThreadedOp *exits = &code[num_instrs];
+    size_t num_exits = 1;
+
+    exits[0].PC = (first + num_instrs) * 4;
+    exits[0].handler = handlers[exits[0].PC > last_addr ? T_EXIT : T_ENTER];
+
+    DecodedInstruction *decoded = fetchDecoded(core, first * 4);
+    for(size_t i = 0; i < num_instrs; i++)
+    {
+        ThreadedOp *op = &code[i];
+        ThreadedOpcode opcode = threadedOpcode(&decoded[i]);
+
+        opcodes[i] = opcode;
+        op->handler = handlers[opcode];
+        op->imm = decoded[i].imm;
+        op->PC = (first + i) * 4;
+        op->rd = decoded[i].rd;
+        op->rs_1 = decoded[i].rs_1;
+        op->rs_2 = decoded[i].rs_2;
+        op->funct3 = decoded[i].funct3;
+        op->funct5 = decoded[i].funct5;
+
+        if(opcode == T_BEQ || opcode == T_BNE || opcode == T_BLT || opcode == T_BGE || opcode == T_JAL)
+        {
+            Addr target = op->PC + op->imm;
+            if(target / 4 - first < num_instrs)
+            {
+                op->target = &code[target / 4 - first];
+            }
+            else
+            {
+                exits[num_exits].handler = handlers[target > last_addr ? T_EXIT : T_ENTER];
+                exits[num_exits].PC = target;
+                op->target = &exits[num_exits++];
+            }
+        }
+    }
+
+    // Fuse idioms into their first op. The ops they swallow keep their own
+    // slots, so jumping into the middle of a fused sequence still works.
+    // Patterns stay inside the page, the op after its last is the way out.
+    for(size_t i = 0; i < num_instrs; i++)
+        code[i].handler = handlers[fusedOpcode(&opcodes[i], &decoded[i], num_instrs - i)];
+    return code;
+}
+
+// The op for PC, which is inside the program, translating its page if it has to
+static inline ThreadedOp *threadedOp(Core *core, const void *const *handlers, ThreadedOp **pages, Addr PC)
+{
+    Addr page_num = PC >> DECODE_PAGE_SHIFT;
+    if(pages[page_num] == NULL)
+        pages[page_num] = translatePage(core, handlers, page_num);
+    return &pages[page_num][(PC / 4) & ((1 << DECODE_PAGE_BITS) - 1)];
+}
+
+bool runThreaded(Core *core)
+{
+    static const void *handlers[NUM_THREADED_OPCODES] = {
+        [T_NOP] = &&do_nop,
+        [T_ADD] = &&do_add,
+        [T_SUB] = &&do_sub,
+        [T_SLL] = &&do_sll,
+        [T_SRL] = &&do_srl,
+        [T_XOR] = &&do_xor,
+        [T_OR] = &&do_or,
+        [T_AND] = &&do_and,
+        [T_SLT] = &&do_slt,
+        [T_ADDI] = &&do_addi,
+        [T_SLLI] = &&do_slli,
+        [T_SRLI] = &&do_srli,
+        [T_XORI] = &&do_xori,
+        [T_ORI] = &&do_ori,
+        [T_ANDI] = &&do_andi,
+        [T_SLTI] = &&do_slti,
+        [T_LB] = &&do_lb,
+        [T_LH] = &&do_lh,
+        [T_LW] = &&do_lw,
+        [T_LD] = &&do_ld,
+        [T_LBU] = &&do_lbu,
+        [T_LHU] = &&do_lhu,
+        [T_LWU] = &&do_lwu,
+        [T_SB] = &&do_sb,
+        [T_SH] = &&do_sh,
+        [T_SW] = &&do_sw,
+        [T_SD] = &&do_sd,
+        [T_BEQ] = &&do_beq,
+        [T_BNE] = &&do_bne,
+        [T_BLT] = &&do_blt,
+        [T_BGE] = &&do_bge,
+        [T_JAL] = &&do_jal,
+        [T_JALR] = &&do_jalr,
+        [T_AMO] = &&do_amo,
+        [T_EXIT] = &&do_exit,
+        [T_ENTER] = &&do_enter,
+        [T_SLLI_ADD] = &&do_slli_add,
+        [T_SLLI_ADD_LD] = &&do_slli_add_ld,
+        [T_ADDI_BEQ] = &&do_addi_beq,
+        [T_ADDI_BNE] = &&do_addi_bne,
+        [T_ADDI_BLT] = &&do_addi_blt,
+        [T_ADDI_BGE] = &&do_addi_bge,
+        [T_SLT_BEQ] = &&do_slt_beq,
+        [T_SLT_BNE] = &&do_slt_bne,
+        [T_SLTI_BEQ] = &&do_slti_beq,
+        [T_SLTI_BNE] = &&do_slti_bne,
+    };
+
+    if(core->instr_mem->num_instrs == 0 || core->PC > core->instr_mem->last_addr)
+        return false;
+
+    // Nothing is translated until it runs
+    Addr last_addr = core->instr_mem->last_addr;
+    size_t num_pages = core->decode_cache.num_pages;
+    ThreadedOp **pages = calloc(num_pages, sizeof(ThreadedOp *));
+
+    // Execute
+    uint64_t *reg = core->reg_file;
+    Memory *mem = core->data_mem;
+    ThreadedOp *op = threadedOp(core, handlers, pages, core->PC);
+    Tick start_clk = core->clk;
+    Tick retired = 0;
+    Tick fused = 0;
+    Addr exit_PC;
+    Addr target;
+
+#define DISPATCH() goto *op->handler
+#define NEXT() do { retired++; op++; DISPATCH(); } while(0)
+#define BRANCH(cond) do { retired++; op = (cond) ? op->target : op + 1; DISPATCH(); } while(0)
+#define FUSED_NEXT(n) do { retired += n; fused += n; op += n; DISPATCH(); } while(0)
+#define FUSED_BRANCH(cond) do { retired += 2; fused += 2; op = (cond) ? op[1].target : op + 2; DISPATCH(); } while(0)
+// PC and clk go to the core first, for the report if flat memory faults and for
+// a device that reads the clock or ends the run
+#define SYNC(n) do { core->PC = op[n].PC; core->clk = start_clk + retired + n; } while(0)
+#define LOAD(funct3) do { SYNC(0); reg[op->rd] = lsuLoad(mem, reg[op->rs_1] + op->imm, funct3); reg[0] = 0; NEXT(); } while(0)
+#define STORE(funct3) do { SYNC(0); lsuStore(mem, reg[op->rs_1] + op->imm, reg[op->rs_2], funct3); NEXT(); } while(0)
+
+    DISPATCH();
+
+do_nop:
+    NEXT();
+do_add:
+    reg[op->rd] = reg[op->rs_1] + reg[op->rs_2];
+    NEXT();
+do_sub:
+    reg[op->rd] = reg[op->rs_1] - reg[op->rs_2];
+    NEXT();
+do_sll:
+    reg[op->rd] = reg[op->rs_1] << (reg[op->rs_2] & 0x3F);
+    NEXT();
+do_srl:
+    reg[op->rd] = reg[op->rs_1] >> (reg[op->rs_2] & 0x3F);
+    NEXT();
+do_xor:
+    reg[op->rd] = reg[op->rs_1] ^ reg[op->rs_2];
+    NEXT();
+do_or:
+    reg[op->rd] = reg[op->rs_1] | reg[op->rs_2];
+    NEXT();
+do_and:
+    reg[op->rd] = reg[op->rs_1] & reg[op->rs_2];
+    NEXT();
+do_slt:
+    reg[op->rd] = (int64_t)reg[op->rs_1] < (int64_t)reg[op->rs_2];
+    NEXT();
+do_addi:
+    reg[op->rd] = reg[op->rs_1] + op->imm;
+    NEXT();
+do_slli:
+    reg[op->rd] = reg[op->rs_1] << (op->imm & 0x3F);
+    NEXT();
+do_srli:
+    reg[op->rd] = reg[op->rs_1] >> (op->imm & 0x3F);
+    NEXT();
+do_xori:
+    reg[op->rd] = reg[op->rs_1] ^ op->imm;
+    NEXT();
+do_ori:
+    reg[op->rd] = reg[op->rs_1] | op->imm;
+    NEXT();
+do_andi:
+    reg[op->rd] = reg[op->rs_1] & op->imm;
+    NEXT();
+do_slti:
+    reg[op->rd] = (int64_t)reg[op->rs_1] < op->imm;
+    NEXT();
+do_lb:
+    LOAD(0b000);
+do_lh:
+    LOAD(0b001);
+do_lw:
+    LOAD(0b010);
+do_ld:
+    LOAD(0b011);
+do_lbu:
+    LOAD(0b100);
+do_lhu:
+    LOAD(0b101);
+do_lwu:
+    LOAD(0b110);
+do_sb:
+    STORE(0b000);
+do_sh:
+    STORE(0b001);
+do_sw:
+    STORE(0b010);
+do_sd:
+    STORE(0b011);
+do_beq:
+    BRANCH(reg[op->rs_1] == reg[op->rs_2]);
+do_bne:
+    BRANCH(reg[op->rs_1] != reg[op->rs_2]);
+do_blt:
+    BRANCH((int64_t)reg[op->rs_1] < (int64_t)reg[op->rs_2]);
+do_bge:
+    BRANCH((int64_t)reg[op->rs_1] >= (int64_t)reg[op->rs_2]);
+do_jal:
+    reg[op->rd] = op->PC + 4;
+    reg[0] = 0;
+    retired++;
+    op = op->target;
+    DISPATCH();
+do_jalr:
+    target = reg[op->rs_1] + op->imm; // Before the link write, rd may be rs_1
+    reg[op->rd] = op->PC + 4;
+    reg[0] = 0;
+    retired++;
+    if(target > last_addr)
+    {
+        exit_PC = target;
+        goto done;
+    }
+    op = threadedOp(core, handlers, pages, target);
+    DISPATCH();
+do_amo:
+    SYNC(0);
+    reg[op->rd] = lsuAtomic(mem, &core->reservation, reg[op->rs_1], reg[op->rs_2], op->funct3, op->funct5);
+    reg[0] = 0;
+    NEXT();
+do_slli_add:
+    reg[op->rd] = reg[op->rs_1] << (op->imm & 0x3F);
+    reg[op[1].rd] = reg[op[1].rs_1] + reg[op[1].rs_2];
+    FUSED_NEXT(2);
+do_slli_add_ld:
+    reg[op->rd] = reg[op->rs_1] << (op->imm & 0x3F);
+    reg[op[1].rd] = reg[op[1].rs_1] + reg[op[1].rs_2];
+    SYNC(2);
+    reg[op[2].rd] = lsuLoad(mem, reg[op[2].rs_1] + op[2].imm, 0b011);
+    reg[0] = 0;
+    FUSED_NEXT(3);
+do_addi_beq:
+    reg[op->rd] = reg[op->rs_1] + op->imm;
+    FUSED_BRANCH(reg[op[1].rs_1] == reg[op[1].rs_2]);
+do_addi_bne:
+    reg[op->rd] = reg[op->rs_1] + op->imm;
+    FUSED_BRANCH(reg[op[1].rs_1] != reg[op[1].rs_2]);
+do_addi_blt:
+    reg[op->rd] = reg[op->rs_1] + op->imm;
+    FUSED_BRANCH((int64_t)reg[op[1].rs_1] < (int64_t)reg[op[1].rs_2]);
+do_addi_bge:
+    reg[op->rd] = reg[op->rs_1] + op->imm;
+    FUSED_BRANCH((int64_t)reg[op[1].rs_1] >= (int64_t)reg[op[1].rs_2]);
+do_slt_beq:
+    reg[op->rd] = (int64_t)reg[op->rs_1] < (int64_t)reg[op->rs_2];
+    FUSED_BRANCH(reg[op[1].rs_1] == reg[op[1].rs_2]);
+do_slt_bne:
+    reg[op->rd] = (int64_t)reg[op->rs_1] < (int64_t)reg[op->rs_2];
+    FUSED_BRANCH(reg[op[1].rs_1] != reg[op[1].rs_2]);
+do_slti_beq:
+    reg[op->rd] = (int64_t)reg[op->rs_1] < op->imm;
+    FUSED_BRANCH(reg[op[1].rs_1] == reg[op[1].rs_2]);
+do_slti_bne:
+    reg[op->rd] = (int64_t)reg[op->rs_1] < op->imm;
+    FUSED_BRANCH(reg[op[1].rs_1] != reg[op[1].rs_2]);
+do_enter:
+    // Chained to the op it leads to once that page is translated
+    if(op->target == NULL)
+        op->target = threadedOp(core, handlers, pages, op->PC);
+    op = op->target;
+    DISPATCH();
+do_exit:
+    exit_PC = op->PC;
+
+done:
+#undef DISPATCH
+#undef NEXT
+#undef BRANCH
+#undef FUSED_NEXT
+#undef FUSED_BRANCH
+#undef SYNC
+#undef LOAD
+#undef STORE
+    core->PC = exit_PC;
+    core->clk = start_clk + retired;
+    core->fused_instrs += fused;
+    for(size_t i = 0; i < num_pages; i++)
+        free(pages[i]);
+    free(pages);
+
+    // Runs to completion in one call, so there's never another tick
+    return false;
+}
@@ -0,0 +1,80 @@
+#ifndef __THREADED_H__
+#define __THREADED_H__
+
+#include "Core.h"
+
+// Functional execution mode: no timing, no control signals, no muxes.
+// Instruction memory is translated into threaded code, one ThreadedOp per
+// instruction, and dispatched with computed goto. Each decode page is
+// translated the first time anything in it runs.
+typedef enum ThreadedOpcode
+{
+    T_NOP,
+    T_ADD,
+    T_SUB,
+    T_SLL,
+    T_SRL,
+    T_XOR,
+    T_OR,
+    T_AND,
+    T_SLT,
+    T_ADDI,
+    T_SLLI,
+    T_SRLI,
+    T_XORI,
+    T_ORI,
+    T_ANDI,
+    T_SLTI,
+    T_LB,
+    T_LH,
+    T_LW,
+    T_LD,
+    T_LBU,
+    T_LHU,
+    T_LWU,
+    T_SB,
+    T_SH,
+    T_SW,
+    T_SD,
+    T_BEQ,
+    T_BNE,
+    T_BLT,
+    T_BGE,
+    T_JAL,
+    T_JALR,
+    T_AMO, // Every atomic, funct5 says which
+    T_EXIT,
+    T_ENTER, // Into another page, translated the first time this is taken
+    // Fused macro-ops: the head op runs the ops after it as well
+    T_SLLI_ADD,
+    T_SLLI_ADD_LD,
+    T_ADDI_BEQ,
+    T_ADDI_BNE,
+    T_ADDI_BLT,
+    T_ADDI_BGE,
+    T_SLT_BEQ,
+    T_SLT_BNE,
+    T_SLTI_BEQ,
+    T_SLTI_BNE,
+    NUM_THREADED_OPCODES
+} ThreadedOpcode;
+
+typedef struct ThreadedOp ThreadedOp;
+typedef struct ThreadedOp
+{
+    const void *handler; // Label inside runThreaded()
+    ThreadedOp *target; // Taken successor of branches and jal
+    int64_t imm;
+    Addr PC;
+    uint8_t rd;
+    uint8_t rs_1;
+    uint8_t rs_2;
+    uint8_t funct3; // Width and operation of T_AMO
+    uint8_t funct5;
+} ThreadedOp;
+
+ThreadedOpcode threadedOpcode(DecodedInstruction *decoded);
+ThreadedOpcode fusedOpcode(ThreadedOpcode *opcodes, DecodedInstruction *decoded, size_t num_instrs);
+bool runThreaded(Core *core);
+
+#endif
@@ -0,0 +1,82 @@
+#include "Tiered.h"
+#include "Block.h"
+#include "Jit.h"
+
+bool runTiered(Core *core)
+{
+    if(core->instr_mem->num_instrs == 0)
+        return false;
+
+    Jit *jit = initJit(core);
+    core->jit = jit;
+    Block_Map *map = core->block_map;
+    Addr last_addr = core->instr_mem->last_addr;
+    while(core->PC <= last_addr)
+    {
+        if(core->data_mem->code_written)
+            memCodeWritten(core->data_mem);
+
+        Block *block = findBlock(core, map, core->PC);
+
+        // Off an instruction boundary or on a rewritten page, step through it
+        if(block == NULL)
+        {
+            tickFunc(core);
+            core->interpreted_instrs++;
+            continue;
+        }
+
+        // Hot: run translated code, which may chain through several blocks
+        JitBlock *translated = jitBlock(jit, core->PC);
+        if(translated->code != NULL)
+        {
+            Tick start = core->clk;
+            core->PC = translated->code(core->reg_file, core->data_mem, &core->clk);
+            core->jit_entry = NOT_IN_JIT;
+            core->translated_instrs += core->clk - start;
+            continue;
+        }
+
+        // Cold: count it, and promote it once it crosses the threshold.
+        // Blocks the JIT can't take stay interpreted.
+        if(!block->promoted && ++block->count >= core->hot_threshold)
+        {
+            block->promoted = true;
+            if(jitTranslate(jit, core, core->PC)->code != NULL)
+                continue;
+        }
+
+        DecodedInstruction *decoded = fetchDecoded(core, block->PC);
+        for(unsigned i = 0; i < block->num_instrs; i++)
+            executeInstruction(core, &decoded[i]);
+        core->clk += block->num_instrs;
+        core->interpreted_instrs += block->num_instrs;
+    }
+
+    core->jit = NULL;
+    freeJit(jit);
+
+    // Runs to completion in one call, so there's never another tick
+    return false;
+}
+
+void printTierStats(Core *core)
+{
+    Tick total = core->interpreted_instrs + core->translated_instrs;
+    if(total == 0)
+        total = 1;
+
+    // Out of the blocks found, the rest of the program never ran
+    Block_Map *map = core->block_map;
+    size_t promoted = 0;
+    size_t num_blocks = map == NULL ? 0 : map->num_blocks;
+    for(size_t i = 0; map != NULL && i < map->num_pages; i++)
+    {
+        for(Block *block = map->pages[i] == NULL ? NULL : map->pages[i]->blocks; block != NULL; block = block->next)
+            promoted += block->promoted;
+    }
+
+    printf("Interpreted instructions: %lu (%.1f%%)\n", core->interpreted_instrs, 100.0 * core->interpreted_instrs / total);
+    printf("Translated instructions: %lu (%.1f%%)\n", core->translated_instrs, 100.0 * core->translated_instrs / total);
+    printf("Blocks promoted: %zu of %zu (threshold %u)\n", promoted, num_blocks, core->hot_threshold);
+}
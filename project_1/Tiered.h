@@ -0,0 +1,12 @@
+#ifndef __TIERED_H__
+#define __TIERED_H__
+
+#include "Core.h"
+
+// Tiered execution: every block starts out interpreted through the decoded
+// single-cycle datapath and is handed to the JIT once it has been entered
+// core->hot_threshold times, so setup code never pays for translation.
+bool runTiered(Core *core);
+void printTierStats(Core *core);
+
+#endif
@@ -0,0 +1,117 @@
+#include "TraceCache.h"
+#include "Isa.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char *cachePath(const char *trace)
+{
+    size_t len = strlen(trace);
+    char *path = (char *)malloc(len + sizeof(TRACE_CACHE_SUFFIX));
+    memcpy(path, trace, len);
+    memcpy(path + len, TRACE_CACHE_SUFFIX, sizeof(TRACE_CACHE_SUFFIX));
+    return path;
+}
+
+static uint64_t mix(uint64_t hash, uint64_t word)
+{
+    return (((hash << 5) | (hash >> 59)) ^ word) * 0x517CC1B727220A95UL;
+}
+
+uint64_t hashTrace(const uint8_t *text, size_t size)
+{
+    // Seeded with every row of the ISA table, so changing an encoding invalidates the images
+    uint64_t hash = TRACE_CACHE_VERSION;
+    for(size_t i = 0; i < NUM_ISA_ENTRIES; i++)
+    {
+        hash = mix(hash, isaEncode(&ISA[i], 1, 2, 3, -1));
+        for(const char *c = ISA[i].mnemonic; *c != '\0'; c++)
+            hash = mix(hash, *c);
+    }
+
+    // Then the text eight bytes at a time
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, text + i, sizeof(word));
+        hash = mix(hash, word);
+    }
+    uint64_t tail = 0;
+    if(i < size)
+        memcpy(&tail, text + i, size - i);
+    return mix(mix(hash, tail), size);
+}
+
+bool loadTraceCache(Instruction_Memory *i_mem, const char *trace, uint64_t hash, size_t size)
+{
+    char *path = cachePath(trace);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    Trace_Image *image = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Trace_Image))
+        image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED)
+        return false;
+
+    // Anything that doesn't match exactly is stale or from another build, parse the text instead
+    bool hit = memcmp(image->magic, TRACE_CACHE_MAGIC, sizeof(image->magic)) == 0 &&
+               image->version == TRACE_CACHE_VERSION &&
+               image->source_hash == hash && image->source_size == size &&
+               (size_t)st.st_size == sizeof(Trace_Image) + (size_t)image->num_instrs * sizeof(uint32_t) &&
+               (image->num_instrs == 0 || image->last_addr == (image->num_instrs - 1) * 4);
+
+    // The words are used where they are, pages of the image are only read in once fetched from
+    if(hit)
+        imemMap(i_mem, image, st.st_size, image->words, image->num_instrs);
+    else
+        munmap(image, st.st_size);
+    return hit;
+}
+
+void saveTraceCache(Instruction_Memory *i_mem, const char *trace, uint64_t hash, size_t size)
+{
+    Trace_Image header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_CACHE_VERSION;
+    header.num_instrs = i_mem->num_instrs;
+    header.source_hash = hash;
+    header.source_size = size;
+    header.entry = 0;
+    header.last_addr = i_mem->last_addr;
+    size_t words_size = i_mem->num_instrs * sizeof(uint32_t);
+
+    // Written aside and renamed into place, so a concurrent run never maps half an image.
+    // The cache is only an optimization, a directory we can't write to just goes without.
+    char *path = cachePath(trace);
+    char *tmp_path = (char *)malloc(strlen(path) + 32);
+    sprintf(tmp_path, "%s.%d", path, (int)getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd >= 0)
+    {
+        bool written = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+        for(size_t done = 0; written && done < words_size; )
+        {
+            ssize_t n = write(fd, (const uint8_t *)i_mem->words + done, words_size - done);
+            written = n > 0;
+            done += written ? n : 0;
+        }
+        close(fd);
+        if(!written || rename(tmp_path, path) != 0)
+            unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(path);
+}
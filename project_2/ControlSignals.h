@@ -19,6 +19,7 @@ typedef struct ControlSignals
     uint8_t bge;
     uint8_t jal;
     uint8_t jalr;
+    uint8_t atomic; // Goes to lsuAtomic() instead of a plain load or store
 } ControlSignals;
 
 #endif
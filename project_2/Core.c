@@ -1,35 +1,72 @@
 #include "Core.h"
+#include "Devices.h"
 #include "Registers.h"
+#include "Isa.h"
+#include "Lsu.h"
 
 Core *initCore(Instruction_Memory *i_mem)
 {
     Core *core = (Core *)malloc(sizeof(Core));
+    core->instr_mem = i_mem;
+    core->devices = NULL;
+    core->data_mem = initMemory(false);
+    resetCore(core);
+
+    return core;
+}
+
+void freeCore(Core *core)
+{
+    freeMemory(core->data_mem);
+    if(core->devices != NULL)
+        freeDevices(core->devices);
+    free(core);
+}
+
+bool runCore(Core *core)
+{
+    // Flat memory turns stray accesses into SIGSEGV, they come back here as guest faults
+    // raised by the instruction in MEM. A device ending the run comes back here too.
+    sigjmp_buf env;
+    int jumped = sigsetjmp(env, 0);
+    if(jumped)
+    {
+        memCatchFaults(core->data_mem, NULL);
+        if(jumped == MEM_STOP)
+            return true;
+        fprintf(stderr, "Guest access fault at PC %lu: address %#lx\n", core->cur->mem.PC, memFaultAddr());
+        return false;
+    }
+
+    memCatchFaults(core->data_mem, &env);
+    while(core->tick(core));
+    memCatchFaults(core->data_mem, NULL);
+    return true;
+}
+
+void resetCore(Core *core)
+{
+    // Back to the initial state, with an empty pipeline
     core->clk = 0;
+    core->instret = 0;
     core->done = 0;
-    core->instr_mem = i_mem;
     core->tick = tickFunc;
     memset(core->reg_file, 0, NUM_REGS*sizeof(core->reg_file[0]));
-    memset(core->data_mem, 0, NUM_BYTES*sizeof(core->data_mem[0]));
-
-    core->instr_fetch = malloc(sizeof(IF));
-    core->instr_fetch->PC = 0;
-    core->id = malloc(sizeof(ID));
-    core->id->ctrl = calloc(1, sizeof(ControlSignals));
-    core->ex = malloc(sizeof(EX));
-    core->ex->ctrl = calloc(1, sizeof(ControlSignals));
-    core->mem = malloc(sizeof(MEM));
-    core->mem->ctrl = calloc(1, sizeof(ControlSignals));
-    core->wb = malloc(sizeof(WB));
-    core->wb->ctrl = calloc(1, sizeof(ControlSignals));
+    clearMemory(core->data_mem);
+    core->reservation.valid = false;
+
+    memset(core->latches, 0, sizeof(core->latches));
+    core->cur = &core->latches[0];
+    core->next = &core->latches[1];
 
     /* UNCOMMENT  TO SET DEFAULT VALUES FOR matrix  */ /* 
-    core->reg_file[1] = core->instr_mem->last->addr;
+    core->reg_file[1] = core->instr_mem->last_addr;
     core->reg_file[2] = NUM_BYTES - 8;
     core->reg_file[10] = 0;
     core->reg_file[11] = 128;
 
     for(int i = 0; i < 16; i++)
-    core->data_mem[i*8] = i;
+    memWrite8(core->data_mem, i*8, i);
 						       */
 
     /* UNCOMMENT TO SET DEFAULT VALUES FOR task_0 */ /*
@@ -39,8 +76,8 @@ Core *initCore(Instruction_Memory *i_mem)
     core->reg_file[4] = 20;
     core->reg_file[5] = 30;
     core->reg_file[6] = -35;
-    core->data_mem[40] = -63;
-    core->data_mem[48] = 63;
+    memWrite8(core->data_mem, 40, -63);
+    memWrite8(core->data_mem, 48, 63);
 						     */
 
     /* UNCOMMENT TO SET DEFAULT VALUES FOR task_1 */ /*
@@ -60,7 +97,7 @@ Core *initCore(Instruction_Memory *i_mem)
     /* UNCOMMENT TO SET DEFAULT VALUES FOR task_2 */ 
     core->reg_file[5] = 26;
     core->reg_file[6] = -27;
-    core->data_mem[20] = 100; 
+    memWrite8(core->data_mem, 20, 100); 
 						     
     
     /* UNCOMMENT TO SET DEFAULT VALUES FOR task_3 */ /*
@@ -68,7 +105,7 @@ Core *initCore(Instruction_Memory *i_mem)
     core->reg_file[2] = -5;
     core->reg_file[5] = -10;
     core->reg_file[6] = 25;
-    core->data_mem[100] = -100; 
+    memWrite8(core->data_mem, 100, -100); 
 						     */
 
     /* UNCOMMENT TO SET DEFAULT VALUES FOR task_3 */ /*
@@ -76,172 +113,246 @@ Core *initCore(Instruction_Memory *i_mem)
     core->reg_file[2] = -5;
     core->reg_file[5] = -10;
     core->reg_file[6] = 25;
-    core->data_mem[100] = -100; 
+    memWrite8(core->data_mem, 100, -100); 
 						     */
-    return core;
 }
 
 bool tickFunc(Core *core)
 {
     // Clocked components
-    // MEM/WB Registers
-    free(core->wb->ctrl);
-    core->wb->r_mem_data = core->mem->r_mem_data;
-    core->wb->result = core->mem->result;
-    core->wb->ctrl = core->mem->ctrl;
-    core->wb->rd = core->mem->rd;
-    core->wb->PC = core->mem->PC;
-
-    // EX/MEM Registers
-    core->mem->result = core->ex->result;
-    core->mem->w_mem_data = core->ex->w_mem_data;
-    core->mem->ctrl = core->ex->ctrl;
-    core->mem->rd = core->ex->rd;
-    core->mem->PC = core->ex->PC;
-
-    // ID/EX Registers
-    core->ex->ctrl = core->id->ctrl;
-    core->ex->read_data_1 = core->id->read_data_1;
-    core->ex->read_data_2 = core->id->read_data_2;
-    core->ex->imm = core->id->imm;
-    core->ex->rd = (core->id->instruction & (0b11111 << 7)) >> 7;
-    core->ex->rs_1 = (core->id->instruction & (0b11111 << 15)) >> 15;
-    core->ex->rs_2 = (core->id->instruction & (0b11111 << 20)) >> 20;
-    core->ex->funct7 = core->id->funct7;
-    core->ex->funct3 = (core->id->instruction & (0b111 << 12)) >> 12;
-    core->ex->PC = core->id->PC;
-    
-    // IF/ID Registers
-    core->id->instruction = core->instr_fetch->instruction;
-    core->id->PC = core->instr_fetch->prevPC;
+    // The stages read the pipeline registers latched at the last clock edge (cur)
+    // and write the ones that will be latched at the end of this cycle (next)
+    Latches *cur = core->cur;
+    Latches *next = core->next;
 
     
     // The stages are done in reverse order because of the dependence of the earlier stages on the later stages
     // Using C instead of an HDL causes this
     // WB
     int64_t w_data;
-    if(core->wb->ctrl->memToReg)
-	w_data = core->wb->r_mem_data;
+    if(cur->wb.ctrl.memToReg)
+	w_data = cur->wb.r_mem_data;
     else
-	w_data = core->wb->result;
+	w_data = cur->wb.result;
 
-    if(core->wb->rd != 0 && core->wb->ctrl->regWrite)
-	core->reg_file[core->wb->rd] = w_data;
+    if(cur->wb.rd != 0 && cur->wb.ctrl.regWrite)
+	core->reg_file[cur->wb.rd] = w_data;
 
+    if(cur->wb.valid)
+	core->instret++;
 
-    // MEM
-    if(core->mem->ctrl->memWrite)
-	for(int i = 0; i < 8; i++)
-	    core->data_mem[core->mem->result + i] = core->mem->w_mem_data & (255UL << (i * 8));
 
-    if(core->mem->ctrl->memRead)
+    // MEM, an atomic's read and write are one access
+    next->wb.r_mem_data = 0;
+    if(cur->mem.ctrl.atomic)
+	next->wb.r_mem_data = lsuAtomic(core->data_mem, &core->reservation, cur->mem.result, cur->mem.w_mem_data,
+					cur->mem.funct3, cur->mem.funct5);
+    else
     {
-	core->mem->r_mem_data = 0;
-	for(int i = 0; i < 8; i++)
-	    core->mem->r_mem_data |= (uint8_t)(core->data_mem[core->mem->result + i] << (i * 8));
+	if(cur->mem.ctrl.memWrite)
+	    lsuStore(core->data_mem, cur->mem.result, cur->mem.w_mem_data, cur->mem.funct3);
+
+	if(cur->mem.ctrl.memRead)
+	    next->wb.r_mem_data = lsuLoad(core->data_mem, cur->mem.result, cur->mem.funct3);
     }
 
+    // MEM/WB Registers
+    next->wb.result = cur->mem.result;
+    next->wb.ctrl = cur->mem.ctrl;
+    next->wb.rd = cur->mem.rd;
+    next->wb.PC = cur->mem.PC;
+    next->wb.valid = cur->mem.valid;
+
 
     // EX
-    uint8_t fwd = forwardUnit(core->ex->rs_1, core->ex->rs_2, core->mem->rd, core->wb->rd, core->mem->ctrl->regWrite, core->wb->ctrl->regWrite);
     uint8_t zero = 0;
-    uint8_t alu_ctrl;
     int64_t operand_1 = 0;
     int64_t operand_2 = 0;
+#if FORWARDING
+    uint8_t fwd = forwardUnit(cur->ex.rs_1, cur->ex.rs_2, cur->mem.rd, cur->wb.rd, cur->mem.ctrl.regWrite, cur->wb.ctrl.regWrite);
     if(((fwd & (0b11 << 2)) >> 2) == 0b00)
-	operand_1 = core->ex->read_data_1;
+	operand_1 = cur->ex.read_data_1;
     else if(((fwd & (0b11 << 2)) >> 2) == 0b01)
 	operand_1 = w_data;
     else if(((fwd & (0b11 << 2)) >> 2) == 0b10)
-	operand_1 = core->mem->result;
+	operand_1 = cur->mem.result;
 
     if((fwd & 0b11) == 0b00)
-	operand_2 = core->ex->read_data_2;
+	operand_2 = cur->ex.read_data_2;
     else if((fwd & 0b11) == 0b01)
 	operand_2 = w_data;
     else if((fwd & 0b11) == 0b10)
-	operand_2 = core->mem->result;
-
-    core->ex->w_mem_data = operand_2;
-    if(core->ex->ctrl->aluSrc)
-        operand_2 = core->ex->imm;
+	operand_2 = cur->mem.result;
+#else
+    // ID held the instruction back until its sources were written, the register reads are current
+    operand_1 = cur->ex.read_data_1;
+    operand_2 = cur->ex.read_data_2;
+#endif
+
+    next->mem.w_mem_data = operand_2;
+    if(cur->ex.ctrl.aluSrc)
+        operand_2 = cur->ex.imm;
     
 
-    if(core->ex->ctrl->jal || core->ex->ctrl->jalr)
+    if(cur->ex.ctrl.jal || cur->ex.ctrl.jalr)
     {
-	operand_1 = core->ex->PC;
+	operand_1 = cur->ex.PC;
 	operand_2 = 4;
     }
     
-    alu_ctrl = aluControl(core->ex->ctrl->aluOp, core->ex->funct3, core->ex->funct7);
-    alu(operand_1, operand_2, alu_ctrl, &(core->ex->result), &zero);
+    alu(operand_1, operand_2, cur->ex.alu_ctrl, &(next->mem.result), &zero);
+
+#if BRANCH_IN_EX
+    // Branches resolve here, on the forwarded operands
+    uint8_t ex_branch = 0;
+    if((cur->ex.ctrl.beq && (operand_1 == operand_2)) || (cur->ex.ctrl.bne && (operand_1 != operand_2)) ||
+       (cur->ex.ctrl.blt && (operand_1 < operand_2)) || (cur->ex.ctrl.bge && (operand_1 >= operand_2)))
+    {
+	ex_branch = 1;
+    }
+    Addr ex_branch_PC = cur->ex.PC + cur->ex.imm;
+#endif
+
+    // EX/MEM Registers
+    next->mem.ctrl = cur->ex.ctrl;
+    next->mem.funct3 = cur->ex.funct3;
+    next->mem.funct5 = cur->ex.funct5;
+    next->mem.rd = cur->ex.rd;
+    next->mem.PC = cur->ex.PC;
+    next->mem.valid = cur->ex.valid;
 
     
     // ID
-    uint8_t hazard_bit = hazardDetection(core->id->instruction, core->ex->rd, core->ex->ctrl);
+    unsigned instruction = cur->id.instruction;
+    const IsaEntry *entry = isaDecode(instruction);
+#if FORWARDING
+    uint8_t hazard_bit = hazardDetection(instruction, cur->ex.rd, &cur->ex.ctrl);
+#if !BRANCH_IN_EX
+    // Nothing is forwarded into ID, so a branch there waits for its sources to reach WB
+    if(entry != NULL && entry->format == FMT_B)
+	hazard_bit &= rawHazardDetection(instruction, cur->ex.rd, &cur->ex.ctrl, cur->mem.rd, &cur->mem.ctrl);
+#endif
+#else
+    uint8_t hazard_bit = rawHazardDetection(instruction, cur->ex.rd, &cur->ex.ctrl, cur->mem.rd, &cur->mem.ctrl);
+#endif
     uint8_t en_pc = hazard_bit & 0b1; // Leaving the possibility for the hazard detection to do more
     uint8_t if_id_en = (hazard_bit & (0b1 << 1)) >> 1;
     uint8_t ctrl_en = (hazard_bit & (0b1 << 2)) >> 2;
     if(core->done)
 	en_pc = 0;    
     
-    core->id->read_data_1 = core->reg_file[(core->id->instruction & (0b11111 << 15)) >> 15]; 
-    core->id->read_data_2 = core->reg_file[(core->id->instruction & (0b11111 << 20)) >> 20];
-    core->id->imm = buildImm(core->id->instruction);
-
-    core->id->ctrl = malloc(sizeof(ControlSignals));
-    if(ctrl_en)
-	control(core->id->ctrl, (core->id->instruction & 0b1111111), ((core->id->instruction & (0b111 << 12)) >> 12));
-    else
-	memset(core->id->ctrl, 0, sizeof(ControlSignals));
+    next->ex.read_data_1 = core->reg_file[(instruction & (0b11111 << 15)) >> 15]; 
+    next->ex.read_data_2 = core->reg_file[(instruction & (0b11111 << 20)) >> 20];
+    next->ex.imm = buildImm(instruction);
+
+    // Control and ALU Control both come from the instruction's row in the ISA table
+    ControlSignals *ctrl = &next->ex.ctrl;
+    memset(ctrl, 0, sizeof(ControlSignals));
+    next->ex.alu_ctrl = ALU_ADD; // Bubbles and unknown instructions
+    if(ctrl_en && entry != NULL)
+    {
+	*ctrl = entry->ctrl;
+	next->ex.alu_ctrl = entry->alu_ctrl;
+    }
 
     uint8_t branch = 0;
-    if((core->id->ctrl->beq && (core->id->read_data_1 == core->id->read_data_2)) || (core->id->ctrl->bne && (core->id->read_data_1 != core->id->read_data_2)) ||
-       (core->id->ctrl->blt && (core->id->read_data_1 < core->id->read_data_2)) || (core->id->ctrl->bge && (core->id->read_data_1 >= core->id->read_data_2)))
+#if !BRANCH_IN_EX
+    if((ctrl->beq && (next->ex.read_data_1 == next->ex.read_data_2)) || (ctrl->bne && (next->ex.read_data_1 != next->ex.read_data_2)) ||
+       (ctrl->blt && (next->ex.read_data_1 < next->ex.read_data_2)) || (ctrl->bge && (next->ex.read_data_1 >= next->ex.read_data_2)))
     {
 	branch = 1;
     }
+#endif
 
-    if((core->id->instruction & 0b1111111) == 0b0010011)
-	core->id->funct7 = 0;
-    else
-	core->id->funct7 = (core->id->instruction & (0b1111111 << 25)) >> 25;
+    // ID/EX Registers
+    next->ex.rd = (instruction & (0b11111 << 7)) >> 7;
+    next->ex.rs_1 = (instruction & (0b11111 << 15)) >> 15;
+    next->ex.rs_2 = (instruction & (0b11111 << 20)) >> 20;
+    next->ex.funct3 = (instruction & (0b111 << 12)) >> 12;
+    next->ex.funct5 = (instruction & (0b11111 << 27)) >> 27;
+    next->ex.PC = cur->id.PC;
+    next->ex.valid = cur->id.valid && ctrl_en; // A stall sends a bubble down instead
 
     
     // Compute branch and jump PC's
-    unsigned branch_PC = core->id->PC + core->id->imm;
+    unsigned branch_PC = cur->id.PC + next->ex.imm;
     unsigned jump_PC;
 
-    if(core->id->ctrl->jal)
-        jump_PC = core->id->PC + core->id->imm;
-    else if(core->id->ctrl->jalr)
-        jump_PC = core->ex->result;
+    if(ctrl->jal)
+        jump_PC = cur->id.PC + next->ex.imm;
+    else if(ctrl->jalr)
+        jump_PC = next->mem.result;
     
     
+#if BRANCH_IN_EX
+    // A taken branch in EX is older than whatever ID holds, so that gets squashed
+    if(ex_branch)
+    {
+	memset(ctrl, 0, sizeof(ControlSignals));
+	next->ex.alu_ctrl = ALU_ADD;
+	next->ex.valid = 0;
+    }
+#endif
+
+#if BRANCH_STALL
+    // Nothing is fetched past a branch or jump until it has resolved
+    uint8_t unresolved = ctrl->beq || ctrl->bne || ctrl->blt || ctrl->bge || ctrl->jal || ctrl->jalr;
+#if BRANCH_IN_EX
+    unresolved |= cur->ex.ctrl.beq || cur->ex.ctrl.bne || cur->ex.ctrl.blt || cur->ex.ctrl.bge;
+#endif
+#else
+    // Predict not taken, only a taken branch or a jalr throws the fetched instruction away
+    uint8_t unresolved = ctrl->jalr;
+#if BRANCH_IN_EX
+    unresolved |= ex_branch;
+#endif
+#endif
+
     // IF
-    // Set PC to the correct values if it is enabled
-    if(core->done || branch || core->id->ctrl->jalr) // Flush IF/ID on branch
-	core->instr_fetch->instruction = 0b00000000000000000000000000010011; // Insert NOPs to finish up
+    next->id.PC = cur->instr_fetch.PC;  // The instructions won't get the right PC if this isn't set
+    if(core->done || branch || unresolved) // Flush IF/ID on branch
+    {
+	next->id.instruction = 0b00000000000000000000000000010011; // Insert NOPs to finish up
+	next->id.valid = 0;
+    }
     else if(if_id_en)
-	core->instr_fetch->instruction = core->instr_mem->instructions[core->instr_fetch->PC / 4].instruction;
+    {
+	next->id.instruction = imemFetch(core->instr_mem, cur->instr_fetch.PC);
+	next->id.valid = cur->instr_fetch.PC <= core->instr_mem->last_addr;
+    }
+    else
+    {
+	// Stalled, the instruction stays in ID with its own PC
+	next->id.instruction = instruction;
+	next->id.PC = cur->id.PC;
+	next->id.valid = cur->id.valid;
+    }
 
-    core->instr_fetch->prevPC = core->instr_fetch->PC;  // The instructions won't get the right PC if this isn't set
+    // IF/ID Registers
+    // Set PC to the correct values if it is enabled
+    next->instr_fetch.PC = cur->instr_fetch.PC;
+#if BRANCH_IN_EX
+    if(ex_branch)
+	next->instr_fetch.PC = ex_branch_PC;
+    else if(en_pc)
+#else
     if(en_pc)
+#endif
     {
 	if(branch)
-	    core->instr_fetch->PC = branch_PC;
-	else if(core->id->ctrl->jal || core->id->ctrl->jalr)
-	    core->instr_fetch->PC = jump_PC;
-	else
-	    core->instr_fetch->PC += 4;
+	    next->instr_fetch.PC = branch_PC;
+	else if(ctrl->jal || ctrl->jalr)
+	    next->instr_fetch.PC = jump_PC;
+	else if(!(BRANCH_STALL && unresolved)) // Refetch once the branch has resolved
+	    next->instr_fetch.PC += 4;
     }
 
     
     /* UNCOMMENT TO PRINT OUT THE INSTRUCTIONS, REGISTERS, AND DATA MEMORY */
-    printf("\nID Stage Instruction: %u\n", core->id->instruction);
+    printf("\nID Stage Instruction: %u\n", instruction);
     printf("EX Stage rd: %u    rs1: %u    rs2: %u    imm: %d    operand_1: %ld    operand_2: %ld    result: %ld    MEM_DATA: %ld\n",
-	   core->ex->rd, core->ex->rs_1, core->ex->rs_2, core->ex->imm, operand_1, operand_2, core->ex->result, core->ex->w_mem_data);
-    printf("MEM_STAGE MEM_DATA: %ld\n", core->mem->w_mem_data);
+	   cur->ex.rd, cur->ex.rs_1, cur->ex.rs_2, cur->ex.imm, operand_1, operand_2, next->mem.result, next->mem.w_mem_data);
+    printf("MEM_STAGE MEM_DATA: %ld\n", cur->mem.w_mem_data);
     printf("HAZARD BITS: %u\n", hazard_bit);
 									      
 
@@ -256,7 +367,7 @@ bool tickFunc(Core *core)
 	signed long data = 0;
 	for(int j = 0; j < 7; j++)
 	{
-	    data |= core->data_mem[i+j] << (j * 8);
+	    data |= memRead8(core->data_mem, i+j) << (j * 8);
 	}
 	printf("Data Address %d: %ld\n", i, data);
     }
@@ -264,15 +375,19 @@ bool tickFunc(Core *core)
 
     /* UNCOMMENT TO SEE DATA AS UNSIGNED BYTES */ /*
     for(int i = 0; i < NUM_BYTES; i++)
-	printf("Data Address %d: %d\n", i, (int8_t)core->data_mem[i]);
+	printf("Data Address %d: %d\n", i, (int8_t)memRead8(core->data_mem, i));
 						  */
     
     ++core->clk;
+    // Clock edge: this cycle's outputs become next cycle's inputs
+    core->cur = next;
+    core->next = cur;
+
     // Are we reaching the final instruction?
-    if (core->instr_fetch->prevPC > core->instr_mem->last->addr)
+    if (next->id.PC > core->instr_mem->last_addr)
 	core->done = 1;
     
-    if(core->wb->PC > core->instr_mem->last->addr)
+    if(cur->wb.PC > core->instr_mem->last_addr)
 	return false;
     
     return true;
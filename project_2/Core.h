@@ -2,6 +2,8 @@
 #define __CORE_H__
 
 #include "Instruction_Memory.h"
+#include "Lsu.h"
+#include "Memory.h"
 
 #include <stdbool.h>
 #include <stdlib.h>
@@ -15,22 +17,47 @@
 #include "WB.h"
 
 #define NUM_REGS 64
-#define NUM_BYTES 1024
+#define NUM_BYTES 1024 // The stack starts at the top of this, data_mem itself is sparse
 #define BOOL bool
 
+// Pipeline policies, fixed at build time so each variant gets its own tickFunc (see make variants)
+#ifndef FORWARDING
+#define FORWARDING 1 // EX takes its operands from EX/MEM and MEM/WB, ID only stalls on load-use
+#endif
+#ifndef BRANCH_IN_EX
+#define BRANCH_IN_EX 0 // Branches resolve in ID on the register file reads
+#endif
+#ifndef BRANCH_STALL
+#define BRANCH_STALL 0 // Predict not taken and flush, 1 stops fetching until the branch resolves
+#endif
+
+// Every pipeline register, named after the stage that reads it
+typedef struct Latches Latches;
+typedef struct Latches
+{
+    IF instr_fetch;
+    ID id;
+    EX ex;
+    MEM mem;
+    WB wb;
+} Latches;
+
+struct Devices;
+
 struct Core;
 typedef struct Core Core;
 typedef struct Core
 {
     Tick clk; // Keep track of core clock
+    Tick instret; // Instructions retired, bubbles and flushed slots don't count
     Instruction_Memory *instr_mem;
     int64_t reg_file[NUM_REGS];
-    uint8_t data_mem[NUM_BYTES];
-    IF *instr_fetch;
-    ID *id;
-    EX *ex;
-    MEM *mem;
-    WB *wb;
+    Memory *data_mem;
+    Lsu_Reservation reservation; // Left by lr for sc
+    struct Devices *devices; // Mapped into data_mem with -M, freed along with the core
+    Latches latches[2]; // Double-buffered, swapped on every clock edge
+    Latches *cur; // Latched at the last clock edge, read by the stages
+    Latches *next; // Written by the stages, latched at the end of the cycle
     uint8_t done;
 
     // Simulation function
@@ -38,6 +65,9 @@ typedef struct Core
 } Core;
 
 Core *initCore(Instruction_Memory *i_mem);
+void freeCore(Core *core);
+void resetCore(Core *core);
+bool runCore(Core *core);
 bool tickFunc(Core *core);
 
 #endif
@@ -0,0 +1,101 @@
+#include "Devices.h"
+
+static uint64_t uartRead(Mem_Device *device, Addr offset, unsigned size)
+{
+    return offset == UART_LSR ? UART_LSR_IDLE : 0;
+}
+
+static void uartWrite(Mem_Device *device, Addr offset, uint64_t data, unsigned size)
+{
+    Devices *devices = (Devices *)device->ctx;
+    if(offset == UART_THR)
+        fputc((uint8_t)data, devices->console);
+}
+
+static uint64_t timerRead(Mem_Device *device, Addr offset, unsigned size)
+{
+    Devices *devices = (Devices *)device->ctx;
+    return offset == TIMER_COUNT ? *devices->clk : 0;
+}
+
+static void timerWrite(Mem_Device *device, Addr offset, uint64_t data, unsigned size)
+{
+}
+
+static uint64_t exitRead(Mem_Device *device, Addr offset, unsigned size)
+{
+    return 0;
+}
+
+static void exitWrite(Mem_Device *device, Addr offset, uint64_t data, unsigned size)
+{
+    Devices *devices = (Devices *)device->ctx;
+    if(offset != EXIT_STATUS)
+        return;
+
+    devices->exited = true;
+    devices->exit_status = (int64_t)data;
+    fflush(devices->console);
+    memStopRun();
+}
+
+static void exitReset(Mem_Device *device)
+{
+    Devices *devices = (Devices *)device->ctx;
+    devices->exited = false;
+    devices->exit_status = 0;
+}
+
+static void setDevice(Mem_Device *device, const char *name, Addr base, Memory *mem, Devices *devices)
+{
+    memset(device, 0, sizeof(Mem_Device));
+    device->name = name;
+    device->base = base;
+    device->size = 1UL << mem->page_bits;
+    device->ctx = devices;
+}
+
+Devices *initDevices(Memory *mem, const Tick *clk, FILE *console)
+{
+    // NULL when mem can't take devices, flat memory has no page flags
+    Devices *devices = (Devices *)calloc(1, sizeof(Devices));
+    devices->console = console;
+    devices->clk = clk;
+
+    setDevice(&devices->uart, "uart", UART_BASE, mem, devices);
+    devices->uart.read = uartRead;
+    devices->uart.write = uartWrite;
+    setDevice(&devices->timer, "timer", TIMER_BASE, mem, devices);
+    devices->timer.read = timerRead;
+    devices->timer.write = timerWrite;
+    setDevice(&devices->exit, "exit", EXIT_BASE, mem, devices);
+    devices->exit.read = exitRead;
+    devices->exit.write = exitWrite;
+    devices->exit.reset = exitReset;
+
+    if(!memAddDevice(mem, &devices->uart) || !memAddDevice(mem, &devices->timer) || !memAddDevice(mem, &devices->exit))
+    {
+        free(devices);
+        return NULL;
+    }
+    return devices;
+}
+
+void freeDevices(Devices *devices)
+{
+    // After the Memory they were added to
+    free(devices);
+}
+
+void printDeviceStats(Devices *devices)
+{
+    Mem_Device *all[] = { &devices->uart, &devices->timer, &devices->exit };
+    Tick total = 0;
+    for(size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++)
+        total += all[i]->reads + all[i]->writes;
+
+    printf("Device accesses: %lu (", total);
+    for(size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++)
+        printf("%s%s %lu/%lu", i == 0 ? "" : ", ", all[i]->name, all[i]->reads, all[i]->writes);
+    printf(" reads/writes)\n");
+}
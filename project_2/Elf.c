@@ -0,0 +1,159 @@
+#include "Elf.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void badElf(const char *path, const char *why)
+{
+    fprintf(stderr, "%s: %s\n", path, why);
+    exit(EXIT_FAILURE);
+}
+
+static bool inFile(Elf_Image *elf, uint64_t offset, uint64_t size)
+{
+    return offset <= elf->file_size && size <= elf->file_size - offset;
+}
+
+Elf_Image *openElf(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("Cannot open program file. \n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Anything without the magic number is left to the trace parser
+    unsigned char ident[EI_NIDENT];
+    struct stat st;
+    if (pread(fd, ident, EI_NIDENT, 0) != EI_NIDENT || memcmp(ident, ELFMAG, SELFMAG) != 0 || fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    fprintf(stderr, "Loading ELF file: %s\n", path);
+    Elf_Image *elf = (Elf_Image *)calloc(1, sizeof(Elf_Image));
+    elf->fd = fd;
+    elf->file_size = st.st_size;
+    elf->file = mmap(NULL, elf->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (elf->file == MAP_FAILED)
+    {
+        perror("Cannot map ELF file");
+        exit(EXIT_FAILURE);
+    }
+
+    Elf64_Ehdr *header = (Elf64_Ehdr *)elf->file;
+    if (!inFile(elf, 0, sizeof(Elf64_Ehdr)) || ident[EI_CLASS] != ELFCLASS64 || ident[EI_DATA] != ELFDATA2LSB)
+        badElf(path, "not a little-endian ELF64 file");
+    if (header->e_machine != EM_RISCV || header->e_type != ET_EXEC)
+        badElf(path, "not a RISC-V executable");
+    if (header->e_phentsize != sizeof(Elf64_Phdr) || !inFile(elf, header->e_phoff, (uint64_t)header->e_phnum * sizeof(Elf64_Phdr)))
+        badElf(path, "program headers are outside the file");
+
+    elf->entry = header->e_entry;
+    elf->segments = (Elf64_Phdr *)(elf->file + header->e_phoff);
+    elf->num_segments = header->e_phnum;
+    for (unsigned i = 0; i < elf->num_segments; i++)
+    {
+        Elf64_Phdr *segment = &elf->segments[i];
+        if (segment->p_type == PT_LOAD && (!inFile(elf, segment->p_offset, segment->p_filesz) || segment->p_memsz < segment->p_filesz))
+            badElf(path, "a segment is outside the file");
+    }
+
+    // Symbols are optional, a stripped file just has none to look up
+    Elf64_Shdr *sections = (Elf64_Shdr *)(elf->file + header->e_shoff);
+    if (header->e_shentsize != sizeof(Elf64_Shdr) || !inFile(elf, header->e_shoff, (uint64_t)header->e_shnum * sizeof(Elf64_Shdr)))
+        return elf;
+    for (unsigned i = 0; i < header->e_shnum; i++)
+    {
+        Elf64_Shdr *symtab = &sections[i];
+        if (symtab->sh_type != SHT_SYMTAB || symtab->sh_link >= header->e_shnum)
+            continue;
+
+        Elf64_Shdr *strtab = &sections[symtab->sh_link];
+        if (!inFile(elf, symtab->sh_offset, symtab->sh_size) || !inFile(elf, strtab->sh_offset, strtab->sh_size))
+            badElf(path, "the symbol table is outside the file");
+        elf->symbols = (Elf64_Sym *)(elf->file + symtab->sh_offset);
+        elf->num_symbols = symtab->sh_size / sizeof(Elf64_Sym);
+        elf->names = (const char *)(elf->file + strtab->sh_offset);
+        elf->names_size = strtab->sh_size;
+        break;
+    }
+    return elf;
+}
+
+void closeElf(Elf_Image *elf)
+{
+    // Guest memory keeps its own mappings of the segments
+    munmap(elf->file, elf->file_size);
+    close(elf->fd);
+    free(elf);
+}
+
+void elfLoadText(Elf_Image *elf, Instruction_Memory *i_mem)
+{
+    // Instruction memory starts at PC 0 and runs up to the end of the last
+    // executable segment. Whatever is below the code is never touched, so it
+    // costs nothing to link it higher up.
+    Addr end = 0;
+    for (unsigned i = 0; i < elf->num_segments; i++)
+    {
+        Elf64_Phdr *segment = &elf->segments[i];
+        if (segment->p_type != PT_LOAD || !(segment->p_flags & PF_X) || segment->p_filesz == 0)
+            continue;
+        if (segment->p_vaddr > IMEM_MAX_BYTES || segment->p_filesz > IMEM_MAX_BYTES - segment->p_vaddr)
+        {
+            fprintf(stderr, "Code at %#lx is past the end of instruction memory (%#lx bytes)\n", segment->p_vaddr, IMEM_MAX_BYTES);
+            exit(EXIT_FAILURE);
+        }
+        if (segment->p_vaddr + segment->p_filesz > end)
+            end = segment->p_vaddr + segment->p_filesz;
+    }
+
+    // Gaps between segments read as zero, which doesn't decode to anything
+    uint32_t *words = imemAlloc(i_mem, (end + 3) / 4);
+    for (unsigned i = 0; i < elf->num_segments; i++)
+    {
+        Elf64_Phdr *segment = &elf->segments[i];
+        if (segment->p_type != PT_LOAD || !(segment->p_flags & PF_X) || segment->p_filesz == 0)
+            continue;
+        memcpy((uint8_t *)words + segment->p_vaddr, elf->file + segment->p_offset, segment->p_filesz);
+    }
+}
+
+void elfMapSegments(Elf_Image *elf, Memory *mem)
+{
+    // Every PT_LOAD, code included, so the program can read its own constants;
+    // bss past the file is pages nobody has stored to yet
+    for (unsigned i = 0; i < elf->num_segments; i++)
+    {
+        Elf64_Phdr *segment = &elf->segments[i];
+        if (segment->p_type == PT_LOAD)
+            memMapFile(mem, segment->p_vaddr, elf->fd, segment->p_offset, segment->p_filesz, segment->p_memsz - segment->p_filesz);
+    }
+}
+
+Addr elfStackTop(Memory *mem)
+{
+    return mem->base != NULL ? mem->size & ~15UL : ELF_STACK_TOP;
+}
+
+bool elfSymbol(Elf_Image *elf, const char *name, Addr *addr)
+{
+    for (size_t i = 0; i < elf->num_symbols; i++)
+    {
+        Elf64_Sym *symbol = &elf->symbols[i];
+        if (symbol->st_shndx == SHN_UNDEF || symbol->st_name >= elf->names_size)
+            continue;
+        if (strncmp(elf->names + symbol->st_name, name, elf->names_size - symbol->st_name) == 0)
+        {
+            *addr = symbol->st_value;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,36 @@
+#ifndef __ELF_H__
+#define __ELF_H__
+
+#include <elf.h>
+
+#include "Instruction_Memory.h"
+#include "Memory.h"
+
+#define ELF_STACK_TOP 0x80000000UL // sp for paged memory, flat memory starts it at the top of RAM
+
+// An RV64 executable, mmap'd read-only for its headers and symbols. Its PT_LOAD
+// segments are mapped into guest memory from the file rather than copied.
+typedef struct Elf_Image Elf_Image;
+typedef struct Elf_Image
+{
+    int fd;
+    uint8_t *file;
+    size_t file_size;
+    Addr entry;
+
+    Elf64_Phdr *segments;
+    unsigned num_segments;
+    Elf64_Sym *symbols; // NULL if the file is stripped
+    size_t num_symbols;
+    const char *names; // String table of symbols
+    size_t names_size;
+} Elf_Image;
+
+Elf_Image *openElf(const char *path);
+void closeElf(Elf_Image *elf);
+void elfLoadText(Elf_Image *elf, Instruction_Memory *i_mem);
+void elfMapSegments(Elf_Image *elf, Memory *mem);
+Addr elfStackTop(Memory *mem);
+bool elfSymbol(Elf_Image *elf, const char *name, Addr *addr);
+
+#endif
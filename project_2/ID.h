@@ -9,17 +9,11 @@ typedef struct ID
 {
     Addr PC;
     unsigned instruction;
-    ControlSignals *ctrl;
-    int64_t read_data_1;
-    int64_t read_data_2;
-    int16_t imm;
-    uint8_t rd;
-    uint8_t rs_1;
-    uint8_t rs_2;
-    uint8_t funct7;
+    uint8_t valid; // Holds a program instruction, not a bubble or a flushed slot
 } ID;
 
 uint8_t hazardDetection(unsigned int instruction, uint8_t ex_rd, ControlSignals *ctrl);
+uint8_t rawHazardDetection(unsigned int instruction, uint8_t ex_rd, ControlSignals *ex_ctrl, uint8_t mem_rd, ControlSignals *mem_ctrl);
 void control(ControlSignals *ctrl_signals, unsigned opcode, uint8_t funct3);
 int buildImm(unsigned instr);
 
@@ -8,10 +8,12 @@ typedef struct MEM MEM;
 typedef struct MEM
 {
     Addr PC;
-    ControlSignals *ctrl;
+    ControlSignals ctrl;
     int64_t result;
     int64_t w_mem_data;
-    int64_t r_mem_data;
+    uint8_t funct3;
+    uint8_t funct5;
     uint8_t rd;
+    uint8_t valid;
 } MEM;
 #endif
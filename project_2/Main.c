@@ -1,34 +1,99 @@
 #include <stdio.h>
+#include <unistd.h>
 
 #include "Core.h"
 #include "Parser.h"
+#include "Elf.h"
+#include "Devices.h"
 
-int main(int argc, const char *argv[])
-{	
-    if (argc != 2)
+int main(int argc, char *argv[])
+{
+    // -F <MB> runs on flat, guard-paged data memory of that size instead of the
+    // sparse paged one, out-of-range loads and stores are reported as faults.
+    // -M maps the devices in: a UART on stdout, a cycle timer and an exit register.
+    size_t flat_size = 0;
+    bool devices = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "F:M")) != -1)
     {
-        printf("Usage: %s %s\n", argv[0], "<trace-file>");
+        if (opt == 'F')
+            flat_size = strtoul(optarg, NULL, 10) << 20;
+        else if (opt == 'M')
+            devices = true;
+        else
+            optind = argc;
+    }
+
+    // Devices hang off page flags, flat memory has none
+    if (devices && flat_size != 0)
+        optind = argc;
+
+    if (optind != argc - 1)
+    {
+        printf("Usage: %s %s\n", argv[0], "[-F <MB> | -M] <trace-file>");
 
         return 0;
     }
 
     /* Task One */
+    // RV64 ELF executables are loaded as they are, anything else is a text trace
     Instruction_Memory instr_mem;
-    instr_mem.last = NULL;
-    loadInstructions(&instr_mem, argv[1]);
+    initInstructionMemory(&instr_mem);
+    Elf_Image *elf = openElf(argv[optind]);
+    if (elf != NULL)
+        elfLoadText(elf, &instr_mem);
+    else
+        loadInstructions(&instr_mem, argv[optind]);
 
     /* Task Two */
     Core *core = initCore(&instr_mem);
+    if (flat_size != 0)
+    {
+        // Swap the memory before anything runs, resetCore() puts the initial values back
+        freeMemory(core->data_mem);
+        core->data_mem = initFlatMemory(flat_size);
+        resetCore(core);
+    }
+    if (elf != NULL)
+    {
+        elfMapSegments(elf, core->data_mem);
+        core->cur->instr_fetch.PC = elf->entry;
+        core->reg_file[2] = elfStackTop(core->data_mem);
+    }
+    if (devices && (core->devices = initDevices(core->data_mem, &core->clk, stdout)) == NULL)
+    {
+        // Something was loaded over the device pages
+        fprintf(stderr, "Cannot map devices at %#lx\n", UART_BASE);
+        freeCore(core);
+        return EXIT_FAILURE;
+    }
 
     /* Task Three - Simulation */
-    while(core->tick(core));
+    if (!runCore(core))
+    {
+        freeCore(core);
+        return EXIT_FAILURE;
+    }
 
     printf("Simulation is finished.\n");
+    if (core->data_mem->unaligned != 0)
+        printf("Unaligned accesses: %lu\n", core->data_mem->unaligned);
+
+    // The guest's exit status becomes ours
+    int status = EXIT_SUCCESS;
+    if (core->devices != NULL)
+    {
+        printDeviceStats(core->devices);
+        if (core->devices->exited)
+        {
+            printf("Guest exited with status %ld\n", core->devices->exit_status);
+            status = (int)core->devices->exit_status;
+        }
+    }
 
-    free(core->instr_fetch);
-    free(core->id);
-    free(core->ex);
-    free(core->mem);
-    free(core->wb);
-    free(core);    
+    freeCore(core);
+    freeInstructionMemory(&instr_mem);
+    if (elf != NULL)
+        closeElf(elf);
+    return status;
 }
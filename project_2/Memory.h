@@ -0,0 +1,230 @@
+#ifndef __MEMORY_H__
+#define __MEMORY_H__
+
+#include "Instruction.h"
+
+#include <setjmp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define PAGE_BITS 12
+#define HUGE_PAGE_BITS 21 // Transparent huge page sized, backed with madvise(MADV_HUGEPAGE)
+#define NO_PAGE (~(Addr)0) // Never a page number, page numbers are at most 52 bits
+#define FLAT_SPAN (1UL << 32) // Flat memory covers the low 4 GB, anything above faults
+
+// Page attribute bits
+#define PAGE_MAPPED 0x1 // data is inside a Memory_Mapping, not ours to free
+#define PAGE_CODE 0x2 // Marked by memMarkCode()
+#define PAGE_MMIO 0x4 // Belongs to a device, there is no data behind it
+
+// Flat memory's per-page marks
+#define CODE_MARKED 1 // Write-protected, decoded code is on it
+#define CODE_WRITTEN 2 // Stored to since, code_write hasn't been called yet
+
+// What the jump buffer armed by memCatchFaults() is jumped to with
+#define MEM_FAULT 1 // Flat memory was accessed out of range
+#define MEM_STOP 2 // A device asked for the run to end, see memStopRun()
+
+// Sparse 64-bit guest memory. Pages are allocated the first time they are
+// written and found through a hash table keyed by page number, with the last
+// page used cached in front of it. Reading a page that was never written
+// returns zeros without allocating it, so host memory only grows with the
+// pages a program actually stores to.
+//
+// Flat memory instead maps guest RAM as one block at base, inside a reservation
+// covering every 32-bit offset plus a guard page on each side. Everything past
+// size is PROT_NONE, so loads and stores below FLAT_SPAN are a plain base + addr
+// and a stray access turns into a SIGSEGV that memCatchFaults() hands back as a
+// guest access fault. Addresses with any of their upper 32 bits set go the slow
+// way, which faults them without touching the host. Either way the guest
+// address is left in a per-thread slot that memFaultAddr() reads back, nothing
+// shared is written on the way in.
+//
+// memMapFile() puts file contents in either kind without copying them: the file
+// is mmap'd private, so pages are shared with the page cache until stored to.
+//
+// Pages instructions have been decoded from are marked with memMarkCode(). The
+// first store to one calls code_write before it lands and unmarks the page.
+// Paged memory keeps a separate one-entry cache for stores that never holds a
+// marked page, and flat memory write-protects marked pages and catches the
+// fault, so stores to every other page stay on the fast path. The fault handler
+// can't call code_write, nothing it does is safe from a signal, so it only lets
+// the store through and sets code_written. The engines call memCodeWritten()
+// when they see it, before they fetch again.
+//
+// memAddDevice() gives whole pages of paged memory to a device. They are
+// flagged PAGE_MMIO and never enter the page caches, so only the slow path
+// ever sees them and hands the access to the device's callbacks. RAM accesses
+// don't compare against any device's range.
+typedef struct Mem_Device Mem_Device;
+typedef struct Mem_Device
+{
+    const char *name;
+    Addr base; // Page aligned
+    size_t size;
+    uint64_t (*read)(Mem_Device *device, Addr offset, unsigned size);
+    void (*write)(Mem_Device *device, Addr offset, uint64_t data, unsigned size);
+    void (*reset)(Mem_Device *device); // By clearMemory(), may be NULL
+    void *ctx;
+
+    Tick reads; // Since clearMemory()
+    Tick writes;
+    Mem_Device *next;
+} Mem_Device;
+
+typedef struct Memory_Page Memory_Page;
+typedef struct Memory_Page
+{
+    Addr page; // Page number, addr >> page_bits
+    uint8_t *data; // NULL if the slot is empty
+    Mem_Device *device; // Set for PAGE_MMIO
+    uint8_t attrs; // PAGE_* bits
+} Memory_Page;
+
+typedef struct Memory_Mapping Memory_Mapping;
+typedef struct Memory_Mapping
+{
+    Addr addr; // Guest address of host
+    uint8_t *host;
+    size_t len;
+    Memory_Mapping *next;
+} Memory_Mapping;
+
+typedef struct Memory Memory;
+typedef struct Memory
+{
+    // One-entry caches in front of the page table, the JIT reads these directly.
+    // Loads use the first, stores the second.
+    Addr last_page;
+    uint8_t *last_data;
+    Addr write_page;
+    uint8_t *write_data;
+
+    unsigned page_bits;
+    bool huge_pages;
+    Memory_Page *pages; // Open addressing, always a power of two slots
+    size_t num_slots;
+    size_t num_pages;
+
+    uint8_t *base; // Flat guest RAM, NULL for paged memory
+    size_t size;
+    uint8_t *reserve; // base and its guard pages
+    size_t reserve_size;
+    Tick unaligned; // Loads and stores that weren't aligned to their size, since clearMemory(), counted atomically
+
+    Memory_Mapping *mappings; // Dropped by clearMemory()
+    Mem_Device *devices; // Kept by clearMemory(), owned by whoever added them
+
+    // Called with the marked page a store is about to change
+    void (*code_write)(void *ctx, Addr addr, size_t len);
+    void *code_ctx;
+    uint8_t *code; // Flat memory's marks, one per page
+    volatile sig_atomic_t code_written; // Some page is CODE_WRITTEN, translated code reads it too
+} Memory;
+
+Memory *initMemory(bool huge_pages);
+Memory *initFlatMemory(size_t size);
+void freeMemory(Memory *mem);
+void clearMemory(Memory *mem);
+uint8_t *memPage(Memory *mem, Addr addr, bool allocate);
+uint64_t memReadSlow(Memory *mem, Addr addr, unsigned size);
+void memWriteSlow(Memory *mem, Addr addr, uint64_t data, unsigned size);
+uint8_t *memAtomicHost(Memory *mem, Addr addr, unsigned size);
+uint8_t memRead8(Memory *mem, Addr addr);
+void memWrite8(Memory *mem, Addr addr, uint8_t data);
+void memReadBytes(Memory *mem, Addr addr, void *buf, size_t len);
+void memWriteBytes(Memory *mem, Addr addr, const void *buf, size_t len);
+bool memInRange(Memory *mem, Addr addr, size_t len);
+void memMapFile(Memory *mem, Addr addr, int fd, off_t offset, size_t len, size_t zero_len);
+void memMarkCode(Memory *mem, Addr addr);
+void memCodeWritten(Memory *mem);
+bool memAddDevice(Memory *mem, Mem_Device *device);
+void memCatchFaults(Memory *mem, sigjmp_buf *env);
+Addr memFaultAddr(void);
+void memStopRun(void);
+
+// One host load or store of 1, 2, 4 or 8 bytes, size is a constant wherever these inline
+static inline uint64_t hostLoad(const uint8_t *host, unsigned size)
+{
+    uint8_t b;
+    uint16_t h;
+    uint32_t w;
+    uint64_t d;
+    switch(size)
+    {
+    case 1:
+        memcpy(&b, host, sizeof(b));
+        return b;
+    case 2:
+        memcpy(&h, host, sizeof(h));
+        return h;
+    case 4:
+        memcpy(&w, host, sizeof(w));
+        return w;
+    default:
+        memcpy(&d, host, sizeof(d));
+        return d;
+    }
+}
+
+static inline void hostStore(uint8_t *host, uint64_t data, unsigned size)
+{
+    uint8_t b = data;
+    uint16_t h = data;
+    uint32_t w = data;
+    switch(size)
+    {
+    case 1:
+        memcpy(host, &b, sizeof(b));
+        break;
+    case 2:
+        memcpy(host, &h, sizeof(h));
+        break;
+    case 4:
+        memcpy(host, &w, sizeof(w));
+        break;
+    default:
+        memcpy(host, &data, sizeof(data));
+        break;
+    }
+}
+
+// An aligned access can't straddle a page, so one to flat memory below FLAT_SPAN
+// or to the cached page never leaves the caller. Unaligned ones, flat ones above
+// and page misses go the slow way. Loads come back zero-extended.
+static inline uint64_t memRead(Memory *mem, Addr addr, unsigned size)
+{
+    if((addr & (size - 1)) == 0)
+    {
+        if(mem->base != NULL && addr < FLAT_SPAN)
+            return hostLoad(mem->base + addr, size);
+        if((addr >> mem->page_bits) == mem->last_page)
+            return hostLoad(mem->last_data + (addr & ((1UL << mem->page_bits) - 1)), size);
+    }
+
+    return memReadSlow(mem, addr, size);
+}
+
+static inline void memWrite(Memory *mem, Addr addr, uint64_t data, unsigned size)
+{
+    if((addr & (size - 1)) == 0)
+    {
+        if(mem->base != NULL && addr < FLAT_SPAN)
+        {
+            hostStore(mem->base + addr, data, size);
+            return;
+        }
+        if((addr >> mem->page_bits) == mem->write_page)
+        {
+            hostStore(mem->write_data + (addr & ((1UL << mem->page_bits) - 1)), data, size);
+            return;
+        }
+    }
+
+    memWriteSlow(mem, addr, data, size);
+}
+
+#endif
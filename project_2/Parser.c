@@ -1,349 +1,474 @@
 #include "Parser.h"
+#include "TraceCache.h"
 
-void loadInstructions(Instruction_Memory *i_mem, const char *trace)
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PARSE_CHUNK_MIN (256 * 1024) // Traces smaller than this are parsed on the calling thread
+#define PARSE_CHUNKS_PER_THREAD 4 // Chunks are uneven, more of them than threads evens the load out
+
+// Where each operand of a format goes, in the order they are written
+typedef enum Operand
+{
+    OP_RD,
+    OP_RS_1,
+    OP_RS_2,
+    OP_IMM,
+    OP_NONE
+} Operand;
+
+static const Operand OPERANDS[][3] = {
+    [FMT_R]     = { OP_RD,   OP_RS_1, OP_RS_2 }, // add rd, rs1, rs2
+    [FMT_I]     = { OP_RD,   OP_RS_1, OP_IMM  }, // addi rd, rs1, imm
+    [FMT_I_MEM] = { OP_RD,   OP_IMM,  OP_RS_1 }, // ld rd, imm(rs1)
+    [FMT_S]     = { OP_RS_2, OP_IMM,  OP_RS_1 }, // sd rs2, imm(rs1)
+    [FMT_B]     = { OP_RS_1, OP_RS_2, OP_IMM  }, // beq rs1, rs2, imm
+    [FMT_J]     = { OP_RD,   OP_IMM,  OP_NONE }, // jal rd, imm
+    [FMT_AMO]   = { OP_RD,   OP_RS_2, OP_RS_1 }, // amoadd.w rd, rs2, (rs1)
+    [FMT_LR]    = { OP_RD,   OP_RS_1, OP_NONE }, // lr.w rd, (rs1)
+};
+
+// Names point into the trace text, they aren't copied
+typedef struct Parse_Label Parse_Label;
+typedef struct Parse_Label
+{
+    const char *name;
+    size_t len;
+    size_t line; // In its chunk until the labels are merged, then in the trace
+} Parse_Label;
+
+// An instruction whose immediate is a label, encoded once every label is known
+typedef struct Parse_Fixup Parse_Fixup;
+typedef struct Parse_Fixup
+{
+    const IsaEntry *entry;
+    unsigned regs[OP_IMM];
+    const char *name;
+    size_t len;
+    size_t line; // In its chunk
+} Parse_Fixup;
+
+// A run of whole lines, parsed independently of the others
+typedef struct Parse_Chunk Parse_Chunk;
+typedef struct Parse_Chunk
+{
+    const char *begin;
+    const char *end;
+    uint32_t *words; // One per line, 0 for lines that aren't instructions
+    size_t num_lines;
+    size_t size_words;
+    size_t num_instrs_to_last; // Lines up to and including the last instruction
+    Parse_Label *labels;
+    size_t num_labels;
+    size_t size_labels;
+    Parse_Fixup *fixups;
+    size_t num_fixups;
+    size_t size_fixups;
+    size_t first_line; // Of the trace, once every chunk before it is parsed
+
+    size_t error_line; // In the chunk counting from 1, 0 if it parsed
+    char error[128];
+} Parse_Chunk;
+
+// Open addressing over every chunk's labels
+typedef struct Label_Table Label_Table;
+typedef struct Label_Table
+{
+    Parse_Label **slots;
+    size_t num_slots;
+} Label_Table;
+
+// One pass over every chunk, run by a pool of threads taking chunks in turn
+typedef struct Parse_Job Parse_Job;
+typedef struct Parse_Job
 {
-    printf("Loading trace file: %s\n", trace);
+    Parse_Chunk *chunks;
+    size_t num_chunks;
+    atomic_size_t next;
+    Label_Table *labels;
+    void (*pass)(Parse_Job *job, Parse_Chunk *chunk);
+} Parse_Job;
+
+static bool isSeparator(char c)
+{
+    return c == ' ' || c == '\t' || c == ',' || c == '(' || c == ')' || c == '\r';
+}
+
+static const char *nextToken(const char *p, const char *eol, size_t *len)
+{
+    // Tokens run up to a separator, a # comment ends the line
+    while(p < eol && isSeparator(*p))
+        p++;
+    const char *token = p;
+    while(p < eol && *p != '#' && !isSeparator(*p))
+        p++;
+    *len = p - token;
+    return token;
+}
+
+static bool isLabelName(const char *token, size_t len)
+{
+    return len > 0 && (token[0] == '_' || (token[0] >= 'A' && token[0] <= 'Z') || (token[0] >= 'a' && token[0] <= 'z'));
+}
 
-    FILE *fd = fopen(trace, "r");
-    if (fd == NULL)
+static int64_t parseImm(const char *token, size_t len)
+{
+    // Decimal, and like strtol() anything that isn't a number is 0
+    bool negative = len > 0 && token[0] == '-';
+    size_t i = len > 0 && (token[0] == '-' || token[0] == '+');
+    int64_t imm = 0;
+    for(; i < len && token[i] >= '0' && token[i] <= '9'; i++)
+        imm = imm * 10 + (token[i] - '0');
+    return negative ? -imm : imm;
+}
+
+static const IsaEntry *lookupOrdered(const char *token, size_t len, int64_t *ordering)
+{
+    // An atomic with .aq, .rl or .aqrl on the end, the aq and rl bits it asks
+    // for go to isaEncode() as the immediate
+    static const struct { const char *suffix; size_t len; int64_t bits; } ORDERINGS[] = {
+        { ".aqrl", 5, 0b11 },
+        { ".aq",   3, 0b10 },
+        { ".rl",   3, 0b01 },
+    };
+    for(size_t i = 0; i < sizeof(ORDERINGS) / sizeof(ORDERINGS[0]); i++)
+    {
+        if(len <= ORDERINGS[i].len || memcmp(token + len - ORDERINGS[i].len, ORDERINGS[i].suffix, ORDERINGS[i].len) != 0)
+            continue;
+        const IsaEntry *entry = isaLookup(token, len - ORDERINGS[i].len);
+        if(entry == NULL || (entry->format != FMT_AMO && entry->format != FMT_LR))
+            return NULL;
+        *ordering = ORDERINGS[i].bits;
+        return entry;
+    }
+    return NULL;
+}
+
+static void *grow(void *array, size_t *size, size_t elem_size)
+{
+    // Doubling, so a chunk reallocates a handful of times rather than per line
+    *size = *size == 0 ? 64 : *size * 2;
+    array = realloc(array, *size * elem_size);
+    if(array == NULL)
     {
-        perror("Cannot open trace file. \n");
+        perror("Cannot allocate parse buffer");
         exit(EXIT_FAILURE);
     }
+    return array;
+}
 
-    // Iterate all the assembly instructions
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
+static void chunkError(Parse_Chunk *chunk, size_t line, const char *token, size_t len, const char *what)
+{
+    // Only the first one, reported with its trace line number after the pass
+    if(chunk->error_line != 0)
+        return;
+    chunk->error_line = line + 1;
+    snprintf(chunk->error, sizeof(chunk->error), "'%.*s' %s", (int)len, token, what);
+}
 
-    Addr PC = 0; // program counter points to the zeroth location initially.
-    int IMEM_index = 0;
-    while ((read = getline(&line, &len, fd)) != -1)
-    {
-        // Assign program counter
-        i_mem->instructions[IMEM_index].addr = PC;
-
-        // Extract operation
-        char *raw_instr = strtok(line, " ");
-        if (strcmp(raw_instr, "add") == 0 ||
-            strcmp(raw_instr, "sub") == 0 ||
-            strcmp(raw_instr, "sll") == 0 ||
-            strcmp(raw_instr, "srl") == 0 ||
-            strcmp(raw_instr, "xor") == 0 ||
-            strcmp(raw_instr, "or")  == 0 ||
-            strcmp(raw_instr, "and") == 0)
-        {
-            parseRType(raw_instr, &(i_mem->instructions[IMEM_index]));
-            i_mem->last = &(i_mem->instructions[IMEM_index]);
-	    }
-        else if(strcmp(raw_instr, "ld")   == 0 ||
-                strcmp(raw_instr, "addi") == 0 ||
-                strcmp(raw_instr, "slli") == 0 ||
-                strcmp(raw_instr, "xori") == 0 ||
-                strcmp(raw_instr, "srli") == 0 ||
-                strcmp(raw_instr, "ori")  == 0 ||
-                strcmp(raw_instr, "andi") == 0 ||
-                strcmp(raw_instr, "jalr") == 0)
-        {
-            parseIType(raw_instr, &(i_mem->instructions[IMEM_index]));
-            i_mem->last = &(i_mem->instructions[IMEM_index]);
-        }
-        else if(strcmp(raw_instr, "sd") == 0)
-        {
-            parseSType(raw_instr, &(i_mem->instructions[IMEM_index]));
-            i_mem->last = &(i_mem->instructions[IMEM_index]);
-        }
-        else if(strcmp(raw_instr, "beq") == 0 ||
-                strcmp(raw_instr, "bne") == 0 ||
-                strcmp(raw_instr, "blt") == 0 ||
-                strcmp(raw_instr, "bge") == 0)
+static void parseChunk(Parse_Job *job, Parse_Chunk *chunk)
+{
+    // One pass over the chunk's text in place, using nothing but its own buffers
+    const char *p = chunk->begin;
+    while(p < chunk->end && chunk->error_line == 0)
+    {
+        const char *eol = memchr(p, '\n', chunk->end - p);
+        if(eol == NULL)
+            eol = chunk->end;
+        if(chunk->num_lines == chunk->size_words)
+            chunk->words = grow(chunk->words, &chunk->size_words, sizeof(uint32_t));
+        uint32_t *word = &chunk->words[chunk->num_lines];
+        *word = 0;
+
+        // A label names the line it is on
+        size_t len;
+        const char *token = nextToken(p, eol, &len);
+        if(len > 1 && token[len - 1] == ':')
         {
-            parseBType(raw_instr, &(i_mem->instructions[IMEM_index]));
-            i_mem->last = &(i_mem->instructions[IMEM_index]);
+            if(chunk->num_labels == chunk->size_labels)
+                chunk->labels = grow(chunk->labels, &chunk->size_labels, sizeof(Parse_Label));
+            chunk->labels[chunk->num_labels++] = (Parse_Label){ token, len - 1, chunk->num_lines };
+            token = nextToken(token + len, eol, &len);
         }
-        else if(strcmp(raw_instr, "jal") == 0)
+
+        // Extract operation, the ISA table says which operands follow
+        int64_t ordering = 0;
+        const IsaEntry *entry = isaLookup(token, len);
+        if(entry == NULL)
+            entry = lookupOrdered(token, len, &ordering);
+        if(entry != NULL)
         {
-            parseJType(raw_instr, &(i_mem->instructions[IMEM_index]));
-            i_mem->last = &(i_mem->instructions[IMEM_index]);
+            unsigned regs[OP_IMM] = { 0 };
+            int64_t imm = ordering;
+            const char *label = NULL;
+            size_t label_len = 0;
+            const char *imm_token = token;
+            size_t imm_len = len;
+            for(int i = 0; i < 3 && OPERANDS[entry->format][i] != OP_NONE; i++)
+            {
+                token = nextToken(token + len, eol, &len);
+                Operand operand = OPERANDS[entry->format][i];
+                if(operand == OP_IMM && isLabelName(token, len))
+                {
+                    label = token;
+                    label_len = len;
+                }
+                else if(operand == OP_IMM)
+                {
+                    imm = parseImm(token, len);
+                    imm_token = token;
+                    imm_len = len;
+                }
+                else
+                {
+                    // fN and the FP ABI names come back past the 5-bit fields,
+                    // and every instruction in the table takes integer registers
+                    int reg = regIndex(token, len);
+                    if(reg < 0)
+                        chunkError(chunk, chunk->num_lines, token, len, "is not a register");
+                    else if(reg >= FP_REG_BASE)
+                        chunkError(chunk, chunk->num_lines, token, len, "is not an integer register");
+                    regs[operand] = reg;
+                }
+            }
+
+            if(label != NULL)
+            {
+                if(chunk->num_fixups == chunk->size_fixups)
+                    chunk->fixups = grow(chunk->fixups, &chunk->size_fixups, sizeof(Parse_Fixup));
+                chunk->fixups[chunk->num_fixups++] = (Parse_Fixup){ entry, { regs[0], regs[1], regs[2] }, label, label_len, chunk->num_lines };
+            }
+            else if(!isaImmFits(entry, imm))
+                chunkError(chunk, chunk->num_lines, imm_token, imm_len, "does not fit the immediate field");
+            else
+                *word = isaEncode(entry, regs[OP_RD], regs[OP_RS_1], regs[OP_RS_2], imm);
+            chunk->num_instrs_to_last = chunk->num_lines + 1;
         }
 
-        IMEM_index++;
-        PC += 4;
+        chunk->num_lines++;
+        p = eol + 1;
     }
-
-    fclose(fd);
 }
 
-void parseRType(char *opr, Instruction *instr)
+static size_t labelHash(const char *name, size_t len)
 {
-    instr->instruction = 0;
-    unsigned opcode = 0b0110011;
-    unsigned funct3 = 0b000;
-    unsigned funct7 = 0b0000000;
-
-    if(strcmp(opr, "add") == 0) 
-    {
-        funct3 = 0b000;
-    }
-    else if(strcmp(opr, "sub") == 0) 
-    {
-        funct7 = 0b0100000;
-    }
-    else if(strcmp(opr, "sll") == 0) 
-    {
-        funct3 = 0b001;
-    }
-    else if(strcmp(opr, "srl") == 0) 
-    {
-        funct3 = 0b101;
-    }
-    else if(strcmp(opr, "xor") == 0)
-    {
-        funct3 = 0b100;
-    }
-    else if(strcmp(opr, "or")  == 0)
-    {
-        funct3 = 0b110;
-    }
-    else if(strcmp(opr, "and") == 0)
-    {
-        funct3 = 0b111;
-    }
-
-    char *reg = strtok(NULL, ", ");
-    unsigned rd = regIndex(reg);
-
-    reg = strtok(NULL, ", ");
-    unsigned rs_1 = regIndex(reg);
-
-    reg = strtok(NULL, "\n");
-    reg++;
-    unsigned rs_2 = regIndex(reg);
-    
-    // Contruct instruction
-    instr->instruction |= opcode;
-    instr->instruction |= (rd << 7);
-    instr->instruction |= (funct3 << (7 + 5));
-    instr->instruction |= (rs_1 << (7 + 5 + 3));
-    instr->instruction |= (rs_2 << (7 + 5 + 3 + 5));
-    instr->instruction |= (funct7 << (7 + 5 + 3 + 5 + 5));
+    // FNV-1a
+    uint64_t hash = 0xCBF29CE484222325UL;
+    for(size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 0x100000001B3UL;
+    return hash;
 }
 
-void parseIType(char *opr, Instruction *instr)
+static Parse_Label **findLabel(Label_Table *table, const char *name, size_t len)
 {
-    instr->instruction = 0;
-    unsigned opcode = 0b0010011;
-    unsigned funct3 = 0b000;
-
-    if(strcmp(opr, "ld") == 0) 
-    {
-        opcode = 0b0000011;
-        funct3 = 0b011;
-    }
-    else if(strcmp(opr, "addi") == 0) 
-    {
-        funct3 = 0b000;
-    }
-    else if(strcmp(opr, "slli") == 0) 
-    {
-        funct3 = 0b001;
-    }
-    else if(strcmp(opr, "xori") == 0) 
-    {
-        funct3 = 0b100;
-    }
-    else if(strcmp(opr, "srli") == 0)
-    {
-        funct3 = 0b101;
-    }
-    else if(strcmp(opr, "ori")  == 0)
-    {
-        funct3 = 0b110;
-    }
-    else if(strcmp(opr, "andi") == 0)
-    {
-        funct3 = 0b111;
-    }
-    else if(strcmp(opr, "jalr") == 0)
-    {
-        opcode = 0b1100111;
-        funct3 = 0b000;
-    }
-
-    char *reg = strtok(NULL, ", ");
-    unsigned rd = regIndex(reg);
+    size_t slot = labelHash(name, len) & (table->num_slots - 1);
+    while(table->slots[slot] != NULL &&
+          (table->slots[slot]->len != len || memcmp(table->slots[slot]->name, name, len) != 0))
+        slot = (slot + 1) & (table->num_slots - 1);
+    return &table->slots[slot];
+}
 
-    int16_t imm;
-    unsigned rs_1;
-    if(strcmp(opr, "ld") == 0 || strcmp(opr, "jalr") == 0)
+static void resolveChunk(Parse_Job *job, Parse_Chunk *chunk)
+{
+    // Second pass, every label's trace line is known now
+    for(size_t i = 0; i < chunk->num_fixups && chunk->error_line == 0; i++)
     {
-        char *strRemainder;
-        imm = strtol(strtok(NULL, "("), &strRemainder, 10);
+        Parse_Fixup *fixup = &chunk->fixups[i];
+        Parse_Label *label = *findLabel(job->labels, fixup->name, fixup->len);
+        if(label == NULL)
+        {
+            chunkError(chunk, fixup->line, fixup->name, fixup->len, "is not a label");
+            break;
+        }
 
-        reg = strtok(NULL, ")");
-        rs_1 = regIndex(reg);
+        // Branches and jal are relative to their own PC, anything else gets the address
+        int64_t imm = label->line * 4;
+        if(fixup->entry->format == FMT_B || fixup->entry->format == FMT_J)
+            imm -= (int64_t)(chunk->first_line + fixup->line) * 4;
+        if(!isaImmFits(fixup->entry, imm))
+        {
+            chunkError(chunk, fixup->line, fixup->name, fixup->len, "is out of range");
+            break;
+        }
+        chunk->words[fixup->line] = isaEncode(fixup->entry, fixup->regs[OP_RD], fixup->regs[OP_RS_1], fixup->regs[OP_RS_2], imm);
     }
-    else
-    {       
-        reg = strtok(NULL, ", ");
-        rs_1 = regIndex(reg);
+}
 
-        char *strRemainder;
-        imm = strtol(strtok(NULL, "\n"), &strRemainder, 10);
-    }
-    
-    // Construct instruction
-    instr->instruction |= opcode;
-    instr->instruction |= (rd << 7);
-    instr->instruction |= (funct3 << (7 + 5));
-    instr->instruction |= (rs_1 << (7 + 5 + 3));
-    instr->instruction |= (imm << (7 + 5 + 3 + 5));
+static void *parseWorker(void *arg)
+{
+    Parse_Job *job = (Parse_Job *)arg;
+    for(size_t i = atomic_fetch_add(&job->next, 1); i < job->num_chunks; i = atomic_fetch_add(&job->next, 1))
+        job->pass(job, &job->chunks[i]);
+    return NULL;
 }
 
-void parseSType(char *opr, Instruction *instr)
+static void runPass(Parse_Job *job, unsigned num_threads, void (*pass)(Parse_Job *job, Parse_Chunk *chunk))
 {
-    instr->instruction = 0;
-    unsigned opcode = 0b0100011;
-    unsigned funct3 = 0;
+    // The calling thread is one of the pool
+    pthread_t threads[num_threads];
+    job->pass = pass;
+    atomic_store(&job->next, 0);
+    for(unsigned t = 1; t < num_threads; t++)
+        pthread_create(&threads[t], NULL, parseWorker, job);
+    parseWorker(job);
+    for(unsigned t = 1; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+}
 
-    if(strcmp(opr, "sd") == 0)
-    {
-        funct3 = 0b011;
-    }
-    /*
-    else if(strcmp(opr, "add") == 0) 
-    {
-        funct3 = 0b000;
-        funct7 = 0b0000000;
-    }
-    else if(strcmp(opr, "sub") == 0) 
-    {
-        funct3 = 0b000;
-        funct7 = 0b0100000;
-    }
-    else if(strcmp(opr, "sll") == 0) 
-    {
-        funct3 = 0b001;
-        funct7 = 0b0000000;
-    }
-    else if(strcmp(opr, "srl") == 0) 
-    {
-        funct3 = 0b101;
-        funct7 = 0b0000000;
-    }
-    else if(strcmp(raw_instr, "xor") == 0)
-    {
-        funct3 = 0b100;
-        funct7 = 0b0000000;
-    }
-    else if(strcmp(raw_instr, "or")  == 0)
-    {
-        funct3 = 0b110;
-        funct7 = 0b0000000;
-    }
-    else if(strcmp(opr, "and") == 0)
+static void reportErrors(Parse_Job *job)
+{
+    for(size_t c = 0; c < job->num_chunks; c++)
     {
-        funct3 = 0b111;
-        funct7 = 0b0000000;
+        Parse_Chunk *chunk = &job->chunks[c];
+        if(chunk->error_line != 0)
+        {
+            fprintf(stderr, "line %zu: %s\n", chunk->first_line + chunk->error_line, chunk->error);
+            exit(EXIT_FAILURE);
+        }
     }
-    */
-
-    char *reg = strtok(NULL, ", ");
-    unsigned rs_2 = regIndex(reg);
-
-    char *strRemainder;
-    int16_t imm = strtol(strtok(NULL, "("), &strRemainder, 10);
-
-    reg = strtok(NULL, ")");
-    unsigned rs_1 = regIndex(reg);
-
-    // Contruct instruction
-    instr->instruction |= opcode;
-    instr->instruction |= ((imm & 0b11111) << 7);
-    instr->instruction |= (funct3 << (7 + 5));
-    instr->instruction |= (rs_1 << (7 + 5 + 3));
-    instr->instruction |= (rs_2 << (7 + 5 + 3 + 5));
-    instr->instruction |= ((imm & 0b111111100000) << 20); // >> 5 << 7 + 5 + 3 + 5 + 5
 }
 
-void parseBType(char *opr, Instruction *instr)
+size_t parseTrace(Instruction_Memory *i_mem, const char *text, size_t size, unsigned num_threads)
 {
-    instr->instruction = 0;
-    unsigned opcode = 0b1100011;
-    unsigned funct3 = 0b000;
-
-    if(strcmp(opr, "beq") == 0) 
-    {
-        funct3 = 0b000;
-    }
-    else if(strcmp(opr, "bne") == 0) 
-    {
-        funct3 = 0b001;
+    // Split at line boundaries, a few chunks per thread unless the trace is small
+    size_t num_chunks = num_threads * PARSE_CHUNKS_PER_THREAD;
+    if(num_chunks > size / PARSE_CHUNK_MIN)
+        num_chunks = size / PARSE_CHUNK_MIN;
+    if(num_chunks == 0)
+        num_chunks = 1;
+    if(num_threads > num_chunks)
+        num_threads = num_chunks;
+
+    Parse_Job job;
+    job.chunks = (Parse_Chunk *)calloc(num_chunks, sizeof(Parse_Chunk));
+    job.num_chunks = num_chunks;
+    const char *begin = text;
+    for(size_t c = 0; c < num_chunks; c++)
+    {
+        const char *end = text + size * (c + 1) / num_chunks;
+        const char *eol = end < text + size ? memchr(end, '\n', text + size - end) : NULL;
+        end = eol != NULL ? eol + 1 : text + size;
+        if(end < begin)
+            end = begin;
+        job.chunks[c].begin = begin;
+        job.chunks[c].end = end;
+        begin = end;
+    }
+
+    // First pass: every chunk on its own, labels and references to them are only collected
+    runPass(&job, num_threads, parseChunk);
+    size_t num_lines = 0;
+    size_t num_labels = 0;
+    for(size_t c = 0; c < num_chunks; c++)
+    {
+        job.chunks[c].first_line = num_lines;
+        num_lines += job.chunks[c].num_lines;
+        num_labels += job.chunks[c].num_labels;
+    }
+    reportErrors(&job);
+
+    // Merge the labels, now that each chunk's first line is known
+    Label_Table labels;
+    labels.num_slots = 16;
+    while(labels.num_slots < 2 * num_labels)
+        labels.num_slots *= 2;
+    labels.slots = (Parse_Label **)calloc(labels.num_slots, sizeof(Parse_Label *));
+    job.labels = &labels;
+    for(size_t c = 0; c < num_chunks; c++)
+    {
+        Parse_Chunk *chunk = &job.chunks[c];
+        for(size_t i = 0; i < chunk->num_labels; i++)
+        {
+            Parse_Label *label = &chunk->labels[i];
+            label->line += chunk->first_line;
+            Parse_Label **slot = findLabel(&labels, label->name, label->len);
+            if(*slot != NULL)
+            {
+                fprintf(stderr, "line %zu: '%.*s' is already defined on line %zu\n", label->line + 1, (int)label->len, label->name, (*slot)->line + 1);
+                exit(EXIT_FAILURE);
+            }
+            *slot = label;
+        }
     }
-    else if(strcmp(opr, "blt") == 0) 
+
+    // Second pass: fill in the label references
+    runPass(&job, num_threads, resolveChunk);
+    reportErrors(&job);
+
+    // Stitch the chunks together, PC follows the line number. Lines after the
+    // last instruction don't need a word.
+    size_t num_instrs = 0;
+    for(size_t c = 0; c < num_chunks; c++)
     {
-        funct3 = 0b100;
+        if(job.chunks[c].num_instrs_to_last != 0)
+            num_instrs = job.chunks[c].first_line + job.chunks[c].num_instrs_to_last;
     }
-    else if(strcmp(opr, "bge") == 0) 
+    uint32_t *words = imemAlloc(i_mem, num_instrs);
+    for(size_t c = 0; c < num_chunks; c++)
     {
-        funct3 = 0b101;
-    }
-
-    char *reg = strtok(NULL, ", ");
-    unsigned rs_1 = regIndex(reg);
-
-    reg = strtok(NULL, ", ");
-    unsigned rs_2 = regIndex(reg);
+        Parse_Chunk *chunk = &job.chunks[c];
+        if(chunk->first_line < num_instrs && chunk->num_lines != 0)
+        {
+            size_t n = num_instrs - chunk->first_line < chunk->num_lines ? num_instrs - chunk->first_line : chunk->num_lines;
+            memcpy(&words[chunk->first_line], chunk->words, n * sizeof(uint32_t));
+        }
 
-    char *strRemainder;
-    int16_t imm = strtol(strtok(NULL, ", "), &strRemainder, 10);
+        free(chunk->words);
+        free(chunk->labels);
+        free(chunk->fixups);
+    }
+    free(labels.slots);
+    free(job.chunks);
 
-    // Contruct instruction
-    instr->instruction |= opcode;
-    instr->instruction |= ((imm & 0b100000000000) >> 4); // >> 11 << 7
-    instr->instruction |= ((imm & 0b11110) << 7); // >> 1 << 7 + 1
-    instr->instruction |= (funct3 << (7 + 1 + 4));
-    instr->instruction |= (rs_1 << (7 + 1 + 4 + 3));
-    instr->instruction |= (rs_2 << (7 + 1 + 4 + 3 + 5));
-    instr->instruction |= ((imm & 0b11111100000) << 20); // >> 5 << 7 + 1 + 4 + 3 + 5 + 5
-    instr->instruction |= ((imm & 0b1000000000000) << 19); // >> 12 << 7 + 1 + 4 + 3 + 5 + 5 + 6
+    return num_lines;
 }
 
-void parseJType(char *opr, Instruction *instr)
+void loadInstructions(Instruction_Memory *i_mem, const char *trace)
 {
-    instr->instruction = 0;
-    unsigned opcode = 0b0000000;
+    fprintf(stderr, "Loading trace file: %s\n", trace);
 
-    if(strcmp(opr, "jal") == 0) 
+    int fd = open(trace, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
     {
-        opcode = 0b1101111;
+        perror("Cannot open trace file. \n");
+        exit(EXIT_FAILURE);
     }
 
-    char *reg = strtok(NULL, ", ");
-    unsigned rd = regIndex(reg);
-
-    char *strRemainder;
-    int16_t imm = strtol(strtok(NULL, ", "), &strRemainder, 10);
-
-    // Contruct instruction
-    instr->instruction |= opcode;
-    instr->instruction |= (rd << 7);
-    instr->instruction |= (imm & 0b11111111000000000000); // >> 12 << 7 + 5
-    instr->instruction |= ((imm & 0b100000000000) << 9); // >> 11 << 7 + 5 + 8
-    instr->instruction |= ((imm & 0b11111111110) << 20); // >> 1 << 7 + 5 + 8 + 1
-    instr->instruction |= ((imm & 0b100000000000000000000) << 11); // >> 20 << 7 + 5 + 8 + 1 + 10;
-}
-
-int regIndex(char *reg)
-{
-    unsigned i = 0;
-    for (i; i < NUM_OF_REGS; i++)
+    const char *text = NULL;
+    if (st.st_size != 0)
     {
-        if (strcmp(REGISTER_NAME[i], reg) == 0)
+        text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED)
         {
-            break;
+            perror("Cannot map trace file");
+            exit(EXIT_FAILURE);
         }
+        madvise((void *)text, st.st_size, MADV_WILLNEED);
+    }
+    close(fd);
+
+    // Hashing the text is much cheaper than parsing it, an up to date image saves the parse
+    uint64_t hash = hashTrace((const uint8_t *)text, st.st_size);
+    if (!loadTraceCache(i_mem, trace, hash, st.st_size))
+    {
+        unsigned num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        struct timespec start, stop;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        size_t lines = parseTrace(i_mem, text, st.st_size, num_threads);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+        double mb = st.st_size / 1e6;
+        fprintf(stderr, "Parsed %zu lines (%.3f MB) in %.3f ms, %.1f MB/s\n", lines, mb, seconds * 1e3, seconds > 0 ? mb / seconds : 0.0);
+        saveTraceCache(i_mem, trace, hash, st.st_size);
     }
 
-    return i;
+    if (text != NULL)
+        munmap((void *)text, st.st_size);
 }
@@ -4,13 +4,8 @@
 #include <string.h>
 
 #include "Instruction_Memory.h"
+#include "Isa.h"
 #include "Registers.h"
 
 void loadInstructions(Instruction_Memory *i_mem, const char *trace);
-void parseRType(char *opr, Instruction *instr);
-void parseIType(char *opr, Instruction *instr);
-void parseSType(char *opr, Instruction *instr);
-void parseBType(char *opr, Instruction *instr);
-void parseJType(char *opr, Instruction *instr);
-int regIndex(char *reg);
-void trim(char *reg);
+size_t parseTrace(Instruction_Memory *i_mem, const char *text, size_t size, unsigned num_threads);
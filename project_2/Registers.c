@@ -1,5 +1,8 @@
 #include "Registers.h"
 
+#include <stdbool.h>
+#include <string.h>
+
 const char* REGISTER_NAME[NUM_OF_REGS] = {
         "x0",
         "x1",
@@ -67,3 +70,60 @@ const char* REGISTER_NAME[NUM_OF_REGS] = {
         "f31"
 };
 
+// The unnumbered ABI names
+static const struct { const char *name; int index; } ABI_NAMES[] = {
+    { "zero", 0 }, { "ra", 1 }, { "sp", 2 }, { "gp", 3 }, { "tp", 4 }, { "fp", 8 }
+};
+
+// t, s and a followed by n. The integer t and s registers come in two runs,
+// the floating-point ones are the same except that ft is numbered straight.
+static int abiGroupIndex(char group, unsigned n, bool fp)
+{
+    if(group == 'a' && n < 8)
+        return 10 + n;
+    if(group == 's' && n < 2)
+        return 8 + n;
+    if(group == 's' && n < 12)
+        return 16 + n;
+    if(group == 't' && !fp && n < 3)
+        return 5 + n;
+    if(group == 't' && !fp && n < 7)
+        return 25 + n;
+    if(group == 't' && fp && n < 8)
+        return n;
+    if(group == 't' && fp && n < 12)
+        return 20 + n;
+    return -1;
+}
+
+int regIndex(const char *reg, size_t len)
+{
+    // Split off the number at the end, xN and fN are just that number
+    size_t prefix = len;
+    while(prefix > 0 && reg[prefix - 1] >= '0' && reg[prefix - 1] <= '9')
+        prefix--;
+    if(len - prefix > 2)
+        return -1;
+    unsigned n = 0;
+    for(size_t i = prefix; i < len; i++)
+        n = n * 10 + (reg[i] - '0');
+
+    if(prefix < len && prefix == 1 && (reg[0] == 'x' || reg[0] == 'f'))
+        return n < 32 ? (int)n + (reg[0] == 'f' ? FP_REG_BASE : 0) : -1;
+    if(prefix < len && prefix == 1)
+        return abiGroupIndex(reg[0], n, false);
+    if(prefix < len && prefix == 2 && reg[0] == 'f')
+    {
+        int index = abiGroupIndex(reg[1], n, true);
+        return index < 0 ? -1 : index + FP_REG_BASE;
+    }
+    if(prefix < len)
+        return -1;
+
+    for(size_t i = 0; i < sizeof(ABI_NAMES) / sizeof(ABI_NAMES[0]); i++)
+    {
+        if(strlen(ABI_NAMES[i].name) == len && memcmp(ABI_NAMES[i].name, reg, len) == 0)
+            return ABI_NAMES[i].index;
+    }
+    return -1;
+}
@@ -0,0 +1,172 @@
+#include "Simulator.h"
+#include "Parser.h"
+
+static bool exited(Simulator *sim)
+{
+    // Until the next reset, running again would only exit again
+    return sim->core->devices != NULL && sim->core->devices->exited;
+}
+
+static bool finished(Simulator *sim)
+{
+    return sim->instr_mem.num_instrs == 0 || sim->finished;
+}
+
+Simulator *simCreate(void)
+{
+    Simulator *sim = (Simulator *)malloc(sizeof(Simulator));
+    initInstructionMemory(&sim->instr_mem);
+    sim->core = initCore(&sim->instr_mem);
+    sim->finished = false;
+    sim->elf = NULL;
+    return sim;
+}
+
+void simFree(Simulator *sim)
+{
+    freeCore(sim->core);
+    freeInstructionMemory(&sim->instr_mem);
+    if(sim->elf != NULL)
+        closeElf(sim->elf);
+    free(sim);
+}
+
+void simLoad(Simulator *sim, const char *program)
+{
+    if(sim->elf != NULL)
+        closeElf(sim->elf);
+    sim->elf = openElf(program);
+    if(sim->elf != NULL)
+        elfLoadText(sim->elf, &sim->instr_mem);
+    else
+        loadInstructions(&sim->instr_mem, program);
+    simReset(sim);
+}
+
+void simReset(Simulator *sim)
+{
+    resetCore(sim->core);
+    sim->finished = false;
+
+    // resetCore() cleared memory, the segments go back in from the file
+    if(sim->elf != NULL)
+    {
+        elfMapSegments(sim->elf, sim->core->data_mem);
+        sim->core->cur->instr_fetch.PC = sim->elf->entry;
+        sim->core->reg_file[2] = elfStackTop(sim->core->data_mem);
+    }
+}
+
+bool simAttachDevices(Simulator *sim, FILE *console)
+{
+    // Fails on flat memory, and on a second call. The devices stay through
+    // loads and resets, which put the exit register back.
+    if(sim->core->devices != NULL)
+        return false;
+    sim->core->devices = initDevices(sim->core->data_mem, &sim->core->clk, console);
+    return sim->core->devices != NULL;
+}
+
+SimStatus simRunCycles(Simulator *sim, Tick cycles)
+{
+    if(exited(sim))
+        return SIM_EXITED;
+    sigjmp_buf env;
+    int jumped = sigsetjmp(env, 0);
+    if(jumped)
+    {
+        memCatchFaults(sim->core->data_mem, NULL);
+        return jumped == MEM_STOP ? SIM_EXITED : SIM_FAULT;
+    }
+    memCatchFaults(sim->core->data_mem, &env);
+
+    // tickFunc is called directly, no indirect call through core->tick
+    for(Tick i = 0; i < cycles && !finished(sim); i++)
+        sim->finished = !tickFunc(sim->core);
+    memCatchFaults(sim->core->data_mem, NULL);
+    return finished(sim) ? SIM_FINISHED : SIM_STOPPED;
+}
+
+SimStatus simRunUntil(Simulator *sim, SimUntil until, uint64_t value)
+{
+    Core *core = sim->core;
+    if(exited(sim))
+        return SIM_EXITED;
+    sigjmp_buf env;
+    int jumped = sigsetjmp(env, 0);
+    if(jumped)
+    {
+        memCatchFaults(core->data_mem, NULL);
+        return jumped == MEM_STOP ? SIM_EXITED : SIM_FAULT;
+    }
+    memCatchFaults(core->data_mem, &env);
+
+    SimStatus status = SIM_FINISHED;
+    while(!finished(sim))
+    {
+        if((until == UNTIL_PC && core->cur->instr_fetch.PC == value) ||
+           (until == UNTIL_CYCLE && core->clk >= value) ||
+           (until == UNTIL_INSTRET && core->instret >= value))
+        {
+            status = SIM_STOPPED;
+            break;
+        }
+
+        sim->finished = !tickFunc(core);
+    }
+    memCatchFaults(core->data_mem, NULL);
+    return status;
+}
+
+Addr simPC(Simulator *sim)
+{
+    return sim->core->cur->instr_fetch.PC;
+}
+
+Tick simCycles(Simulator *sim)
+{
+    return sim->core->clk;
+}
+
+Tick simInstret(Simulator *sim)
+{
+    return sim->core->instret;
+}
+
+int64_t simReadReg(Simulator *sim, unsigned reg)
+{
+    return reg < NUM_REGS ? sim->core->reg_file[reg] : 0;
+}
+
+void simWriteReg(Simulator *sim, unsigned reg, int64_t value)
+{
+    if(reg != 0 && reg < NUM_REGS)
+        sim->core->reg_file[reg] = value;
+}
+
+bool simReadMem(Simulator *sim, Addr addr, void *buf, size_t len)
+{
+    // Paged memory backs the whole 64-bit space, only flat memory can be out of range
+    if(!memInRange(sim->core->data_mem, addr, len))
+        return false;
+    memReadBytes(sim->core->data_mem, addr, buf, len);
+    return true;
+}
+
+bool simWriteMem(Simulator *sim, Addr addr, const void *buf, size_t len)
+{
+    if(!memInRange(sim->core->data_mem, addr, len))
+        return false;
+    memWriteBytes(sim->core->data_mem, addr, buf, len);
+    return true;
+}
+
+bool simSymbol(Simulator *sim, const char *name, Addr *addr)
+{
+    return sim->elf != NULL && elfSymbol(sim->elf, name, addr);
+}
+
+int64_t simExitCode(Simulator *sim)
+{
+    return exited(sim) ? sim->core->devices->exit_status : 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __SIMULATOR_H__
+#define __SIMULATOR_H__
+
+#include "Core.h"
+#include "Devices.h"
+#include "Elf.h"
+
+// librvsim: drives the simulator in-process instead of through RVSim.
+// A Simulator owns one Core and the instruction memory it runs; loading and
+// resetting reuse both, so a harness can do thousands of runs on one of them.
+
+typedef enum SimUntil
+{
+    UNTIL_PC, // IF is about to fetch from this PC
+    UNTIL_CYCLE, // clk has reached this value
+    UNTIL_INSTRET // This many instructions have retired
+} SimUntil;
+
+typedef enum SimStatus
+{
+    SIM_STOPPED, // Ran out of cycles or met the run-until condition
+    SIM_FINISHED, // Ran off the end of the program
+    SIM_FAULT, // Touched flat memory out of range, the faulting instruction is in MEM
+    SIM_EXITED // Wrote the exit register, simExitCode() has the status
+} SimStatus;
+
+typedef struct Simulator Simulator;
+typedef struct Simulator
+{
+    Instruction_Memory instr_mem;
+    Core *core;
+    bool finished; // tickFunc has drained the pipeline past the last instruction
+    Elf_Image *elf; // NULL when the program is a text trace
+} Simulator;
+
+Simulator *simCreate(void);
+void simFree(Simulator *sim);
+void simLoad(Simulator *sim, const char *program);
+void simReset(Simulator *sim);
+bool simAttachDevices(Simulator *sim, FILE *console);
+SimStatus simRunCycles(Simulator *sim, Tick cycles);
+SimStatus simRunUntil(Simulator *sim, SimUntil until, uint64_t value);
+
+Addr simPC(Simulator *sim);
+Tick simCycles(Simulator *sim);
+Tick simInstret(Simulator *sim);
+int64_t simReadReg(Simulator *sim, unsigned reg);
+void simWriteReg(Simulator *sim, unsigned reg, int64_t value);
+bool simReadMem(Simulator *sim, Addr addr, void *buf, size_t len);
+bool simWriteMem(Simulator *sim, Addr addr, const void *buf, size_t len);
+bool simSymbol(Simulator *sim, const char *name, Addr *addr);
+int64_t simExitCode(Simulator *sim);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef __TRACE_CACHE_H__
+#define __TRACE_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "Instruction_Memory.h"
+
+#define TRACE_CACHE_SUFFIX ".rvbin"
+#define TRACE_CACHE_MAGIC "RVSIMBIN"
+#define TRACE_CACHE_VERSION 4 // Bump whenever the parser would encode a trace differently
+
+// An assembled trace, kept next to it as <trace>.rvbin. The key is a hash of
+// the trace text and of the ISA table, so editing either one makes the image
+// stale and the next load parses the text again and rewrites it.
+typedef struct Trace_Image Trace_Image;
+typedef struct Trace_Image
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_instrs; // Words in the image, last_addr / 4 + 1
+    uint64_t source_hash;
+    uint64_t source_size;
+    Addr entry;
+    Addr last_addr;
+    uint32_t words[];
+} Trace_Image;
+
+uint64_t hashTrace(const uint8_t *text, size_t size);
+bool loadTraceCache(Instruction_Memory *i_mem, const char *trace, uint64_t hash, size_t size);
+void saveTraceCache(Instruction_Memory *i_mem, const char *trace, uint64_t hash, size_t size);
+
+#endif
@@ -8,10 +8,11 @@ typedef struct WB WB;
 typedef struct WB
 {
     Addr PC;
-    ControlSignals *ctrl;
+    ControlSignals ctrl;
     int64_t r_mem_data;
     int64_t result;
     uint8_t rd;
+    uint8_t valid;
 } WB;
 
 #endif